@@ -1,126 +1,662 @@
 #include "AMon.h"
 #include <math.h>
 #include <algorithm>
+#include <future>
+#include <unistd.h>
+#ifdef __linux__
+#	include <pthread.h>
+#endif
+
+thread_local AMonShard *AMon::curshard = NULL;
+
+int getintlist(const config_setting_t *config, std::vector<int> &list)
+{
+	list.clear();
+	if (!config)
+		return 0;
+	if (config_setting_type(config) == CONFIG_TYPE_INT)
+		list.push_back(config_setting_get_int(config));
+	else if (config_setting_is_array(config) || config_setting_is_list(config))
+	{
+		for (int i = 0; i < config_setting_length(config); ++i)
+		{
+			const config_setting_t *elem = config_setting_get_elem(config, i);
+			if (config_setting_type(elem) != CONFIG_TYPE_INT)
+				return -1;
+			list.push_back(config_setting_get_int(elem));
+		}
+	}
+	else
+		return -1;
+	for (int val: list)
+		if (val < 0)
+			return -1;
+	return 0;
+}
+
+int getstrlist(const config_setting_t *config, std::vector<std::string> &list)
+{
+	list.clear();
+	if (!config)
+		return 0;
+	if (config_setting_type(config) == CONFIG_TYPE_STRING)
+		list.push_back(config_setting_get_string(config));
+	else if (config_setting_is_array(config) || config_setting_is_list(config))
+	{
+		for (int i = 0; i < config_setting_length(config); ++i)
+		{
+			const config_setting_t *elem = config_setting_get_elem(config, i);
+			if (config_setting_type(elem) != CONFIG_TYPE_STRING)
+				return -1;
+			list.push_back(config_setting_get_string(elem));
+		}
+	}
+	else
+		return -1;
+	return 0;
+}
+
+int setaffinity(std::thread &thrd, const std::vector<int> &cpus, size_t idx)
+{
+	if (cpus.empty())
+		return 0;
+	int cpu = cpus[idx % cpus.size()];
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (int err = pthread_setaffinity_np(thrd.native_handle(), sizeof(set), &set))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Set affinity to cpu %d failed: %s\n", cpu, strerror(err)), -1);
+	return 0;
+#else
+	PELOG_ERROR_RETURN((PLV_WARNING, "Thread affinity not supported, ignored cpu %d\n", cpu), -1);
+#endif
+}
+
+AMon::AMon(const char *datadir, int shardnum/* = 1*/, size_t qsize/* = 65536*/): datadir(datadir), nstopped(0), npending(0)
+{
+	for (int i = 0; i < shardnum; ++i)
+		shards.push_back(std::make_unique<AMonShard>(this, i, qsize));
+	for (auto &chunk: serieschunks)
+		chunk.store(NULL, std::memory_order_relaxed);
+	static std::atomic<uint64_t> instances{0};
+	instance = ++instances;
+}
+
+AMon::~AMon()
+{
+	for (auto &chunk: serieschunks)
+		delete[] chunk.load(std::memory_order_relaxed);
+}
 
 int AMon::start()
 {
-	if (mainthrd.joinable())
+	if (shards[0]->thrd.joinable())
 		PELOG_ERROR_RETURN((PLV_ERROR, "AMon already running\n"), -1);
-	mainthrd = std::thread(&AMon::mainproc, this);
+	nstopped = 0;
+	npending = 0;
+	readstop = false;
+	replay();
+	// storage cpus are taken by shards first, then readers
+	for (int i = 0; i < readernum; ++i)
+	{
+		readers.push_back(std::thread(&AMon::readproc, this));
+		setaffinity(readers.back(), cpus, shards.size() + i);
+	}
+	for (auto &shard: shards)
+	{
+		shard->thrd = std::thread(&AMon::mainproc, this, shard.get());
+		setaffinity(shard->thrd, cpus, shard->idx);
+	}
+	PELOG_LOG((PLV_INFO, "AMon started with %d shards, %d readers\n", (int)shards.size(), readernum));
 	return 0;
 }
 
 int AMon::stop()
 {
-	if (!mainthrd.joinable())
+	if (!shards[0]->thrd.joinable())
 		return -1;
 	PELOG_LOG((PLV_INFO, "AMon job to stop\n"));
-	taskq.put(std::make_unique<TaskStop>());
-	mainthrd.join();
+	for (auto &shard: shards)
+		shard->taskq.put(std::make_unique<TaskStop>());
+	for (auto &shard: shards)
+		shard->thrd.join();
+	// readers finish queued scans before exiting
+	{
+		std::lock_guard<std::mutex> lock(readmutex);
+		readstop = true;
+		readcond.notify_all();
+	}
+	for (std::thread &reader: readers)
+		reader.join();
+	readers.clear();
+	return flushall();
+}
+
+// write all dirty logs to files in parallel. logs not written before `flushtimeout` are saved to the journal instead,
+// to be replayed on next start
+int AMon::flushall()
+{
+	std::vector<Alog *> logs;
+	for (auto &shard: shards)
+		for (Alog *log: shard->logs)
+			if (log->dirty())
+				logs.push_back(log);
+	if (logs.empty())
+		return 0;
+	auto stime = std::chrono::steady_clock::now();
+	std::atomic<size_t> next{0};
+	std::atomic<size_t> nflushed{0};
+	std::atomic<bool> expired{false};
+	std::vector<uint8_t> flushed(logs.size(), 0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < std::min(flushnum, (int)logs.size()); ++i)
+	{
+		threads.push_back(std::thread([&]() {
+			for (size_t idx; !expired && (idx = next++) < logs.size(); )
+			{
+				if (logs[idx]->flush() == 0)
+					flushed[idx] = 1;
+				++nflushed;
+			}
+		}));
+	}
+	PELOG_LOG((PLV_INFO, "Flushing " PL_SIZET " series with %d threads\n", logs.size(), (int)threads.size()));
+	for (double logsecs = 0; nflushed < logs.size() && !expired; )
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - stime).count();
+		if (flushtimeout > 0 && secs >= flushtimeout)
+			expired = true;
+		else if (secs >= logsecs + 5)
+		{
+			logsecs = secs;
+			PELOG_LOG((PLV_INFO, "Flushed " PL_SIZET "/" PL_SIZET " series\n", (size_t)nflushed, logs.size()));
+		}
+	}
+	for (std::thread &thrd: threads)
+		thrd.join();
+	size_t left = logs.size() - std::count(flushed.begin(), flushed.end(), 1);
+	PELOG_LOG((PLV_INFO, "Flushed " PL_SIZET "/" PL_SIZET " series in %.1fs\n", logs.size() - left, logs.size(),
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - stime).count()));
+	if (left == 0)
+		return 0;
+	// journal the rest
+	std::string jname = datadir + "/" + JOURNAL;
+	std::string tmpname = jname + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if (!fp)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Open journal failed %s, " PL_SIZET " series not saved\n", tmpname.c_str(), left), -1);
+	int ret = 0;
+	for (size_t idx = 0; idx < logs.size(); ++idx)
+		if (!flushed[idx] && logs[idx]->journal(fp) != 0)
+			ret = -1;
+	// on disk before it replaces the final name, so a crash after shutdown leaves no partial journal
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+	{
+		fclose(fp);
+		PELOG_ERROR_RETURN((PLV_ERROR, "Sync journal failed %s\n", tmpname.c_str()), -1);
+	}
+	if (fclose(fp) != 0 || rename(tmpname.c_str(), jname.c_str()) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write journal failed %s\n", jname.c_str()), -1);
+	PELOG_LOG((PLV_WARNING, "Flush timed out, " PL_SIZET " series saved to journal %s\n", left, jname.c_str()));
+	return ret;
+}
+
+// write values in the shutdown journal left by flushall(), if any. called before shard threads start
+int AMon::replay()
+{
+	std::string jname = datadir + "/" + JOURNAL;
+	FILE *fp = fopen(jname.c_str(), "rb");
+	if (!fp)
+		return 0;
+	std::string name;
+	StoreType type;
+	std::vector<uint32_t> times;
+	std::vector<float> values;
+	size_t nseries = 0;
+	int res;
+	while ((res = Alog::readjournal(fp, name, type, times, values)) > 0)
+	{
+		Alog *log = getlog(*shards[shardof(name)], name, type);
+		if (log->backfill(times.data(), values.data(), times.size()) != 0 || log->backfillend() != 0)
+			PELOG_LOG((PLV_ERROR, "Replay journal failed %s\n", name.c_str()));
+		++nseries;
+	}
+	fclose(fp);
+	PELOG_LOG((res < 0 ? PLV_ERROR : PLV_INFO, "Replayed " PL_SIZET " series from journal %s%s\n", nseries, jname.c_str(),
+		res < 0 ? ", the rest is corrupted" : ""));
+	// keep a corrupted journal for inspection
+	if (res < 0 && rename(jname.c_str(), (jname + ".bad").c_str()) != 0 || res >= 0 && remove(jname.c_str()) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Remove journal failed %s\n", jname.c_str()), -1);
 	return 0;
 }
 
-void AMon::mainproc()
+void AMon::mainproc(AMonShard *shard)
 {
-	PELOG_LOG((PLV_VERBOSE, "AMon job started\n"));
-	bool running = true;
-	while (running)
+	PELOG_LOG((PLV_VERBOSE, "AMon job %d started\n", shard->idx));
+	curshard = shard;
+	shard->outbox.resize(shards.size());
+	shard->pending = std::vector<std::deque<std::unique_ptr<Task>>>(shards.size());
+	// run until TaskStop, then keep serving values from other shards until all shards have received TaskStop and
+	// sent all their pending tasks. shards flush their outboxes after each batch, so no more values are on the way after that
+	constexpr size_t BATCH = 64;
+	std::vector<std::unique_ptr<Task>> tasks;
+	tasks.reserve(BATCH);
+	bool stopping = false;
+	while (!stopping || nstopped < (int)shards.size() || npending > 0)
 	{
-		std::unique_ptr<Task> t = taskq.get();
-		switch (t->type)
+		bool waitsend = std::any_of(shard->pending.begin(), shard->pending.end(),
+			[](const std::deque<std::unique_ptr<Task>> &q) { return !q.empty(); });
+		shard->taskq.get_many(tasks, BATCH, std::chrono::milliseconds(waitsend ? 1 : stopping ? 10 : 1000));
+		tick(*shard);
+		for (std::unique_ptr<Task> &t: tasks)
 		{
-		case Task::TT_STOP:
-			running = false;
-			break;
-		case Task::TT_WRITE:
+			if (t->type == Task::TT_STOP)
+			{
+				if (!stopping)
+					nstopped++;
+				stopping = true;
+				continue;
+			}
+			process(*shard, std::move(t));
+		}
+		tasks.clear();
+		flushoutbox(*shard);
+	}
+	while (std::unique_ptr<Task> t = shard->taskq.tryget())
+		if (t->type != Task::TT_STOP)
+			process(*shard, std::move(t));
+	flushoutbox(*shard);
+	curshard = NULL;
+	PELOG_LOG((PLV_VERBOSE, "AMon job %d finished\n", shard->idx));
+}
+
+void AMon::process(AMonShard &shard, std::unique_ptr<Task> &&t)
+{
+	// spread incoming reads from shard 0 over all shards
+	if (shard.idx == 0 && shards.size() > 1 && t->type == Task::TT_READ)
+	{
+		nextshard = (nextshard + 1) % shards.size();
+		// process locally if the target is full, so overload backs up into the input queue where it is shed
+		if (nextshard != 0 && shards[nextshard]->taskq.tryput(t))
+			return;
+	}
+	switch (t->type)
+	{
+	case Task::TT_ADD:
+	{
+		TaskAdd *task = (TaskAdd *)t.get();
+		for (const TaskAdd::Value &val: task->values)
+			if (getlog(shard, val.name, val.type)->addv(val.time, val.value, val.type) != 0)
+				PELOG_LOG((PLV_WARNING, "AMon add value failed %s\n", val.name.c_str()));
+		if (!task->points.empty())
 		{
-			TaskWrite *task = (TaskWrite *)t.get();
-			if (task->process(this) != 0)
-				PELOG_LOG((PLV_WARNING, "AMon process write failed\n"));
-			break;
+			thread_local std::vector<size_t> idx;
+			idx.clear();
+			for (size_t i = 0; i < task->points.size(); ++i)
+				idx.push_back(i);
+			addlocal(shard, task->points.data(), idx);
 		}
-		case Task::TT_READ:
+		break;
+	}
+	case Task::TT_READ:
+	{
+		std::unique_ptr<TaskRead> task((TaskRead *)t.release());
+		if (task->parsereq(task.get()) != 0)
 		{
-			TaskRead *task = (TaskRead *)t.get();
-			int res = 0;
-			if ((res = task->parsereq(task)) != 0)
-				PELOG_LOG((PLV_WARNING, "AMon process read parsereq failed\n"));
-			if (res == 0 && (res = getdata(task)) != 0)
-				PELOG_LOG((PLV_WARNING, "AMon process read failed\n"));
-			if (task->response(task) != 0)
+			PELOG_LOG((PLV_WARNING, "AMon process read parsereq failed\n"));
+			if (task->response(task.get()) != 0)
 				PELOG_LOG((PLV_WARNING, "AMon process read response failed\n"));
-			break;
 		}
-		default:
-			PELOG_LOG((PLV_ERROR, "AMon unexpected task %d\n", t->type));
-			break;
+		else
+			getdata(std::move(task));
+		break;
+	}
+	case Task::TT_CALL:
+		((TaskCall *)t.get())->func(shard);
+		break;
+	default:
+		PELOG_LOG((PLV_ERROR, "AMon unexpected task %d\n", t->type));
+		break;
+	}
+}
+
+// queue a task to shard `to`. shard threads never block on a full queue, as the target may be blocked sending
+// to this shard as well. the task is kept in `pending` instead, and retried by flushoutbox()
+void AMon::send(size_t to, std::unique_ptr<Task> &&task)
+{
+	if (!curshard)
+	{
+		shards[to]->taskq.put(std::move(task));
+		return;
+	}
+	std::deque<std::unique_ptr<Task>> &pending = curshard->pending[to];
+	if (pending.empty() && shards[to]->taskq.tryput(task))
+		return;
+	pending.push_back(std::move(task));
+	npending++;
+}
+
+// send values added for series of other shards, and retry pending tasks
+void AMon::flushoutbox(AMonShard &shard)
+{
+	for (size_t i = 0; i < shard.outbox.size(); ++i)
+	{
+		if (shard.outbox[i])
+			send(i, std::move(shard.outbox[i]));
+		std::deque<std::unique_ptr<Task>> &pending = shard.pending[i];
+		for (; !pending.empty() && shards[i]->taskq.tryput(pending.front()); npending--)
+			pending.pop_front();
+	}
+}
+
+// periodical jobs, called at least once per second
+void AMon::tick(AMonShard &shard)
+{
+	uint32_t curtime = (uint32_t)time(NULL);
+	if (curtime == shard.ticktime)
+		return;
+	// scrub data files in background, at most `scrubrate` bytes per second in total of all shards
+	if (scrubrate > 0 && !shard.logs.empty())
+	{
+		size_t budget = std::max((size_t)1, scrubrate / shards.size()) * std::min(curtime - shard.ticktime, 10u);
+		while (budget > 0)
+		{
+			if (shard.logs[shard.scrubidx]->scrub(budget) == 1 && ++shard.scrubidx >= shard.logs.size())
+			{
+				shard.scrubidx = 0;	// a whole pass finished, continue on next tick
+				break;
+			}
+		}
+	}
+	if (shard.idx == 0 && !selfprefix.empty())
+		selfstats(curtime);
+	shard.ticktime = curtime;
+}
+
+// store metrics of AMon itself once per step of the self series. called on shard 0
+void AMon::selfstats(uint32_t curtime)
+{
+	int32_t step = alogconf.schema(selfprefix.c_str()).steps[0];
+	uint32_t stime = curtime - curtime % step;
+	if (stime == selftime)
+		return;
+	uint32_t elapsed = selftime ? stime - selftime : step;
+	selftime = stime;
+	// queueing delay per lane, of all shards
+	for (int lane = 0; lane < TaskQueue::LANENUM; ++lane)
+	{
+		TaskQueue::LaneStat total;
+		for (auto &shard: shards)
+		{
+			TaskQueue::LaneStat stat = shard->taskq.getstat((TaskQueue::Lane)lane);
+			total.count += stat.count;
+			total.delaysum += stat.delaysum;
+			total.delaymax = std::max(total.delaymax, stat.delaymax);
+			total.depth += stat.depth;
 		}
+		std::string name = selfprefix + ".queue." + TaskQueue::lanename((TaskQueue::Lane)lane) + ".";
+		addv((name + "tasks").c_str(), stime, (double)total.count / elapsed, AMON_AUINT);	// per second
+		addv((name + "delay").c_str(), stime, total.count ? total.delaysum / 1000.0 / total.count : 0, AMON_FP16);	// ms
+		addv((name + "delay_max").c_str(), stime, total.delaymax / 1000.0, AMON_FP16);
+		addv((name + "depth").c_str(), stime, (double)total.depth, AMON_FP16);
+	}
+	// writes dropped by load shedding
+	uint64_t dropped = 0;
+	bool shedding = false;
+	for (auto &shard: shards)
+	{
+		dropped += shard->taskq.getdropped();
+		shedding = shedding || shard->taskq.isshedding();
+	}
+	addv((selfprefix + ".ingest.dropped").c_str(), stime, (double)dropped / elapsed, AMON_AUINT);	// values per second
+	addv((selfprefix + ".ingest.shedding").c_str(), stime, shedding ? 1 : 0, AMON_AUINT);
+	// counters of workers
+	std::lock_guard<std::mutex> lock(selfmutex);
+	for (SelfCounter &counter: selfcounters)
+	{
+		uint64_t cur = counter.counter->load(std::memory_order_relaxed);
+		addv((selfprefix + "." + counter.name).c_str(), stime, (double)(cur - counter.last) / elapsed, counter.type);
+		counter.last = cur;
 	}
-	PELOG_LOG((PLV_VERBOSE, "AMon job finished\n"));
 }
 
-int AMon::getdata(TaskRead *task)
+void AMon::addcounter(const std::string &name, const std::atomic<uint64_t> *counter, StoreType type)
 {
-	if (task->aggr >= 0 && task->aggr < TaskRead::AMON_AGGRNUM)
-		return doaggr(task);
-	return doread(task);
+	std::lock_guard<std::mutex> lock(selfmutex);
+	selfcounters.push_back(SelfCounter{name, counter, counter->load(std::memory_order_relaxed), type});
 }
 
-int AMon::doread(TaskRead *task)
+// find log by name and load it from file if not in memory yet. AMON_NULL `type` only loads existing logs
+// must be called on the owning shard of `name`
+Alog *AMon::getlog(AMonShard &shard, const std::string &name, StoreType type)
 {
-	uint32_t curtime = time(NULL);
-	const int maxnum = 500;
-	task->step = Alog::getrangeparam(task->start, task->end, curtime, maxnum);
-	if (task->step == 0)	// start >= end, no valid data range
-		return 0;
-	int datalen = (task->end - task->start) / task->step;
-	task->datatime.resize(datalen);
-	task->databuf.resize(datalen * task->names.size());
-	for (uint32_t curtime = task->start, idx = 0; curtime < task->end; curtime += task->step, ++idx)
-		task->datatime[idx] = curtime;
-	for (size_t iname = 0; iname < task->names.size(); ++iname)
+	assert(shardof(name) == (size_t)shard.idx);
+	auto ilog = shard.data.find(name);
+	if (ilog != shard.data.end())
+		return ilog->second.get();
+	std::unique_ptr<Alog> plog = std::make_unique<Alog>(&alogconf);
+	if (plog->init(datadir.c_str(), name.c_str(), type) != 0 && type == AMON_NULL)
+		return NULL;
+	Alog *log = plog.get();
+	shard.data.emplace(name, std::move(plog));
+	shard.logs.push_back(log);
+	return log;
+}
+
+// log by interned id, through the dense table of the shard
+Alog *AMon::getlog(AMonShard &shard, SeriesId id, StoreType type)
+{
+	if (id < shard.byid.size() && shard.byid[id])
+		return shard.byid[id];
+	Alog *log = getlog(shard, series(id).name, type);
+	if (log)
 	{
-		float *databuf = task->databuf.data() + iname * datalen;
-		auto idata = data.find(task->names[iname]);
-		if (idata == data.end())	// try load log data if not found in memory
+		if (id >= shard.byid.size())
+			shard.byid.resize(id + 1);
+		shard.byid[id] = log;
+	}
+	return log;
+}
+
+// run `func` on each shard with the indexes of its part of `names`, and then `done` on the shard finishing last
+void AMon::fanout(const std::vector<std::vector<size_t>> &names, std::function<void (AMonShard &, const std::vector<size_t> &)> &&func,
+	std::function<void ()> &&done)
+{
+	struct Job
+	{
+		std::vector<std::vector<size_t>> names;
+		std::function<void (AMonShard &, const std::vector<size_t> &)> func;
+		std::function<void ()> done;
+		std::atomic<int> remain;
+	};
+	auto job = std::make_shared<Job>();
+	job->names = names;
+	job->func = std::move(func);
+	job->done = std::move(done);
+	job->remain = 1;	// hold by the caller until all calls are sent
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		if (names[i].empty())
+			continue;
+		job->remain++;
+		send(i, std::make_unique<TaskCall>([job](AMonShard &shard) {
+			job->func(shard, job->names[shard.idx]);
+			if (--job->remain == 0)
+				job->done();
+		}));
+	}
+	if (--job->remain == 0)
+		job->done();
+}
+
+// read logs of `names` (indexes of task->names, grouped by shard) with `func`, and then `done` after all.
+// logs are looked up on their owning shards, and then read on the reader pool if any, or on the shards otherwise.
+// `func` is called with NULL log for missing series
+void AMon::scan(std::shared_ptr<TaskRead> task, const std::vector<std::vector<size_t>> &names,
+	std::function<void (size_t iname, const Alog *log)> &&func, std::function<void ()> &&done)
+{
+	struct Job
+	{
+		std::function<void (size_t, const Alog *)> func;
+		std::function<void ()> done;
+		std::atomic<int> remain;
+	};
+	auto job = std::make_shared<Job>();
+	job->func = std::move(func);
+	job->done = std::move(done);
+	job->remain = 1;	// released after all shards have passed their parts on
+	fanout(names, [this, task, job](AMonShard &shard, const std::vector<size_t> &names) {
+		typedef std::vector<std::pair<size_t, const Alog *>> Logs;
+		Logs logs;
+		for (size_t iname: names)
+			logs.emplace_back(iname, getlog(shard, task->names[iname], AMON_NULL));
+		if (readers.empty())
+		{
+			for (const auto &log: logs)
+				job->func(log.first, log.second);
+			return;
+		}
+		// split among readers
+		size_t partlen = (logs.size() + readers.size() - 1) / readers.size();
+		std::lock_guard<std::mutex> lock(readmutex);
+		for (size_t bpos = 0; bpos < logs.size(); bpos += partlen)
+		{
+			auto part = std::make_shared<Logs>(logs.begin() + bpos, logs.begin() + std::min(bpos + partlen, logs.size()));
+			job->remain++;
+			readjobs.push_back([job, part]() {
+				for (const auto &log: *part)
+					job->func(log.first, log.second);
+				if (--job->remain == 0)
+					job->done();
+			});
+		}
+		readcond.notify_all();
+	}, [job]() {
+		if (--job->remain == 0)
+			job->done();
+	});
+}
+
+void AMon::readproc()
+{
+	PELOG_LOG((PLV_VERBOSE, "AMon reader started\n"));
+	while (true)
+	{
+		std::function<void ()> job;
+		{
+			std::unique_lock<std::mutex> lock(readmutex);
+			readcond.wait(lock, [this] { return readstop || !readjobs.empty(); });
+			if (readjobs.empty())
+				break;
+			job = std::move(readjobs.front());
+			readjobs.pop_front();
+		}
+		job();
+	}
+	PELOG_LOG((PLV_VERBOSE, "AMon reader finished\n"));
+}
+
+void AMon::getdata(std::unique_ptr<TaskRead> &&task)
+{
+	std::shared_ptr<TaskRead> ptask(std::move(task));
+	if (ptask->aggr >= 0 && ptask->aggr < TaskRead::AMON_AGGRNUM)
+		doaggr(ptask);
+	else
+		doread(ptask);
+}
+
+// read in 2 rounds on the owning shards of the series: the level steps to determine a common step, and then the data
+void AMon::doread(std::shared_ptr<TaskRead> task)
+{
+	struct Job
+	{
+		std::vector<std::vector<size_t>> names;	// indexes of task->names on each shard
+		uint32_t curtime;
+		std::mutex mutex;
+		int32_t lvstep = 0;
+	};
+	auto job = std::make_shared<Job>();
+	job->names.resize(shards.size());
+	for (size_t iname = 0; iname < task->names.size(); ++iname)
+		job->names[shardof(task->names[iname])].push_back(iname);
+	job->curtime = time(NULL);
+	fanout(job->names, [this, task, job](AMonShard &shard, const std::vector<size_t> &names) {
+		for (size_t iname: names)
 		{
-			std::unique_ptr<Alog> plog = std::make_unique<Alog>();
-			if(plog->init(datadir.c_str(), task->names[iname].c_str(), AMON_NULL) == 0)
-				idata = data.emplace(task->names[iname], std::move(plog)).first;
+			const Alog *log = getlog(shard, task->names[iname], AMON_NULL);
+			if (!log)
+				continue;
+			int32_t step = log->levelstep(task->start, job->curtime);
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->lvstep = Alog::commonstep(job->lvstep, step);
 		}
-		if (idata != data.end())
+	}, [this, task, job]() {
+		const int maxnum = 500;
+		task->step = Alog::getrangeparam(task->start, task->end, job->curtime, job->lvstep, maxnum);
+		if (task->step == 0)	// start >= end, no valid data range
 		{
-			idata->second->getrange(task->start, task->end, task->step, databuf);
-			if (task->aggr == TaskRead::AMON_CURRENT)	// fill recent values if missing
+			if (task->response(task.get()) != 0)
+				PELOG_LOG((PLV_WARNING, "AMon process read response failed\n"));
+			return;
+		}
+		int datalen = (task->end - task->start) / task->step;
+		task->datatime.resize(datalen);
+		task->databuf.resize(datalen * task->names.size());
+		task->coverbuf.resize(task->coverage ? task->databuf.size() : 0);
+		for (uint32_t curtime = task->start, idx = 0; curtime < task->end; curtime += task->step, ++idx)
+			task->datatime[idx] = curtime;
+		scan(task, job->names, [task, datalen](size_t iname, const Alog *log) {
+			float *databuf = task->databuf.data() + iname * datalen;
+			float *coverbuf = task->coverage ? task->coverbuf.data() + iname * datalen : NULL;
+			if (log)
 			{
-				for (int idx = datalen - 1; idx >= 0; --idx)
+				log->getrange(task->start, task->end, task->step, databuf, coverbuf);
+				if (task->aggr == TaskRead::AMON_CURRENT)	// fill recent values if missing
 				{
-					if (!isnan(databuf[idx]))
+					for (int idx = datalen - 1; idx >= 0; --idx)
 					{
-						for (int fidx = idx + 1; fidx < datalen; ++fidx)
-							databuf[fidx] = databuf[idx];
-						break;
+						if (!isnan(databuf[idx]))
+						{
+							for (int fidx = idx + 1; fidx < datalen; ++fidx)
+							{
+								databuf[fidx] = databuf[idx];
+								if (coverbuf)
+									coverbuf[fidx] = coverbuf[idx];
+							}
+							break;
+						}
 					}
 				}
 			}
-		}
-		else
-		{
-			std::for_each(databuf, databuf + datalen, [](float &d){ d = NAN; });
-			PELOG_LOG((PLV_WARNING, "No data %s\n", task->names[iname].c_str()));
-		}
-	}
-	return 0;
+			else
+			{
+				std::for_each(databuf, databuf + datalen, [](float &d){ d = NAN; });
+				if (coverbuf)
+					std::fill(coverbuf, coverbuf + datalen, 0.0f);
+				PELOG_LOG((PLV_WARNING, "No data %s\n", task->names[iname].c_str()));
+			}
+		}, [task]() {
+			if (task->response(task.get()) != 0)
+				PELOG_LOG((PLV_WARNING, "AMon process read response failed\n"));
+		});
+	});
 }
 
-int AMon::doaggr(TaskRead *task)
+void AMon::doaggr(std::shared_ptr<TaskRead> task)
 {
 	constexpr int32_t tzoff = 3600 * 8;	// Default TZ GMT+8
 	constexpr int32_t weekoff = 86400 * 4 + tzoff;	// epoch is (86400 * 4(Thursday) + tzoff) in TZ
 	task->datatime.clear();
 	task->databuf.clear();
+	task->coverbuf.clear();
 	if (task->start < 86400 * 7 - weekoff || task->end < task->start)
-		return 0;
+	{
+		if (task->response(task.get()) != 0)
+			PELOG_LOG((PLV_WARNING, "AMon process read response failed\n"));
+		return;
+	}
 	// fix the aggr level if not approperate
 	static constexpr int32_t aggrsteps[] = { 60, 3600, 86400, 86400 * 7, 86400 * 30, 86400 * 365 };
 	static_assert(TaskRead::AMON_AGGRNUM == sizeof(aggrsteps) / sizeof(aggrsteps[0]), "aggrsteps not match");
@@ -183,39 +719,253 @@ int AMon::doaggr(TaskRead *task)
 		}
 	}	// else if (task->aggr == TaskRead::AMON_MONTH || task->aggr == TaskRead::AMON_YEAR)
 	// now datatime contains 1 more element at the end specifying end of the last aggr range, which MUST be removed before return
-	// fill data
+	// fill data on the owning shards
 	int datalen = task->datatime.size() - 1;
 	task->databuf.resize(datalen * task->names.size());
+	task->coverbuf.resize(task->coverage ? task->databuf.size() : 0);
+	std::vector<std::vector<size_t>> byshard(shards.size());
 	for (size_t iname = 0; iname < task->names.size(); ++iname)
-	{
+		byshard[shardof(task->names[iname])].push_back(iname);
+	scan(task, byshard, [task, datalen](size_t iname, const Alog *log) {
 		float *databuf = task->databuf.data() + iname * datalen;
-		auto idata = data.find(task->names[iname]);
-		if (idata == data.end())	// try load log data if not found in memory
-		{
-			std::unique_ptr<Alog> plog = std::make_unique<Alog>();
-			if(plog->init(datadir.c_str(), task->names[iname].c_str(), AMON_NULL) == 0)
-				idata = data.emplace(task->names[iname], std::move(plog)).first;
-		}
-		if (idata != data.end())
-			idata->second->aggrrange(task->datatime, databuf);
+		float *coverbuf = task->coverage ? task->coverbuf.data() + iname * datalen : NULL;
+		if (log)
+			log->aggrrange(task->datatime, databuf, coverbuf);
 		else
 		{
 			std::for_each(databuf, databuf + datalen, [](float &d){ d = 0; });
+			if (coverbuf)
+				std::fill(coverbuf, coverbuf + datalen, 0.0f);
 			PELOG_LOG((PLV_WARNING, "No data %s\n", task->names[iname].c_str()));
 		}
+	}, [task]() {
+		task->datatime.pop_back();	// remove the temporary extra element in datatime
+		if (task->response(task.get()) != 0)
+			PELOG_LOG((PLV_WARNING, "AMon process read response failed\n"));
+	});
+}
+
+int AMon::addv(const char *name, uint32_t time, double value, StoreType type)
+{
+	std::string sname = name;
+	size_t owner = shardof(sname);
+	if (curshard && (size_t)curshard->idx == owner)
+		return getlog(*curshard, sname, type)->addv(time, value, type);
+	// queue to the owning shard
+	std::unique_ptr<TaskAdd> local;
+	std::unique_ptr<TaskAdd> &task = curshard ? curshard->outbox[owner] : local;
+	if (!task)
+		task = std::make_unique<TaskAdd>();
+	task->values.push_back(TaskAdd::Value{std::move(sname), time, value, type});
+	if (!curshard)
+		shards[owner]->taskq.put(std::move(local));
+	return 0;
+}
+
+namespace
+{
+// ids looked up by current thread, so steady state lookups take no lock
+struct SeriesCache
+{
+	uint64_t instance = 0;	// of the AMon
+	std::unordered_map<std::string, SeriesId> ids;
+};
+thread_local SeriesCache seriescache;
+}
+
+SeriesId AMon::intern(const std::string &name)
+{
+	if (seriescache.instance != instance)
+	{
+		seriescache.ids.clear();
+		seriescache.instance = instance;
+	}
+	auto icache = seriescache.ids.find(name);
+	if (icache != seriescache.ids.end())
+		return icache->second;
+	std::unique_lock<std::mutex> lock(seriesmutex);
+	auto iid = seriesids.find(name);
+	int32_t step = 0;
+	if (iid == seriesids.end())
+	{
+		// step of the existing file, which may differ from the current schema. resolved without holding the lock
+		lock.unlock();
+		step = loadstep(name, AMON_NULL);
+		lock.lock();
+		iid = seriesids.find(name);
+	}
+	if (iid == seriesids.end())
+	{
+		SeriesId id = (SeriesId)seriesids.size();
+		if (id / SERIESCHUNK >= SERIESMAXCHUNK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Too many series to intern %s\n", name.c_str()), AMON_NOSERIES);
+		Series *chunk = serieschunks[id / SERIESCHUNK].load(std::memory_order_relaxed);
+		if (!chunk)
+		{
+			chunk = new Series[SERIESCHUNK];
+			serieschunks[id / SERIESCHUNK].store(chunk, std::memory_order_release);
+		}
+		Series &series = chunk[id % SERIESCHUNK];
+		series.name = name;
+		series.shard = shardof(name);
+		series.step = step;
+		iid = seriesids.emplace(name, id).first;
 	}
-	task->datatime.pop_back();	// remove the temporary extra element in datatime
+	seriescache.ids.emplace(name, iid->second);
+	return iid->second;
+}
+
+int AMon::addv(SeriesId id, uint32_t time, double value, StoreType type)
+{
+	if (id == AMON_NOSERIES)
+		return -1;
+	size_t owner = series(id).shard;
+	if (curshard && (size_t)curshard->idx == owner)
+		return getlog(*curshard, id, type)->addv(time, value, type);
+	// queue to the owning shard
+	std::unique_ptr<TaskAdd> local;
+	std::unique_ptr<TaskAdd> &task = curshard ? curshard->outbox[owner] : local;
+	if (!task)
+		task = std::make_unique<TaskAdd>();
+	task->points.push_back(SeriesPoint{id, time, value, type});
+	if (!curshard)
+		shards[owner]->taskq.put(std::move(local));
 	return 0;
 }
 
-int AMon::addv(const char *name, uint32_t time, double value, StoreType type)
+int AMon::addv_batch(const SeriesPoint *points, size_t n)
+{
+	if (!curshard)
+	{
+		// not on a shard thread, queue all values to their owning shards
+		std::vector<std::unique_ptr<TaskAdd>> tasks(shards.size());
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (points[i].id == AMON_NOSERIES)
+				continue;
+			std::unique_ptr<TaskAdd> &task = tasks[series(points[i].id).shard];
+			if (!task)
+				task = std::make_unique<TaskAdd>();
+			task->points.push_back(points[i]);
+		}
+		for (size_t owner = 0; owner < tasks.size(); ++owner)
+			if (tasks[owner])
+				shards[owner]->taskq.put(std::move(tasks[owner]));
+		return 0;
+	}
+	// values of other shards go to the outbox, local ones are written now
+	thread_local std::vector<size_t> idx;
+	idx.clear();
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (points[i].id == AMON_NOSERIES)
+			continue;
+		size_t owner = series(points[i].id).shard;
+		if (owner == (size_t)curshard->idx)
+		{
+			idx.push_back(i);
+			continue;
+		}
+		std::unique_ptr<TaskAdd> &task = curshard->outbox[owner];
+		if (!task)
+			task = std::make_unique<TaskAdd>();
+		task->points.push_back(points[i]);
+	}
+	addlocal(*curshard, points, idx);
+	return 0;
+}
+
+bool AMon::Outbox::add(const SeriesPoint *points, size_t n, uint32_t source)
+{
+	std::fill(admitted.begin(), admitted.end(), 0);
+	bool ret = true;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (points[i].id == AMON_NOSERIES)
+			continue;
+		size_t owner = amon->series(points[i].id).shard;
+		if (admitted[owner] == 0)	// shed by the queue of the owning shard, once per source and shard
+			admitted[owner] = amon->shards[owner]->taskq.admit(source) ? 1 : -1;
+		if (admitted[owner] < 0)
+		{
+			ret = false;
+			continue;
+		}
+		std::unique_ptr<TaskAdd> &task = tasks[owner];
+		if (!task)
+		{
+			task = std::make_unique<TaskAdd>();
+			task->points.reserve(sizes[owner]);
+		}
+		task->points.push_back(points[i]);
+	}
+	return ret;
+}
+
+void AMon::Outbox::flush()
 {
-	auto ilog = data.find(name);
-	if (ilog == data.end())
+	for (size_t owner = 0; owner < tasks.size(); ++owner)
 	{
-		ilog = data.emplace(name, std::make_unique<Alog>()).first;
-		ilog->second->init(datadir.c_str(), name, type);
+		if (!tasks[owner])
+			continue;
+		sizes[owner] = tasks[owner]->points.size();
+		if (!amon->shards[owner]->taskq.offer(std::move(tasks[owner])))
+			PELOG_LOG((PLV_DEBUG, "Dropped " PL_SIZET " values of shard " PL_SIZET ", task queue full\n", sizes[owner], owner));
 	}
-	return ilog->second->addv(time, value, type);
 }
 
+// write `points[idx]` of series owned by `shard`, grouped by series keeping their order
+void AMon::addlocal(AMonShard &shard, const SeriesPoint *points, std::vector<size_t> &idx)
+{
+	std::sort(idx.begin(), idx.end(), [points](size_t a, size_t b) {
+		return points[a].id != points[b].id ? points[a].id < points[b].id : a < b;
+	});
+	thread_local std::vector<uint32_t> times;
+	thread_local std::vector<float> values;
+	for (size_t i = 0, e = 0; i < idx.size(); i = e)
+	{
+		const SeriesPoint &first = points[idx[i]];
+		times.clear();
+		values.clear();
+		const int32_t step = series(first.id).step;
+		for (e = i; e < idx.size() && points[idx[e]].id == first.id; ++e)
+		{
+			const SeriesPoint &point = points[idx[e]];
+			for (uint32_t time = point.time - point.fill / step * step; time <= point.time; time += step)
+			{
+				times.push_back(time);
+				values.push_back((float)point.value);
+			}
+		}
+		if (getlog(shard, first.id, first.type)->addv_batch(times.data(), values.data(), times.size(), first.type) != 0)
+			PELOG_LOG((PLV_WARNING, "AMon add values failed %s\n", series(first.id).name.c_str()));
+	}
+}
+
+int32_t AMon::getstep(const char *name, StoreType type)
+{
+	return loadstep(name, type);
+}
+
+// level 0 step of the log of `name`, as loaded from its file, or by the schema if there is no file. resolved on the
+// owning shard, waiting for it when called off the shard threads
+int32_t AMon::loadstep(const std::string &name, StoreType type)
+{
+	auto resolve = [this, &name, type](AMonShard &shard) {
+		// a new series has no file to load yet
+		if (type == AMON_NULL && shard.data.find(name) == shard.data.end() &&
+				access((datadir + "/" + name).c_str(), F_OK) != 0)
+			return alogconf.schema(name.c_str()).steps[0];
+		Alog *log = getlog(shard, name, type);
+		return log ? log->step0() : alogconf.schema(name.c_str()).steps[0];
+	};
+	size_t owner = shardof(name);
+	if (curshard && (size_t)curshard->idx == owner)
+		return resolve(*curshard);
+	assert(!curshard);	// shards waiting on each other would deadlock
+	std::promise<int32_t> step;
+	shards[owner]->taskq.put(std::make_unique<TaskCall>([&step, &resolve](AMonShard &shard) {
+		step.set_value(resolve(shard));
+	}));
+	return step.get_future().get();
+}
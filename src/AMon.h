@@ -6,15 +6,38 @@
 #include <mutex>
 #include <thread>
 #include <condition_variable>
+#include <chrono>
 #include <assert.h>
 #include <new>
 #include <vector>
 #include <unordered_map>
+#include <string.h>
+#include <atomic>
 #include "pe_log.h"
+#include "libconfig/libconfig.h"
 
 // common defs
-#define AMON_MINSTEP 5
+#define AMON_MINSTEP 1	// smallest level 0 step supported
+#define AMON_DEFSTEP 5	// level 0 step of the default schema
 enum StoreType { AMON_NULL = -1, AMON_AUINT = 0, AMON_FP16 = 1 };
+// non-negative integer list config (an int or an array / list of ints), e.g. cpus for thread affinity. empty if `config` is NULL
+int getintlist(const config_setting_t *config, std::vector<int> &list);
+// string list config (a string or an array / list of strings). empty if `config` is NULL
+int getstrlist(const config_setting_t *config, std::vector<std::string> &list);
+// pin `thrd` to cpus[idx % cpus.size()], nothing if `cpus` is empty
+int setaffinity(std::thread &thrd, const std::vector<int> &cpus, size_t idx);
+// series name interned by AMon::intern(), valid for the life of AMon
+typedef uint32_t SeriesId;
+#define AMON_NOSERIES ((SeriesId)-1)
+// a value of an interned series, see AMon::addv_batch()
+struct SeriesPoint
+{
+	SeriesId id;
+	uint32_t time;
+	double value;
+	StoreType type;
+	uint32_t fill;	// seconds before `time` also set to `value`, at level 0 steps of the series. 0 for one value
+};
 class AMon;
 
 #include "Alog.h"
@@ -25,31 +48,15 @@ struct Task
 	enum Type
 	{
 		TT_UNK,
-		TT_WRITE,
 		TT_READ,
 		TT_STOP,
+		TT_ADD,
+		TT_CALL,
 		RR_READ,
 	} type = TT_UNK;
+	int64_t qtime = 0;	// time queued, in us of steady clock
 	virtual ~Task() { /*fprintf(stderr, "dtor Task %p\n", this);*/ }
 };
-// write task
-#pragma warning(disable : 4200)
-struct TaskWrite: public Task
-{
-	std::function<int (const uint8_t *data, size_t size, AMon *amon)> processor;
-	size_t dsize = 0;	// size of `data`
-	uint8_t data[];
-	static std::unique_ptr<TaskWrite> alloc(size_t dsize)
-	{
-		TaskWrite *p = (TaskWrite *)operator new(sizeof(TaskWrite) + sizeof(TaskWrite::data[0]) * dsize);
-		new(p) TaskWrite();
-		p->dsize = dsize;
-		return std::unique_ptr<TaskWrite>(p);
-	}
-	int process(AMon *amon) { return processor(data, dsize, amon); }
-protected:
-	TaskWrite() { type = TT_WRITE; /*fprintf(stderr, "ctor TaskWrite %p\n", this);*/ }
-};
 // read task
 struct TaskRead: public Task
 {
@@ -73,9 +80,11 @@ struct TaskRead: public Task
 		AMON_AGGRNUM,
 		AMON_CURRENT,
 	} aggr = AMON_NOAGGR;
+	bool coverage = false;	// also return coverage of values
 	// result
 	int32_t step = 0;
 	std::vector<float> databuf;
+	std::vector<float> coverbuf;	// fraction of level 0 steps having values, same layout as databuf. only if coverage is set
 	std::vector<uint32_t> datatime;
 };
 #if !defined(__cpp_lib_make_unique) && !defined(_MSC_VER)
@@ -92,51 +101,469 @@ struct TaskStop: public Task
 {
 	TaskStop() { type = TT_STOP; }
 };
+class AMonShard;
+// values to be added by the shard owning the series
+struct TaskAdd: public Task
+{
+	TaskAdd() { type = TT_ADD; }
+	struct Value
+	{
+		std::string name;
+		uint32_t time;
+		double value;
+		StoreType type;
+	};
+	std::vector<Value> values;
+	std::vector<SeriesPoint> points;	// values of interned series
+};
+// job to run on a shard
+struct TaskCall: public Task
+{
+	TaskCall(std::function<void (AMonShard &)> &&func): func(std::move(func)) { type = TT_CALL; }
+	std::function<void (AMonShard &)> func;
+};
+// bounded lock-free multi-producer single-consumer ring of tasks
+// producers claim cells by CAS on `head` and publish them with the cell sequence (Vyukov's bounded queue),
+// the only consumer takes cells in order
+class TaskRing
+{
+public:
+	TaskRing(size_t capacity = 65536)
+	{
+		for (mask = 1; mask < capacity; mask <<= 1)
+			;
+		cells = std::unique_ptr<Cell[]>(new Cell[mask]);
+		for (size_t i = 0; i < mask; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		mask -= 1;
+	}
+	~TaskRing()
+	{
+		while (Task *task = take())
+			delete task;
+	}
+	// return false if full
+	bool put(Task *task)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+		Cell *cell;
+		while (true)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = head.load(std::memory_order_relaxed);
+		}
+		cell->task = task;
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	// consumer only. next task without taking it, or NULL if empty
+	const Task *peek() const
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		const Cell *cell = &cells[pos & mask];
+		return cell->seq.load(std::memory_order_acquire) == pos + 1 ? cell->task : NULL;
+	}
+	// consumer only
+	Task *take()
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Cell *cell = &cells[pos & mask];
+		if (cell->seq.load(std::memory_order_acquire) != pos + 1)
+			return NULL;
+		Task *task = cell->task;
+		cell->task = NULL;
+		cell->seq.store(pos + mask + 1, std::memory_order_release);
+		tail.store(pos + 1, std::memory_order_relaxed);
+		return task;
+	}
+	// approximate number of tasks
+	size_t size() const
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t t = tail.load(std::memory_order_relaxed);
+		return h > t ? h - t : 0;
+	}
+	size_t capacity() const { return mask + 1; }
+private:
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		Task *task = NULL;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t mask = 0;
+	char pad0[64];
+	std::atomic<size_t> head{0};	// next cell to put, shared by producers
+	char pad1[64];
+	std::atomic<size_t> tail{0};	// next cell to take, only changed by the consumer
+	char pad2[64];
+};
+
+// task queue of a shard, with separate lanes for reads and writes so queries are not queued behind ingest backlog.
+// the consumer picks the lane of the next task by `Sched` policy, spins shortly on empty before parking on a
+// condition variable, and producers only touch the mutex when the consumer is parked. spin length adapts to whether
+// spinning has been paying off recently. `put()` blocks while the lane is full, `tryput()` fails instead, and
+// `offer()` sheds incoming writes by `Shed` policy when the write lane is getting full
 class TaskQueue
 {
 public:
-	TaskQueue() { }
+	enum Lane { LANE_READ, LANE_WRITE, LANENUM };
+	struct Sched
+	{
+		enum Policy
+		{
+			QS_STRICT,	// reads always first
+			QS_WEIGHTED,	// up to `weights[lane]` tasks from each non-empty lane in turn
+			QS_DEADLINE,	// earliest of (queued time + `deadlines[lane]`) first
+		} policy = QS_WEIGHTED;
+		int weights[LANENUM] = { 4, 1 };
+		int deadlines[LANENUM] = { 50, 1000 };	// ms
+	};
+	struct Shed
+	{
+		enum Policy
+		{
+			SHED_NONE,	// never drop, block the producer while full
+			SHED_NEWEST,	// drop all incoming writes
+			SHED_SOURCE,	// drop writes of sources sending more than the average recently
+			SHED_SAMPLE,	// keep 1 of `sample` incoming writes
+		} policy = SHED_NEWEST;
+		// shedding starts when the write lane has `high` tasks, and stops when it falls below `low`
+		size_t high = 0;
+		size_t low = 0;
+		int sample = 4;
+	};
+	// queueing delay of a lane since last getstat()
+	struct LaneStat
+	{
+		uint64_t count = 0;
+		uint64_t delaysum = 0;	// us
+		uint64_t delaymax = 0;	// us
+		size_t depth = 0;	// current number of queued tasks
+	};
+	TaskQueue(size_t capacity = 65536)
+	{
+		for (int i = 0; i < LANENUM; ++i)
+			lanes[i].reset(new TaskRing(capacity));
+		shed.high = lanes[LANE_WRITE]->capacity() / 10 * 8;
+		shed.low = lanes[LANE_WRITE]->capacity() / 2;
+		for (auto &cnt: srccount)
+			cnt.store(0, std::memory_order_relaxed);
+	}
 	~TaskQueue() { }
+	// call before any task is queued
+	void setsched(const Sched &sched) { this->sched = sched; }
+	void setshed(const Shed &shed) { this->shed = shed; }
+	static Lane laneof(const Task *task) { return task->type == Task::TT_READ || task->type == Task::TT_CALL ? LANE_READ : LANE_WRITE; }
 	void stop() { putfront(std::make_unique<TaskStop>()); }
 	void put(std::unique_ptr<Task> &&task)
 	{
-		std::lock_guard<std::mutex> lock(mutex);
-		tasks.push_back(std::move(task));
-		cond.notify_all();
+		for (int spin = 0; !tryput(task); ++spin)
+		{
+			if (spin < FULLSPIN)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			// wait for the consumer to take some. the timeout covers the unfenced check in gettask()
+			std::unique_lock<std::mutex> lock(mutex);
+			nfullwait++;
+			fullcond.wait_for(lock, std::chrono::milliseconds(1));
+			nfullwait--;
+		}
+	}
+	// put `task` if its lane is not full. on success `task` is moved away and true is returned
+	bool tryput(std::unique_ptr<Task> &task)
+	{
+		task->qtime = now();
+		if (!lanes[laneof(task.get())]->put(task.get()))
+			return false;
+		task.release();
+		wake();
+		return true;
+	}
+	// put a write task received from `source`, or drop it when overloaded. never blocks unless policy is SHED_NONE.
+	// return false if dropped
+	bool offer(std::unique_ptr<Task> &&task, uint32_t source)
+	{
+		return admit(source) && offer(std::move(task));
+	}
+	// put a write task already admitted, dropped if the queue is full
+	bool offer(std::unique_ptr<Task> &&task)
+	{
+		if (shed.policy == Shed::SHED_NONE)
+		{
+			put(std::move(task));
+			return true;
+		}
+		if (tryput(task))
+			return true;
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		droptotal.fetch_add(1, std::memory_order_relaxed);
+		return false;
 	}
+	// shedding decision for a write from `source`, counted as dropped if refused
+	bool admit(uint32_t source)
+	{
+		if (shed.policy == Shed::SHED_NONE)
+			return true;
+		std::atomic<uint32_t> &srccnt = srccount[(source * 2654435761u) >> 24];
+		uint32_t cnt = srccnt.fetch_add(1, std::memory_order_relaxed) + 1;
+		srctotal.fetch_add(1, std::memory_order_relaxed);
+		decaysources();
+		// start or stop shedding by watermarks
+		size_t depth = lanes[LANE_WRITE]->size();
+		bool shedding = this->shedding.load(std::memory_order_relaxed);
+		if (shedding != (shedding ? depth >= shed.low : depth >= shed.high) && this->shedding.exchange(!shedding) == shedding)
+		{
+			shedding = !shedding;
+			PELOG_LOG((shedding ? PLV_WARNING : PLV_INFO, "Task queue %s shedding writes, depth " PL_SIZET ", " PL_SIZET " dropped so far\n",
+				shedding ? "start" : "stop", depth, (size_t)droptotal.load(std::memory_order_relaxed)));
+		}
+		bool drop = false;
+		if (shedding)
+		{
+			if (shed.policy == Shed::SHED_NEWEST)
+				drop = true;
+			else if (shed.policy == Shed::SHED_SOURCE)
+				drop = (uint64_t)cnt * srcactive.load(std::memory_order_relaxed) > srctotal.load(std::memory_order_relaxed);
+			else if (shed.policy == Shed::SHED_SAMPLE)
+				drop = sampleseq.fetch_add(1, std::memory_order_relaxed) % shed.sample != 0;
+		}
+		if (!drop)
+			return true;
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		droptotal.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	// number of writes dropped by offer() since last call
+	uint64_t getdropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+	// state is only updated on offer(), so also check depth in case writes stopped coming in while shedding
+	bool isshedding() const { return shedding.load(std::memory_order_relaxed) && lanes[LANE_WRITE]->size() >= shed.low; }
+	// put before all queued tasks. only for rare control tasks, so a plain locked list is used
 	void putfront(std::unique_ptr<Task> &&task)
 	{
-		std::lock_guard<std::mutex> lock(mutex);
-		tasks.push_front(std::move(task));
-		cond.notify_all();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			front.push_front(std::move(task));
+			nfront.store(front.size(), std::memory_order_release);
+		}
+		wake();
 	}
 	std::unique_ptr<Task> get()
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		cond.wait(lock, [this] { return !tasks.empty(); });
-		assert(!tasks.empty() && lock.owns_lock());
-		std::unique_ptr<Task> task = std::move(tasks.front());
-		tasks.pop_front();
+		std::unique_ptr<Task> task;
+		while (!(task = tryget()))
+			wait(std::chrono::milliseconds(1000));
 		return task;
 	}
-	std::unique_ptr<Task> tryget()
+	// wait at most `timeout` for a task. return NULL on timeout
+	std::unique_ptr<Task> get(std::chrono::milliseconds timeout)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		if (tasks.empty())
-			return NULL;
-		std::unique_ptr<Task> task = std::move(tasks.front());
-		tasks.pop_front();
+		std::unique_ptr<Task> task = tryget();
+		if (!task && wait(timeout))
+			task = tryget();
 		return task;
 	}
-	bool empty()
+	// append at most `max` tasks to `tasks`, waiting at most `timeout` for the first one. return number of tasks got
+	size_t get_many(std::vector<std::unique_ptr<Task>> &tasks, size_t max, std::chrono::milliseconds timeout)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		return tasks.empty();
+		size_t num = 0;
+		for (bool waited = false; true; waited = true)
+		{
+			for (; num < max; ++num)
+			{
+				std::unique_ptr<Task> task = tryget();
+				if (!task)
+					break;
+				tasks.push_back(std::move(task));
+			}
+			if (num > 0 || waited || !wait(timeout))
+				return num;
+		}
 	}
+	std::unique_ptr<Task> tryget()
+	{
+		if (nfront.load(std::memory_order_acquire) > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!front.empty())
+			{
+				std::unique_ptr<Task> task = std::move(front.front());
+				front.pop_front();
+				nfront.store(front.size(), std::memory_order_release);
+				return task;
+			}
+		}
+		return std::unique_ptr<Task>(gettask());
+	}
+	bool empty() const { return size() == 0; }
+	// approximate number of queued tasks
+	size_t size() const { return lanes[LANE_READ]->size() + lanes[LANE_WRITE]->size() + nfront.load(std::memory_order_relaxed); }
+	size_t capacity() const { return lanes[LANE_WRITE]->capacity(); }
+	// queueing delay of `lane` since last call. may be called from any thread
+	LaneStat getstat(Lane lane)
+	{
+		LaneStat ret;
+		ret.count = stats[lane].count.exchange(0, std::memory_order_relaxed);
+		ret.delaysum = stats[lane].delaysum.exchange(0, std::memory_order_relaxed);
+		ret.delaymax = stats[lane].delaymax.exchange(0, std::memory_order_relaxed);
+		ret.depth = lanes[lane]->size();
+		return ret;
+	}
+	static const char *lanename(Lane lane) { return lane == LANE_READ ? "read" : "write"; }
+	static int64_t now() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
 private:
-	std::deque<std::unique_ptr<Task>> tasks;
+	static constexpr int MINSPIN = 16;
+	static constexpr int MAXSPIN = 4096;
+	static constexpr int FULLSPIN = 64;
+	std::unique_ptr<TaskRing> lanes[LANENUM];
+	Sched sched;
+	// consumer state
+	int spinlimit = MINSPIN;
+	int curlane = 0;	// QS_WEIGHTED lane being served
+	int credit = 0;	// tasks left to take from `curlane`
+	struct
+	{
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> delaysum{0};
+		std::atomic<uint64_t> delaymax{0};
+	} stats[LANENUM];
+	char pad0[64];
+	std::atomic<bool> parked{false};	// consumer is (about to be) waiting on `cond`
+	std::atomic<size_t> nfront{0};
+	std::atomic<int> nfullwait{0};	// producers waiting for free cells
+	std::deque<std::unique_ptr<Task>> front;
 	std::mutex mutex;
 	std::condition_variable cond;
+	std::condition_variable fullcond;
+	// load shedding state, shared by producers
+	Shed shed;
+	std::atomic<bool> shedding{false};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> droptotal{0};
+	std::atomic<uint32_t> sampleseq{0};
+	std::atomic<uint32_t> srccount[256];	// recent writes of sources, by hash of source id. halved every second
+	std::atomic<uint32_t> srctotal{0};
+	std::atomic<uint32_t> srcactive{1};	// number of non-zero `srccount` on last decay
+	std::atomic<int64_t> srcdecay{0};	// time of last decay, in seconds
+
+	bool ready() const
+	{
+		return nfront.load(std::memory_order_acquire) > 0 || lanes[LANE_READ]->peek() || lanes[LANE_WRITE]->peek();
+	}
+	// take next task from lanes by policy
+	Task *gettask()
+	{
+		int lane = -1;
+		if (sched.policy == Sched::QS_STRICT)
+			lane = lanes[LANE_READ]->peek() ? LANE_READ : LANE_WRITE;
+		else if (sched.policy == Sched::QS_DEADLINE)
+		{
+			int64_t due = 0;
+			for (int i = 0; i < LANENUM; ++i)
+			{
+				const Task *head = lanes[i]->peek();
+				if (head && (lane < 0 || head->qtime + sched.deadlines[i] * 1000 < due))
+				{
+					lane = i;
+					due = head->qtime + sched.deadlines[i] * 1000;
+				}
+			}
+			if (lane < 0)
+				return NULL;
+		}
+		else	// QS_WEIGHTED, visit each lane once with fresh credit at most
+		{
+			for (int i = 0; i <= LANENUM && lane < 0; ++i)
+			{
+				if (credit > 0 && lanes[curlane]->peek())
+					lane = curlane;
+				else
+				{
+					curlane = (curlane + 1) % LANENUM;
+					credit = sched.weights[curlane];
+				}
+			}
+			if (lane < 0)
+				return NULL;
+			credit--;
+		}
+		Task *task = lanes[lane]->take();
+		if (!task)
+			return NULL;
+		uint64_t delay = (uint64_t)std::max((int64_t)0, now() - task->qtime);
+		stats[lane].count.fetch_add(1, std::memory_order_relaxed);
+		stats[lane].delaysum.fetch_add(delay, std::memory_order_relaxed);
+		for (uint64_t max = stats[lane].delaymax.load(std::memory_order_relaxed);
+			delay > max && !stats[lane].delaymax.compare_exchange_weak(max, delay, std::memory_order_relaxed); )
+			;
+		if (nfullwait.load(std::memory_order_relaxed) > 0)
+			fullcond.notify_all();
+		return task;
+	}
+	// halve recent write counts of sources once per second
+	void decaysources()
+	{
+		int64_t cur = now() / 1000000;
+		int64_t last = srcdecay.load(std::memory_order_relaxed);
+		if (cur == last || !srcdecay.compare_exchange_strong(last, cur, std::memory_order_relaxed))
+			return;
+		uint32_t total = 0;
+		uint32_t active = 0;
+		for (auto &cnt: srccount)
+		{
+			uint32_t c = cnt.load(std::memory_order_relaxed) / 2;
+			cnt.store(c, std::memory_order_relaxed);
+			total += c;
+			active += c > 0 ? 1 : 0;
+		}
+		srctotal.store(total, std::memory_order_relaxed);
+		srcactive.store(std::max(active, 1u), std::memory_order_relaxed);
+	}
+	// called by producers after publishing a task
+	void wake()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (parked.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_one();
+		}
+	}
+	// consumer waits for a task, spinning first. return false on timeout
+	bool wait(std::chrono::milliseconds timeout)
+	{
+		for (int spin = 0; spin < spinlimit; ++spin)
+		{
+			if (ready())
+			{
+				if (spinlimit < MAXSPIN)
+					spinlimit *= 2;
+				return true;
+			}
+			if (spin % 16 == 15)
+				std::this_thread::yield();
+		}
+		if (spinlimit > MINSPIN)
+			spinlimit /= 2;
+		std::unique_lock<std::mutex> lock(mutex);
+		parked.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool ret = cond.wait_for(lock, timeout, [this] { return ready(); });
+		parked.store(false, std::memory_order_relaxed);
+		return ret;
+	}
 };
 
 //////// workers ////////
@@ -162,23 +589,197 @@ protected:
 	TaskQueue *taskq = NULL;
 };
 
-//////// data management worker (in separate thread) ///////
+//////// data management worker (in separate threads) ///////
+// series are partitioned into shards by hash of name. each shard has its own thread, task queue and logs
+class AMonShard
+{
+public:
+	AMonShard(AMon *amon, int idx, size_t qsize): amon(amon), idx(idx), taskq(qsize) { }
+	AMon *amon;
+	int idx;
+	TaskQueue taskq;
+	std::thread thrd;
+	std::unordered_map<std::string, std::unique_ptr<Alog>> data;
+	std::vector<Alog *> logs;	// all logs in `data`, in load order
+	std::vector<Alog *> byid;	// logs in `data` by SeriesId, NULL if not looked up by id yet
+	std::vector<std::unique_ptr<TaskAdd>> outbox;	// values to be sent to other shards after current tasks
+	std::vector<std::deque<std::unique_ptr<Task>>> pending;	// tasks to other shards waiting for queue space
+	size_t scrubidx = 0;	// next log in `logs` to scrub
+	uint32_t ticktime = 0;
+};
+
 class AMon: public Worker
 {
 public:
-	AMon(const char *datadir): datadir(datadir) { }
+	static std::unique_ptr<AMon> byConfig(const char *datadir, const config_t *config)
+	{
+		int shardnum = config_get_int(config, "storage.shards", 1);
+		if (shardnum <= 0)
+			shardnum = std::max(1u, std::thread::hardware_concurrency());
+		int qsize = std::max(1024, config_get_int(config, "storage.queue_size", 65536));
+		auto ret = std::unique_ptr<AMon>(new AMon(datadir, std::min(shardnum, 256), qsize));
+		ret->alogconf.fullverify = strcmp(config_get_string(config, "storage.verify", "fast"), "full") == 0;
+		ret->alogconf.sealdelay = std::max(0, config_get_int(config, "storage.seal_delay", 60));
+		ret->alogconf.lateness = std::max(0, config_get_int(config, "storage.lateness", 60));
+		ret->scrubrate = (size_t)std::max(0, config_get_int(config, "storage.scrub_rate_kb", 512)) * 1024;
+		if (ret->alogconf.loadschemas(config_lookup(config, "storage.schemas")) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid storage.schemas config\n"), NULL);
+		// scheduling of read & write lanes in task queues
+		TaskQueue::Sched sched;
+		const char *policy = config_get_string(config, "storage.sched_policy", "weighted");
+		if (strcmp(policy, "strict") == 0)
+			sched.policy = TaskQueue::Sched::QS_STRICT;
+		else if (strcmp(policy, "weighted") == 0)
+			sched.policy = TaskQueue::Sched::QS_WEIGHTED;
+		else if (strcmp(policy, "deadline") == 0)
+			sched.policy = TaskQueue::Sched::QS_DEADLINE;
+		else
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid storage.sched_policy %s\n", policy), NULL);
+		sched.weights[TaskQueue::LANE_READ] = std::max(1, config_get_int(config, "storage.sched_read_weight", 4));
+		sched.weights[TaskQueue::LANE_WRITE] = std::max(1, config_get_int(config, "storage.sched_write_weight", 1));
+		sched.deadlines[TaskQueue::LANE_READ] = std::max(0, config_get_int(config, "storage.sched_read_deadline_ms", 50));
+		sched.deadlines[TaskQueue::LANE_WRITE] = std::max(0, config_get_int(config, "storage.sched_write_deadline_ms", 1000));
+		// load shedding of incoming writes
+		TaskQueue::Shed shed;
+		policy = config_get_string(config, "storage.shed_policy", "newest");
+		if (strcmp(policy, "block") == 0)
+			shed.policy = TaskQueue::Shed::SHED_NONE;
+		else if (strcmp(policy, "newest") == 0)
+			shed.policy = TaskQueue::Shed::SHED_NEWEST;
+		else if (strcmp(policy, "source") == 0)
+			shed.policy = TaskQueue::Shed::SHED_SOURCE;
+		else if (strcmp(policy, "sample") == 0)
+			shed.policy = TaskQueue::Shed::SHED_SAMPLE;
+		else
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid storage.shed_policy %s\n", policy), NULL);
+		shed.high = std::min(qsize, std::max(1, config_get_int(config, "storage.queue_high", qsize / 10 * 8)));
+		shed.low = std::min((int)shed.high, std::max(0, config_get_int(config, "storage.queue_low", qsize / 2)));
+		shed.sample = std::max(1, config_get_int(config, "storage.shed_sample", 4));
+		for (auto &shard: ret->shards)
+		{
+			shard->taskq.setsched(sched);
+			shard->taskq.setshed(shed);
+		}
+		ret->selfprefix = config_get_string(config, "storage.self_metrics", "amon");
+		ret->readernum = std::min(64, std::max(0, config_get_int(config, "storage.readers", 0)));
+		if (getintlist(config_lookup(config, "storage.affinity"), ret->cpus) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid storage.affinity config\n"), NULL);
+		ret->flushnum = std::min(256, std::max(1, config_get_int(config, "storage.flush_threads", 8)));
+		ret->flushtimeout = std::max(0, config_get_int(config, "storage.shutdown_timeout", 0));
+		return ret;
+	}
+	AMon(const char *datadir, int shardnum = 1, size_t qsize = 65536);
+	~AMon();
 	int stop();
 	int start();
-	TaskQueue *gettaskq() { return &taskq; }
+	// tasks from receivers and readers are accepted by shard 0, and spread over all shards
+	TaskQueue *gettaskq() { return &shards[0]->taskq; }
+	// add a value, on the owning shard of the series. values from other threads are queued to the owning shard
 	int addv(const char *name, uint32_t time, double value, StoreType type);
+	// map a series name to a stable id, for addv() and getstep() without hashing or copying the name.
+	// thread safe, and each thread caches the ids it has looked up. a new name waits for its owning shard to load its
+	// file, so it must not be called on the other shard threads
+	SeriesId intern(const std::string &name);
+	int addv(SeriesId id, uint32_t time, double value, StoreType type);
+	// add values of any series. values of a series are written in one Alog::addv_batch() on its owning shard, so
+	// upper level updates and file writes are done once per series instead of once per value
+	int addv_batch(const SeriesPoint *points, size_t n);
+	// level 0 step of a series, of its file if it exists, or as configured by storage schemas. the log is created by
+	// `type` unless AMON_NULL. waits for the owning shard like intern()
+	int32_t getstep(const char *name, StoreType type);
+	int32_t getstep(SeriesId id) const { return series(id).step; }
+	const std::string &getname(SeriesId id) const { return series(id).name; }
+	// export a counter of a worker as self metric `<selfprefix>.<name>`, in rate per second. `counter` must outlive
+	// AMon running. fp16 saturates at 65504, so counters of bytes, lines or values are stored as AMON_AUINT
+	void addcounter(const std::string &name, const std::atomic<uint64_t> *counter, StoreType type = AMON_FP16);
+	// values resolved off the shard threads (e.g. parsed by a receiver on an I/O thread), collected by owning shard
+	// and queued in one task per shard on flush(). one object per thread
+	class Outbox
+	{
+	public:
+		Outbox(AMon *amon): amon(amon), tasks(amon->shards.size()), admitted(amon->shards.size()), sizes(amon->shards.size()) { }
+		~Outbox() { flush(); }
+		// add values received from `source`. values of shards shedding writes from `source` are dropped.
+		// return false if any is dropped
+		bool add(const SeriesPoint *points, size_t n, uint32_t source);
+		void flush();
+	private:
+		AMon *amon;
+		std::vector<std::unique_ptr<TaskAdd>> tasks;
+		std::vector<int8_t> admitted;	// of shards in current add(), 0 not decided, 1 admitted, -1 dropped
+		std::vector<size_t> sizes;	// points of last task by shard, to reserve the next one
+	};
 private:
 	std::string datadir;
-	TaskQueue taskq;
-	std::thread mainthrd;
-	std::unordered_map<std::string, std::unique_ptr<Alog>> data;
+	std::vector<std::unique_ptr<AMonShard>> shards;
+	size_t nextshard = 0;	// round robin target for incoming tasks
+	std::atomic<int> nstopped;	// number of shards having received TaskStop
+	std::atomic<int> npending;	// number of tasks of all shards waiting in AMonShard::pending
+	AlogConf alogconf;
+	// background scrubbing
+	size_t scrubrate = 0;	// bytes per second, 0 to disable
+	// metrics of AMon itself, stored as series under `selfprefix`. empty to disable
+	std::string selfprefix;
+	uint32_t selftime = 0;	// time of last self metrics
+	struct SelfCounter
+	{
+		std::string name;
+		const std::atomic<uint64_t> *counter;
+		uint64_t last;
+		StoreType type;
+	};
+	std::vector<SelfCounter> selfcounters;
+	std::mutex selfmutex;	// of `selfcounters`, added by workers while shard 0 is running
+	// reader pool, scanning logs concurrently with the shard threads writing them. 0 readers to scan on shard threads
+	int readernum = 0;
+	std::vector<std::thread> readers;
+	std::deque<std::function<void ()>> readjobs;
+	std::mutex readmutex;
+	std::condition_variable readcond;
+	bool readstop = false;
+	std::vector<int> cpus;	// cpus to pin shard and reader threads to. empty for no pinning
+	// shutdown flush
+	int flushnum = 8;	// threads
+	int flushtimeout = 0;	// seconds, 0 for no limit
+	static constexpr const char *JOURNAL = ".amon-journal";
+	static thread_local AMonShard *curshard;	// shard of current thread
+	// interned series, in chunks by id. entries are never moved or removed, so they are read without lock
+	struct Series
+	{
+		std::string name;
+		size_t shard;
+		int32_t step;
+	};
+	static const size_t SERIESCHUNK = 4096;
+	static const size_t SERIESMAXCHUNK = 4096;
+	std::atomic<Series *> serieschunks[SERIESMAXCHUNK];
+	std::unordered_map<std::string, SeriesId> seriesids;
+	std::mutex seriesmutex;
+	uint64_t instance;	// unique among AMon objects of the process, to tell apart per thread id caches
 private:
-	void mainproc();
-	int getdata(TaskRead *task);
-	int doread(TaskRead *task);
-	int doaggr(TaskRead *task);
+	size_t shardof(const std::string &name) const { return shards.size() == 1 ? 0 : std::hash<std::string>()(name) % shards.size(); }
+	const Series &series(SeriesId id) const
+	{
+		return serieschunks[id / SERIESCHUNK].load(std::memory_order_acquire)[id % SERIESCHUNK];
+	}
+	void mainproc(AMonShard *shard);
+	void process(AMonShard &shard, std::unique_ptr<Task> &&t);
+	void send(size_t to, std::unique_ptr<Task> &&task);
+	void flushoutbox(AMonShard &shard);
+	void tick(AMonShard &shard);
+	void selfstats(uint32_t curtime);
+	Alog *getlog(AMonShard &shard, const std::string &name, StoreType type);
+	Alog *getlog(AMonShard &shard, SeriesId id, StoreType type);
+	int32_t loadstep(const std::string &name, StoreType type);
+	void addlocal(AMonShard &shard, const SeriesPoint *points, std::vector<size_t> &idx);
+	void fanout(const std::vector<std::vector<size_t>> &names, std::function<void (AMonShard &, const std::vector<size_t> &)> &&func,
+		std::function<void ()> &&done);
+	void scan(std::shared_ptr<TaskRead> task, const std::vector<std::vector<size_t>> &names,
+		std::function<void (size_t iname, const Alog *log)> &&func, std::function<void ()> &&done);
+	void readproc();
+	int flushall();
+	int replay();
+	void getdata(std::unique_ptr<TaskRead> &&task);
+	void doread(std::shared_ptr<TaskRead> task);
+	void doaggr(std::shared_ptr<TaskRead> task);
 };
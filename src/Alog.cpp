@@ -1,8 +1,11 @@
 #include "AMon.h"
 #include <assert.h>
+#include <unistd.h>
 #include <time.h>
 #include <thread>
+#include <math.h>
 #include "pe_log.h"
+#include "crc32c.h"
 #include "AUint.h"
 #include "fp16/fp16.h"
 
@@ -12,14 +15,16 @@
 // level data buffers are round-robin, except level[-1] which keeps all history (VPERIOD[-1] is initial value)
 // file format:
 // name being file name
-// Header, LevelInfo[header.lvnum], level0 values (float), level[1] values (uint16_t), ...
+// (Header, LevelInfo[header.lvnum]) x 2 slots, blkcrc[header.blkcap] x 2 slots, level0 values (float), level[1] values (uint16_t), ...
+// level values are divided into blocks of ALOG_BLKSIZE bytes, each protected by a crc32c in blkcrc. header.hcrc protects
+// header and LevelInfo, and header.tcrc protects blkcrc. on updating, data blocks are written and synced first, and then
+// blkcrc, header and LevelInfo go to the slot of the older header, so the newer one is kept if that is torn
 
 // default level setups
 const static int32_t VSTEP[] = { 5, 60, 600, 1800 };
 const static int32_t VPERIOD[] = { 86400, 86400 * 15, 86400 * 183, 86400 * 365 };
 //const static int32_t VSTEP[] = { 5, 10, 15, 15 };
 //const static int32_t VPERIOD[] = { 180, 240, 300, 86400 };
-const static int32_t VSTEPLEN[] = { VPERIOD[0] / VSTEP[0], VPERIOD[1] / VSTEP[1], VPERIOD[2] / VSTEP[2], VPERIOD[3] / VSTEP[3] };
 static_assert(ALOG_DEF_LVNUM == sizeof(VSTEP) / sizeof(VSTEP[0]) &&
 	sizeof(VSTEP) / sizeof(VSTEP[0]) == sizeof(VPERIOD) / sizeof(VPERIOD[0]), "VSTEP & VPERIOD mismatch");
 // config check. could be made static_assert if constexpr is supported
@@ -27,18 +32,96 @@ static struct StaticParamChecker
 {
 	StaticParamChecker()
 	{
-		assert(VSTEP[0] == AMON_MINSTEP);
-		assert(VPERIOD[0] >= 60);
-		for (size_t i = 0; i < ALOG_DEF_LVNUM; ++i)
-		{
-			assert(86400 % VSTEP[i] == 0 || VSTEP[i] % 86400 == 0);
-			assert(86400 % VPERIOD[i] == 0 || VPERIOD[i] % 86400 == 0);
-			assert(VSTEP[i] % VSTEP[0] == 0);
-		}
-		assert(VPERIOD[0] >= VSTEP[ALOG_DEF_LVNUM - 1] * 10);
+		assert(VSTEP[0] == AMON_DEFSTEP);
+		AlogSchema schema;
+		schema.steps.assign(VSTEP, VSTEP + ALOG_DEF_LVNUM);
+		schema.periods.assign(VPERIOD, VPERIOD + ALOG_DEF_LVNUM);
+		assert(schema.check() == 0);
 	}
 } static_param_checker;
 
+// memory & disk bytes of data values of a series
+size_t AlogSchema::bytes() const
+{
+	size_t ret = 0;
+	for (size_t i = 0; i < steps.size(); ++i)
+		ret += (size_t)(periods[i] / steps[i]) * (i == 0 ? sizeof(float) : sizeof(uint16_t) + (coverage ? sizeof(uint8_t) : 0));
+	return ret;
+}
+
+int AlogSchema::check() const
+{
+	if (steps.size() != periods.size() || steps.size() < 2 || steps.size() > ALOG_MAXLV)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Invalid level num of schema %s\n", match.c_str()), -1);
+	if (steps[0] < AMON_MINSTEP || 60 % steps[0] != 0 || periods[0] < 60)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Invalid level 0 of schema %s\n", match.c_str()), -1);
+	for (size_t i = 0; i < steps.size(); ++i)
+	{
+		if (steps[i] <= 0 || periods[i] <= 0 || 86400 % steps[i] != 0 && steps[i] % 86400 != 0 ||
+				86400 % periods[i] != 0 && periods[i] % 86400 != 0 || steps[i] % steps[0] != 0 || periods[i] % steps[i] != 0 ||
+				i > 0 && steps[i] <= steps[i - 1] || i != steps.size() - 1 && periods[i] / steps[i] > 10 * 1024 * 1024)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid level %d (%d:%d) of schema %s\n",
+				(int)i, (int)steps[i], (int)periods[i], match.c_str()), -1);
+	}
+	if (periods[0] < steps.back() * 10)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Level 0 period too short for schema %s\n", match.c_str()), -1);
+	return 0;
+}
+
+// load schemas from config list like:
+// ( { match = "host1.latency"; steps = [ 1, 60, 600, 1800 ]; periods = [ 86400, 1296000, 15811200, 31536000 ]; coverage = true; } )
+int AlogConf::loadschemas(const config_setting_t *config)
+{
+	schemas.clear();
+	int num = config ? config_setting_length(config) : 0;
+	for (int i = 0; i < num; ++i)
+	{
+		config_setting_t *item = config_setting_get_elem(config, i);
+		AlogSchema schema;
+		const char *match = "";
+		config_setting_lookup_string(item, "match", &match);
+		schema.match = match;
+		config_setting_lookup_bool(item, "coverage", &schema.coverage);
+		config_setting_t *steps = config_setting_get_member(item, "steps");
+		config_setting_t *periods = config_setting_get_member(item, "periods");
+		if (!steps || !periods)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Missing steps or periods in schema %s\n", match), -1);
+		for (int l = 0; l < config_setting_length(steps); ++l)
+			schema.steps.push_back(config_setting_get_int_elem(steps, l));
+		for (int l = 0; l < config_setting_length(periods); ++l)
+			schema.periods.push_back(config_setting_get_int_elem(periods, l));
+		if (schema.check() != 0)
+			return -1;
+		schemas.push_back(std::move(schema));
+	}
+	// report memory cost
+	bool hasdef = false;
+	for (const auto &schema: schemas)
+	{
+		PELOG_LOG((PLV_INFO, "Schema \"%s\" level 0 step %d, " PL_SIZET " bytes per series\n",
+			schema.match.c_str(), (int)schema.steps[0], schema.bytes()));
+		hasdef = hasdef || schema.match.empty();
+	}
+	if (!hasdef)
+		PELOG_LOG((PLV_INFO, "Default schema level 0 step %d, " PL_SIZET " bytes per series\n",
+			(int)schema("").steps[0], schema("").bytes()));
+	return 0;
+}
+
+const AlogSchema &AlogConf::schema(const char *name) const
+{
+	static const AlogSchema defschema = []() {
+		AlogSchema schema;
+		schema.steps.assign(VSTEP, VSTEP + ALOG_DEF_LVNUM);
+		schema.periods.assign(VPERIOD, VPERIOD + ALOG_DEF_LVNUM);
+		return schema;
+	}();
+	for (const auto &schema: schemas)
+		if (strncmp(name, schema.match.c_str(), schema.match.size()) == 0)
+			return schema;
+	return defschema;
+}
+
 // get the round time (actual write time) of `steptime`
 // eg, for level==1 whose VSTEP[1]==60, steptime=>round: 0=>0, 1~60=>60, 61~120=>120, ...
 uint32_t roundtime(uint32_t steptime, int32_t step)
@@ -75,8 +158,11 @@ uint32_t roundup(uint32_t val, uint32_t mul)
 	return val - val % mul;
 }
 
-Alog::Alog()
+Alog::Alog(const AlogConf *conf): conf(conf)
 {
+	static const AlogConf defconf;
+	if (!this->conf)
+		this->conf = &defconf;
 }
 
 Alog::~Alog()
@@ -117,45 +203,141 @@ int Alog::init(const char *dir, const char *logname, StoreType type)
 		fseek(fp, 0, SEEK_END);
 		long fsize = ftell(fp);
 		fseek(fp, 0, SEEK_SET);
-		// read header
-		if (fread(&h, sizeof(h), 1, fp) != 1)
+		// read header. version 2 files have 2 header slots, and the latest one with a valid crc table is used
+		int version = 0;	// 0: early unversioned file, 1: single header. both are upgraded after loading
+		std::vector<FileHeader> heads;	// candidates, latest first
+		std::vector<std::vector<LevelInfo>> headlvs;
+		if (fread(&h.magic, sizeof(h.magic), 1, fp) != 1 || fread(&h.version, sizeof(h.version), 1, fp) != 1)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Load failed %s\n", filename.c_str()), -1);
+		if (!(h.magic == ALOG_MAGIC && h.version == ALOG_VERSION))	// slot 0 may be torn
+		{
+			FileHeader sh;
+			fseek(fp, HDRSIZE, SEEK_SET);
+			if (fread(&sh, sizeof(sh), 1, fp) == 1 && sh.magic == ALOG_MAGIC && sh.version == ALOG_VERSION)
+				h = sh;
+		}
+		fseek(fp, 0, SEEK_SET);
+		if (h.magic == ALOG_MAGIC && h.version == ALOG_VERSION)
+		{
+			version = ALOG_VERSION;
+			for (int slot = 0; slot < 2; ++slot)
+			{
+				FileHeader sh;
+				fseek(fp, slot * HDRSIZE, SEEK_SET);
+				if (fread(&sh, sizeof(sh), 1, fp) != 1 || sh.magic != ALOG_MAGIC || sh.version != ALOG_VERSION ||
+						sh.lvnum < 2 || sh.lvnum > ALOG_MAXLV)
+					continue;	// never written, or torn
+				std::vector<LevelInfo> slv(sh.lvnum);
+				if ((int)fread(slv.data(), sizeof(slv[0]), sh.lvnum, fp) != sh.lvnum)
+					continue;
+				uint32_t hcrc = sh.hcrc;
+				sh.hcrc = 0;
+				if (crc32c(slv.data(), sizeof(slv[0]) * sh.lvnum, crc32c(&sh, sizeof(sh))) != hcrc)
+				{
+					PELOG_LOG((PLV_WARNING, "Header crc mismatch in slot %d %s\n", slot, filename.c_str()));
+					continue;
+				}
+				sh.hcrc = hcrc;
+				size_t pos = !heads.empty() && heads[0].gen < sh.gen ? 0 : heads.size();
+				heads.insert(heads.begin() + pos, sh);
+				headlvs.insert(headlvs.begin() + pos, std::move(slv));
+			}
+			if (heads.empty())
+				PELOG_ERROR_RETURN((PLV_ERROR, "Header crc mismatch %s\n", filename.c_str()), -1);
+		}
+		else if (h.magic == ALOG_MAGIC && h.version == 1)
+		{
+			FileHeaderV1 h1;
+			if (fread(&h1, sizeof(h1), 1, fp) != 1 || h1.lvnum < 2 || h1.lvnum > ALOG_MAXLV)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Load failed %s\n", filename.c_str()), -1);
+			std::vector<LevelInfo> slv(h1.lvnum);
+			if ((int)fread(slv.data(), sizeof(slv[0]), h1.lvnum, fp) != h1.lvnum)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Load info failed %s\n", filename.c_str()), -1);
+			uint32_t hcrc = h1.hcrc;
+			h1.hcrc = 0;
+			if (crc32c(slv.data(), sizeof(slv[0]) * h1.lvnum, crc32c(&h1, sizeof(h1))) != hcrc)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Header crc mismatch %s\n", filename.c_str()), -1);
+			version = 1;
+			h = FileHeader();
+			h.flags = h1.flags;
+			h.stype = h1.stype;
+			h.lvnum = h1.lvnum;
+			h.blkcap = h1.blkcap;
+			h.tcrc = h1.tcrc;
+			heads.push_back(h);
+			headlvs.push_back(std::move(slv));
+		}
+		else if (h.magic == ALOG_MAGIC)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Unsupported data file version %d %s\n", (int)h.version, filename.c_str()), -1);
+		else
+		{
+			FileHeaderV0 h0;
+			if (fread(&h0, sizeof(h0), 1, fp) != 1 || h0.lvnum < 2 || h0.lvnum > ALOG_MAXLV)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Load failed %s\n", filename.c_str()), -1);
+			h = FileHeader();
+			h.stype = h0.stype;
+			h.lvnum = h0.lvnum;
+			heads.push_back(h);
+			headlvs.emplace_back(h.lvnum);
+			if ((int)fread(headlvs[0].data(), sizeof(LevelInfo), h.lvnum, fp) != h.lvnum)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Load info failed %s\n", filename.c_str()), -1);
+		}
+		// choose the latest header with valid levels, and read its block crc table. if the table is torn, it is
+		// still used, and data blocks are verified one by one against it and the table of the other header
+		bool verify = conf->fullverify && version != 0;
+		size_t chosen = heads.size();
+		std::vector<std::vector<uint32_t>> tables(heads.size());
+		for (size_t ihead = 0; ihead < heads.size(); ++ihead)
+		{
+			h = heads[ihead];
+			lv = headlvs[ihead];
+			if (h.flags & ~ALOG_FLAG_COVER)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Unsupported data file flags %x %s\n", (int)h.flags, filename.c_str()), -1);
+			int32_t basepos = version == 0 ? sizeof(FileHeaderV0) + sizeof(lv[0]) * h.lvnum :
+				version == 1 ? sizeof(FileHeaderV1) + sizeof(lv[0]) * h.lvnum + sizeof(uint32_t) * h.blkcap : dataoff();
+			int32_t blknum = checklevels(basepos, version != 0, fsize);
+			if (blknum < 0)
+				continue;
+			headlvs[ihead] = lv;
+			if (version == 0)	// no crc
+			{
+				chosen = ihead;
+				break;
+			}
+			tables[ihead].resize(blknum);
+			fseek(fp, version == 1 ? sizeof(FileHeaderV1) + sizeof(lv[0]) * h.lvnum : tableoff(h.gen % 2), SEEK_SET);
+			if ((int)fread(tables[ihead].data(), sizeof(uint32_t), blknum, fp) != blknum)
+				continue;
+			if (chosen == heads.size())
+				chosen = ihead;
+		}
+		if (chosen == heads.size())
+			PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted %s\n", filename.c_str()), -1);
+		if (chosen > 0)
+			PELOG_LOG((PLV_WARNING, "Loading older header %s\n", filename.c_str()));
+		if (version != 0 && crc32c(tables[chosen].data(), sizeof(uint32_t) * tables[chosen].size()) != heads[chosen].tcrc)
+		{
+			PELOG_LOG((PLV_ERROR, "Block crc table mismatch, verifying data blocks %s\n", filename.c_str()));
+			verify = true;
+		}
+		// second chance for blocks whose crc entry is torn, if the other header has the same layout
+		std::vector<uint32_t> alttable;
+		for (size_t ihead = 0; ihead < heads.size(); ++ihead)
+			if (ihead != chosen && tables[ihead].size() == tables[chosen].size() && heads[ihead].flags == heads[chosen].flags &&
+					std::equal(headlvs[ihead].begin(), headlvs[ihead].end(), headlvs[chosen].begin(),
+						[](const LevelInfo &a, const LevelInfo &b) { return a.off == b.off && a.len == b.len; }))
+				alttable = tables[ihead];
+		h = heads[chosen];
+		lv = headlvs[chosen];
+		blkcrc = std::move(tables[chosen]);
 		if (type == AMON_NULL && (h.stype == AMON_AUINT || h.stype == AMON_FP16))
 			type = (StoreType)h.stype;
 		else if (type != h.stype)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Type not match %d:%d %s\n", type, h.stype, filename.c_str()), -1);
 		if (type == AMON_NULL)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid type for Alog %s\n", filename.c_str()), -1);
-		if (h.lvnum < 2 || h.lvnum > 20)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid level num %d %s\n", h.lvnum, filename.c_str()), -1);
-		// read level info
-		lv.resize(h.lvnum);
-		if ((int)fread(lv.data(), sizeof(lv[0]), h.lvnum, fp) != h.lvnum)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Load info failed %s\n", filename.c_str()), -1);
-		// verify
-		if (lv[0].step != AMON_MINSTEP)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Incompatible step %d %s\n", lv[0].step, filename.c_str()), -1);
-		int32_t basepos = sizeof(h) + sizeof(lv[0]) * h.lvnum;
-		for (int i = 0; i < h.lvnum; ++i)
-		{
-			if (lv[i].off != basepos || lv[i].pos < 0 || lv[i].pos > lv[i].len || lv[i].len <= 0 || lv[i].step <= 0)
-				PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted (%d:%d:%d:%d:%d) %s\n",
-				i, (int)lv[i].step, (int)lv[i].len, (int)lv[i].off, (int)basepos, filename.c_str()), -1);
-			int32_t period = lv[i].step * lv[i].len;
-			if (i == 0 && lv[i].step > 86400 || lv[i].step > 10 * 86400 || 86400 % lv[i].step != 0 && lv[i].step % 86400 != 0 ||
-					i != h.lvnum - 1 && lv[i].len > 10 * 1024 * 1024 || period % 86400 != 0 && 86400 % period != 0)
-				PELOG_ERROR_RETURN((PLV_ERROR, "Data file incompatible (%d:%d:%d:%d:%d) %s\n",
-				i, (int)lv[i].step, (int)lv[i].len, (int)lv[i].off, (int)basepos, filename.c_str()), -1);
-			lv[i].time -= lv[i].time % lv[i].step;
-			if (lv[i].time > 500000000 && (lv[i].time < 1577808000 || lv[i].time > 2524579200u))
-				PELOG_ERROR_RETURN((PLV_ERROR, "Data file currupted (%d:%u) %s\n", i, lv[i].time, filename.c_str()), -1);
-			if (lv[i].step % lv[0].step != 0)
-				PELOG_ERROR_RETURN((PLV_ERROR, "Data file incompatible (%d:%d) %s\n", i, (int)lv[i].step, filename.c_str()), -1);
-			basepos += lv[i].len * (i == 0 ? sizeof(float) : sizeof(uint16_t));
-		}
-		if (fsize < basepos)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted (%d:%d:%d) %s\n",
-			-1, (int)fsize, (int)basepos, filename.c_str()), -1);
+		setnan = setnan_funcs[type];	// for discarded blocks
+		fseek(fp, lv[0].off, SEEK_SET);
 		// read values
 		value0.resize(lv[0].len);
 		if ((int)fread(value0.data(), sizeof(value0[0]), lv[0].len, fp) != lv[0].len)
@@ -167,47 +349,80 @@ int Alog::init(const char *dir, const char *logname, StoreType type)
 			if ((int)fread(value[i].data(), sizeof(value[i][0]), lv[i].len, fp) != lv[i].len)
 				PELOG_ERROR_RETURN((PLV_ERROR, "Load data failed %d %s\n", i, filename.c_str()), -1);
 		}
+		cover.clear();
+		cover.resize(h.lvnum);
+		for (int i = 1; i < h.lvnum && hascover(); ++i)
+		{
+			cover[i].resize(lv[i].len);
+			if ((int)fread(cover[i].data(), sizeof(cover[i][0]), lv[i].len, fp) != lv[i].len)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Load coverage failed %d %s\n", i, filename.c_str()), -1);
+		}
+		fp.release();
+		layout();
+		if (verify)	// verify data blocks. blocks failed are discarded and rewritten
+		{
+			for (int i = 0; i < areanum(); ++i)
+			{
+				for (int32_t blk = 0; blk < lvblocks(i); ++blk)
+				{
+					uint32_t crc = blockcrc(i, blk);
+					if (crc == blkcrc[blkbase[i] + blk] || (!alttable.empty() && crc == alttable[blkbase[i] + blk]))
+					{
+						if (crc != blkcrc[blkbase[i] + blk])
+							ispending = true;	// table is rewritten with the header
+						blkcrc[blkbase[i] + blk] = crc;
+						blkchecked[blkbase[i] + blk] = true;
+					}
+					else
+					{
+						PELOG_LOG((PLV_ERROR, "Data block crc mismatch %d:%d, discarded %s\n", i, (int)blk, filename.c_str()));
+						discardblock(i, blk);
+					}
+				}
+			}
+		}
+		if (version != ALOG_VERSION)	// upgrade to current file version
+		{
+			if (writeall() != 0)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Upgrade data file failed %s\n", filename.c_str()), -1);
+			PELOG_LOG((PLV_INFO, "Upgraded data file %s\n", filename.c_str()));
+		}
 		PELOG_LOG((PLV_INFO, "Loaded data %s\n", filename.c_str()));
 	}
 	else	// Datafile not found, init new
 	{
 		if (type == AMON_NULL)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Missing type for Alog %s\n", filename.c_str()), -1);
-		fp = fopen(filename.c_str(), "wb");
-		if (!fp)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Write failed %s\n", filename.c_str()), -1);
+		const AlogSchema &schema = conf->schema(logname);
 		// header
+		h = FileHeader();
 		h.stype = type;
-		h.lvnum = ALOG_DEF_LVNUM;
-		if (fwrite(&h, sizeof(h), 1, fp) != 1)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Init failed %s\n", filename.c_str()), -1);
+		h.lvnum = (int32_t)schema.steps.size();
+		if (schema.coverage)
+			h.flags |= ALOG_FLAG_COVER;
 		// level info
 		lv.resize(h.lvnum);
-		int32_t basepos = sizeof(h) + sizeof(lv[0]) * h.lvnum;
 		for (int i = 0; i < h.lvnum; ++i)
 		{
-			lv[i].step = VSTEP[i];
-			lv[i].off = basepos;
-			lv[i].len = VSTEPLEN[i];
+			lv[i].step = schema.steps[i];
+			lv[i].len = schema.periods[i] / schema.steps[i];
 			lv[i].time = 0;
 			lv[i].pos = 0;
-			basepos += lv[i].len * (i == 0 ? sizeof(float) : sizeof(uint16_t));
 		}
-		if ((int)fwrite(lv.data(), sizeof(lv[0]), h.lvnum, fp) != h.lvnum)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Init info failed %s\n", filename.c_str()), -1);
 		// values
 		value0.clear();
 		value0.resize(lv[0].len, NAN);
-		if ((int)fwrite(value0.data(), sizeof(value0[0]), lv[0].len, fp) != lv[0].len)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Load data failed 0 %s\n", filename.c_str()), -1);
 		value.clear();
 		value.resize(h.lvnum);
 		for (int i = 1; i < h.lvnum; ++i)
-		{
 			value[i].resize(lv[i].len, setnan_funcs[type]());
-			if ((int)fwrite(value[i].data(), sizeof(value[i][0]), lv[i].len, fp) != lv[i].len)
-				PELOG_ERROR_RETURN((PLV_ERROR, "Load data failed %d %s\n", i, filename.c_str()), -1);
-		}
+		cover.clear();
+		cover.resize(h.lvnum);
+		for (int i = 1; i < h.lvnum && hascover(); ++i)
+			cover[i].resize(lv[i].len, 0);
+		layout();
+		if (writeall() != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Init failed %s\n", filename.c_str()), -1);
 		PELOG_LOG((PLV_INFO, "Inited data %s\n", filename.c_str()));
 	}
 	
@@ -218,67 +433,538 @@ int Alog::init(const char *dir, const char *logname, StoreType type)
 
 	writetime = (uint32_t)time(NULL);
 	writestep = lv[0].time;
-	pending.resize(h.lvnum);
-	for (int i = 0; i < h.lvnum; ++i)
-		pending[i] = 0;
-	ispending = false;
+	maxlate = std::max(lv[0].step, std::min(conf->lateness, lv[0].step * lv[0].len - lv[h.lvnum - 1].step));
+	late.clear();
+	ispending = ndirty > 0;
 
 	inited = true;
 	return 0;
 }
 
+// check level info of the header just read, with data starting at `basepos`. return number of data blocks
+int32_t Alog::checklevels(int32_t basepos, bool hastable, long fsize)
+{
+	if (lv[0].step < AMON_MINSTEP || 60 % lv[0].step != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Incompatible step %d %s\n", lv[0].step, filename.c_str()), -1);
+	int32_t blknum = 0;
+	for (int i = 0; i < h.lvnum; ++i)
+	{
+		if (lv[i].off != basepos || lv[i].pos < 0 || lv[i].pos > lv[i].len || lv[i].len <= 0 || lv[i].step <= 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted (%d:%d:%d:%d:%d) %s\n",
+			i, (int)lv[i].step, (int)lv[i].len, (int)lv[i].off, (int)basepos, filename.c_str()), -1);
+		int32_t period = lv[i].step * lv[i].len;
+		if (i == 0 && lv[i].step > 86400 || lv[i].step > 10 * 86400 || 86400 % lv[i].step != 0 && lv[i].step % 86400 != 0 ||
+				i != h.lvnum - 1 && lv[i].len > 10 * 1024 * 1024 || period % 86400 != 0 && 86400 % period != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Data file incompatible (%d:%d:%d:%d:%d) %s\n",
+			i, (int)lv[i].step, (int)lv[i].len, (int)lv[i].off, (int)basepos, filename.c_str()), -1);
+		lv[i].time -= lv[i].time % lv[i].step;
+		if (lv[i].time > 500000000 && (lv[i].time < 1577808000 || lv[i].time > 2524579200u))
+			PELOG_ERROR_RETURN((PLV_ERROR, "Data file currupted (%d:%u) %s\n", i, lv[i].time, filename.c_str()), -1);
+		if (lv[i].step % lv[0].step != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Data file incompatible (%d:%d) %s\n", i, (int)lv[i].step, filename.c_str()), -1);
+		basepos += lvbytes(i);
+		blknum += lvblocks(i);
+	}
+	for (int area = h.lvnum; area < areanum(); ++area)
+	{
+		basepos += lvbytes(area);
+		blknum += lvblocks(area);
+	}
+	if (fsize < basepos)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted (%d:%d:%d) %s\n",
+		-1, (int)fsize, (int)basepos, filename.c_str()), -1);
+	if (hastable && (h.blkcap < blknum || h.blkcap > 1024 * 1024))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Data file corrupted (%d:%d) %s\n", (int)h.blkcap, (int)blknum, filename.c_str()), -1);
+	return blknum;
+}
+
+// compute crc table layout and data area offsets in file, based on level lengths. crc table is enlarged if necessary
+void Alog::layout()
+{
+	int nareas = areanum();
+	blkbase.resize(nareas + 1);
+	blkbase[0] = 0;
+	for (int i = 0; i < nareas; ++i)
+		blkbase[i + 1] = blkbase[i] + lvblocks(i);
+	blkcrc.resize(blkbase[nareas]);
+	blkdirty.resize(blkbase[nareas]);
+	blkchecked.resize(blkbase[nareas]);
+	if (h.blkcap < blkbase[nareas])	// reserve space for the growing last level
+		h.blkcap = blkbase[nareas] + 128;
+	int32_t basepos = dataoff();
+	areaoff.resize(nareas);
+	for (int i = 0; i < nareas; ++i)
+	{
+		areaoff[i] = basepos;
+		basepos += lvbytes(i);
+	}
+	for (int i = 0; i < h.lvnum; ++i)
+		lv[i].off = areaoff[i];
+}
+
+// data of a block failed verification is lost. it is set to NAN, and written on next file update
+void Alog::discardblock(int area, int32_t blk)
+{
+	int32_t bpos = blk * ALOG_BLKSIZE / itemsize(area);
+	int32_t epos = std::min(lv[arealevel(area)].len, (int32_t)((blk + 1) * ALOG_BLKSIZE / itemsize(area)));
+	WriteSection ws(this);
+	for (int32_t pos = bpos; pos < epos; ++pos)
+	{
+		if (area == 0)
+			value0[pos] = NAN;
+		else if (area < h.lvnum)
+			value[area][pos] = setnan();
+		else
+			cover[arealevel(area)][pos] = 0;
+	}
+	if (!blkdirty[blkbase[area] + blk])
+	{
+		blkdirty[blkbase[area] + blk] = true;
+		ndirty++;
+	}
+	blkchecked[blkbase[area] + blk] = true;
+	ispending = true;
+}
+
+uint32_t Alog::blockcrc(int area, int32_t blk) const
+{
+	size_t boff = (size_t)blk * ALOG_BLKSIZE;
+	return crc32c(lvdata(area) + boff, std::min((size_t)ALOG_BLKSIZE, lvbytes(area) - boff));
+}
+
+// write data blocks [bblk, eblk) of data area to file, and update their crc
+int Alog::writeblocks(FILE *fp, int area, int32_t bblk, int32_t eblk)
+{
+	size_t boff = (size_t)bblk * ALOG_BLKSIZE;
+	size_t eoff = std::min(lvbytes(area), (size_t)eblk * ALOG_BLKSIZE);
+	if (boff >= eoff)
+		return 0;
+	fseek(fp, areaoff[area] + boff, SEEK_SET);
+	if (fwrite(lvdata(area) + boff, 1, eoff - boff, fp) != eoff - boff)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Write lvdata failed %d %s\n", area, filename.c_str()), -1);
+	for (int32_t blk = bblk; blk < eblk; ++blk)
+	{
+		blkcrc[blkbase[area] + blk] = blockcrc(area, blk);
+		blkchecked[blkbase[area] + blk] = true;
+		if (blkdirty[blkbase[area] + blk])
+		{
+			blkdirty[blkbase[area] + blk] = false;
+			ndirty--;
+		}
+	}
+	return 0;
+}
+
+// flush written data of `fp` to disk
+static int syncfile(FILE *fp)
+{
+	if (fflush(fp) != 0)
+		return -1;
+#ifdef __linux__
+	return fdatasync(fileno(fp));
+#else
+	return fsync(fileno(fp));
+#endif
+}
+
+// make all previous writes valid: sync them to disk, then write crc table, header and level info to the slot not
+// holding the current header. a write torn by a crash leaves the other slot valid
+int Alog::writeheader(FILE *fp)
+{
+	if (syncfile(fp) != 0)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Sync data failed %s\n", filename.c_str()), -1);
+	h.gen++;
+	int slot = h.gen % 2;
+	h.tcrc = crc32c(blkcrc.data(), sizeof(blkcrc[0]) * blkcrc.size());
+	h.hcrc = 0;
+	h.hcrc = crc32c(lv.data(), sizeof(lv[0]) * h.lvnum, crc32c(&h, sizeof(h)));
+	fseek(fp, tableoff(slot), SEEK_SET);
+	if (fwrite(blkcrc.data(), sizeof(blkcrc[0]), blkcrc.size(), fp) != blkcrc.size())
+		PELOG_ERROR_RETURN((PLV_WARNING, "Write crc failed %s\n", filename.c_str()), -1);
+	fseek(fp, slot * HDRSIZE, SEEK_SET);
+	if (fwrite(&h, sizeof(h), 1, fp) != 1 || (int)fwrite(lv.data(), sizeof(lv[0]), h.lvnum, fp) != h.lvnum)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Write lvinfo failed %s\n", filename.c_str()), -1);
+	return 0;
+}
+
+// write the whole data file to a temporary file and then replace the original one
+int Alog::writeall()
+{
+	std::string tmpname = filename + ".tmp";
+	FILEGuard fp = fopen(tmpname.c_str(), "wb");
+	if (!fp)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write failed %s\n", tmpname.c_str()), -1);
+	for (int i = 0; i < areanum(); ++i)
+		if (writeblocks(fp, i, 0, lvblocks(i)) != 0)
+			return -1;
+	// both header slots, so that the new file never falls back to an empty one
+	if (writeheader(fp) != 0 || writeheader(fp) != 0 || syncfile(fp) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write failed %s\n", tmpname.c_str()), -1);
+	fp.release();
+	if (rename(tmpname.c_str(), filename.c_str()) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Replace data file failed %s\n", filename.c_str()), -1);
+	return 0;
+}
+
 int Alog::addv(uint32_t time, double value)
 {
 	if (!inited)
 		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
+	{
+		WriteSection ws(this);
+		put(time, (float)value);
+	}
+	// write to file, after the write section so that readers do not wait for the disk
+	if ((ispending || relocate) && updatefile() != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Alog write data failed %s\n", name.c_str()), -1);
+	return 0;
+}
 
+int Alog::addv_batch(const uint32_t *times, const float *values, size_t n)
+{
+	if (!inited)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
+	if (n == 0)
+		return 0;
+	{
+		WriteSection ws(this);
+		uint32_t lvtime = lv[0].time;
+		batching = true;
+		batchup = lv[0].time;
+		for (size_t i = 0; i < n; ++i)
+			put(times[i], values[i]);
+		batching = false;
+		if (batchpending)
+		{
+			updatelevels();
+			batchpending = false;
+		}
+		if (lv[0].time != lvtime && !late.empty())
+			reseal();
+	}
+	if ((ispending || relocate) && updatefile() != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Alog write data failed %s\n", name.c_str()), -1);
+	return 0;
+}
+
+// update upper levels after level 0 moved forward. in a batch this is done once at the end, unless level 0 is about
+// to wrap over values not aggregated yet
+void Alog::uplevels()
+{
+	if (batching && lv[0].time < batchup + (uint32_t)lv[0].step * (lv[0].len / 2))
+	{
+		batchpending = true;
+		return;
+	}
+	updatelevels();
+	batchup = lv[0].time;
+	batchpending = false;
+}
+
+// add a level 0 value, without writing to file
+int Alog::put(uint32_t time, float value)
+{
 	time -= time % lv[0].step;
-	if (time + std::min(60, lv[0].step * lv[0].len) <= lv[0].time)
+	if (time + maxlate <= lv[0].time)
 		PELOG_ERROR_RETURN((PLV_WARNING, "Alog ignore old data time\n"), 0);
 	firsttime = std::min(time, firsttime);
 	if (writestep == 0)
 		writestep = time - lv[0].step;
+	// late value whose upper level buckets have been sealed, keep in reorder buffer to re-aggregate in batch
+	if (lv[0].time != 0 && time <= lv[0].time && roundtime(time, lv[1].step) <= lv[1].time)
+	{
+		late.push_back(LateVal{time, value});
+		ispending = true;
+		if (late.size() >= REORDERLEN)
+			reseal();
+		return 0;
+	}
+	append(time, value);
+	return 0;
+}
 
-	// fill missing values with NAN
-	for (uint32_t uptime = lv[0].time + lv[0].step; lv[0].time != 0 && uptime < time; uptime += lv[0].step)
+// record a level 0 value at `time`, which is either newer than lv[0].time or in unsealed buckets
+void Alog::append(uint32_t time, float value)
+{
+	// fill missing values with NAN. in a batch, level 0 moves in one go up to where upper levels must be updated
+	while (lv[0].time != 0 && lv[0].time + lv[0].step < time)
 	{
-		value0[lv[0].pos] = NAN;
-		++lv[0].pos;
-		pending[0]++;
-		if (lv[0].pos >= lv[0].len)
-			lv[0].pos = 0;
-		lv[0].time = uptime;
-		updatelevels();
+		uint32_t uptime = lv[0].time + lv[0].step;
+		if (batching)
+			uptime = std::max(uptime, std::min(time - lv[0].step, batchup + (uint32_t)lv[0].step * (lv[0].len / 2)));
+		for (; lv[0].time < uptime; lv[0].time += lv[0].step)
+		{
+			value0[lv[0].pos] = NAN;
+			setdirty(0, lv[0].pos);
+			++lv[0].pos;
+			if (lv[0].pos >= lv[0].len)
+				lv[0].pos = 0;
+		}
+		uplevels();
 	}
 	// record the new value
 	assert(lv[0].time == 0 || time <= lv[0].time + lv[0].step);
 	int32_t uppos = lv[0].time == 0 ? 0 :
 		(lv[0].pos + lv[0].len - (lv[0].time + lv[0].step - time) / lv[0].step) % lv[0].len;
-	value0[uppos] = (float)value;
+	value0[uppos] = value;
+	setdirty(0, uppos);
 	if (time > lv[0].time)
 	{
 		assert(lv[0].pos == uppos);
 		++lv[0].pos;
-		pending[0]++;
 		if (lv[0].pos >= lv[0].len)
 			lv[0].pos = 0;
 		lv[0].time = time;
+		uplevels();
+		if (!late.empty() && !batching)
+			reseal();
+	}
+	else if (lv[0].time > 0)	// if got a history value, also write it soon
+		ispending = true;
+}
+
+// write a block of values sorted by time, bypassing the lateness limit of addv().
+// new values go through level 0 as a batch, so that upper levels are built in bulk, also for a new series. history
+// values within level 0 period are written to level 0 directly, and their upper level buckets are re-aggregated in
+// backfillend(). older history values are aggregated and written to the upper levels directly, the last level grows
+// to hold them. backfillend() must be called after the last block
+int Alog::backfill(const uint32_t *times, const float *values, size_t n)
+{
+	if (!inited)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
+	if (n == 0)
+		return 0;
+	for (size_t i = 1; i < n; ++i)
+		if (times[i] < times[i - 1])
+			PELOG_ERROR_RETURN((PLV_WARNING, "Alog backfill data not sorted %s\n", name.c_str()), -1);
+	WriteSection ws(this);
+	if (!late.empty())
+		reseal();
+	if (bfsum.empty())	// first block
+	{
+		bfmin = UINT32_MAX;
+		bfmax = 0;
+		bfsum.assign(h.lvnum, 0);
+		bfcnt.assign(h.lvnum, 0);
+		bfround.assign(h.lvnum, 0);
+	}
+	firsttime = std::min(firsttime, times[0] - times[0] % lv[0].step);
+	batching = true;
+	batchup = lv[0].time;
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint32_t time = times[i] - times[i] % lv[0].step;
+		if (writestep == 0)
+			writestep = time - lv[0].step;
+		uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
+		if (lv[0].time == 0 || time > lv[0].time || time >= mintime0 && roundtime(time, lv[1].step) > lv[1].time)	// not sealed yet
+		{
+			append(time, values[i]);
+			continue;
+		}
+		if (time >= mintime0)	// within level 0
+		{
+			int32_t pos = lvtimepos(time, lv[0].time, lv[0].pos, lv[0].len, lv[0].step);
+			value0[pos] = values[i];
+			setdirty(0, pos);
+			bfmin = std::min(bfmin, time);
+			bfmax = std::max(bfmax, time);
+			continue;
+		}
+		// older than level 0, aggregate into upper levels directly
+		if (lv[h.lvnum - 1].time == 0)	// upper levels not started yet, start them before level 0 period
+		{
+			for (int level = 1; level < h.lvnum; ++level)
+			{
+				if (lv[level].time != 0)
+					continue;
+				lv[level].time = roundtime(mintime0, lv[level].step) - lv[level].step;
+				lv[level].pos = 1;
+			}
+		}
+		extendlast(time);
+		for (int level = 1; level < h.lvnum; ++level)
+		{
+			uint32_t round = roundtime(time, lv[level].step);
+			if (round != bfround[level])
+				bfflush(level);
+			bfround[level] = round;
+			if (!isnan(values[i]))
+			{
+				bfsum[level] += values[i];
+				bfcnt[level]++;
+			}
+		}
+	}
+	batching = false;
+	if (batchpending)
+	{
 		updatelevels();
+		batchpending = false;
 	}
-	else if (lv[0].time > 0)	// if got a history value, also expand pending num
+	ispending = true;
+	return 0;
+}
+
+// grow the last level at its front to hold history at `time`. it never rotates, so its oldest value is at pos 0.
+// the file is rewritten with the moved values on next updatefile()
+void Alog::extendlast(uint32_t time)
+{
+	int level = h.lvnum - 1;
+	uint32_t round = roundtime(time, lv[level].step);
+	uint32_t mintime = lv[level].time - (lv[level].pos - 1) * lv[level].step;
+	if (round >= mintime)
+		return;
+	int32_t expandlen = (int32_t)roundup((mintime - round) / lv[level].step, std::max(1, 86400 / lv[level].step));
+	// grow into new buffers, keeping the old ones for concurrent readers
+	std::vector<uint16_t> grown(value[level].size() + expandlen, setnan());
+	std::copy(value[level].begin(), value[level].end(), grown.begin() + expandlen);
+	retired.push_back(Retired{repoch.load(std::memory_order_relaxed), std::move(value[level]), {}});
+	value[level] = std::move(grown);
+	if (hascover())
 	{
-		pending[0] = std::max(pending[0], (int32_t)(lv[0].time - time) / lv[0].step);
-		ispending = true;
+		std::vector<uint8_t> grownc(cover[level].size() + expandlen, 0);
+		std::copy(cover[level].begin(), cover[level].end(), grownc.begin() + expandlen);
+		retired.back().cover = std::move(cover[level]);
+		cover[level] = std::move(grownc);
 	}
-	// write to file
-	if (ispending && updatefile() != 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "Alog write data failed %s\n", name.c_str()), -1);
+	lv[level].len += expandlen;
+	lv[level].pos += expandlen;
+	layout();
+	relocate = true;	// all values of the level moved
+}
+
+// journal record: JournalHead, name, JournalHead::num of { uint32_t time; float value; }
+struct JournalHead
+{
+	uint32_t magic;
+	uint32_t crc;	// of the rest of the record
+	uint16_t namelen;
+	int16_t stype;
+	uint32_t num;
+};
+static const uint32_t JOURNAL_MAGIC = 0x4a4d4131;	// "1AMJ"
+
+int Alog::journal(FILE *fp)
+{
+	if (!inited)
+		return 0;
+	// level 0 values since last file write, and before that within lateness which may have been updated since
+	std::vector<std::pair<uint32_t, float>> vals;
+	uint32_t from = writestep > (uint32_t)maxlate ? writestep - maxlate : 0;
+	for (int32_t i = 0; i < lv[0].len && lv[0].time >= (uint32_t)(i * lv[0].step); ++i)
+	{
+		uint32_t time = lv[0].time - i * lv[0].step;
+		if (time <= from || time < firsttime)
+			break;
+		float val = value0[(lv[0].pos + lv[0].len - 1 - i) % lv[0].len];
+		if (!isnan(val))
+			vals.emplace_back(time, val);
+	}
+	for (const LateVal &val: late)
+		vals.emplace_back(val.time, val.value);
+	std::stable_sort(vals.begin(), vals.end(),
+		[](const std::pair<uint32_t, float> &a, const std::pair<uint32_t, float> &b) { return a.first < b.first; });
+	std::vector<uint8_t> rec(sizeof(JournalHead) + name.size() + vals.size() * 8);
+	JournalHead head = { JOURNAL_MAGIC, 0, (uint16_t)name.size(), (int16_t)h.stype, (uint32_t)vals.size() };
+	memcpy(&rec[sizeof(head)], name.data(), name.size());
+	uint8_t *p = &rec[sizeof(head) + name.size()];
+	for (const auto &val: vals)
+	{
+		memcpy(p, &val.first, 4);
+		memcpy(p + 4, &val.second, 4);
+		p += 8;
+	}
+	memcpy(&rec[0], &head, sizeof(head));
+	head.crc = crc32c(&rec[sizeof(head.magic) + sizeof(head.crc)], rec.size() - sizeof(head.magic) - sizeof(head.crc));
+	memcpy(&rec[0], &head, sizeof(head));
+	if (fwrite(rec.data(), 1, rec.size(), fp) != rec.size())
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write journal failed %s\n", name.c_str()), -1);
+	inited = false;	// closed without writing
 	return 0;
 }
 
+int Alog::readjournal(FILE *fp, std::string &name, StoreType &type, std::vector<uint32_t> &times, std::vector<float> &values)
+{
+	JournalHead head;
+	size_t n = fread(&head, 1, sizeof(head), fp);
+	if (n == 0)
+		return 0;
+	if (n != sizeof(head) || head.magic != JOURNAL_MAGIC || head.stype != AMON_AUINT && head.stype != AMON_FP16)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Invalid journal record\n"), -1);
+	std::vector<uint8_t> rec(sizeof(head) + head.namelen + (size_t)head.num * 8);
+	memcpy(&rec[0], &head, sizeof(head));
+	if (fread(&rec[sizeof(head)], 1, rec.size() - sizeof(head), fp) != rec.size() - sizeof(head) ||
+		crc32c(&rec[sizeof(head.magic) + sizeof(head.crc)], rec.size() - sizeof(head.magic) - sizeof(head.crc)) != head.crc)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Corrupted journal record\n"), -1);
+	name.assign((const char *)&rec[sizeof(head)], head.namelen);
+	type = (StoreType)head.stype;
+	times.resize(head.num);
+	values.resize(head.num);
+	const uint8_t *p = &rec[sizeof(head) + head.namelen];
+	for (uint32_t i = 0; i < head.num; ++i, p += 8)
+	{
+		memcpy(&times[i], p, 4);
+		memcpy(&values[i], p + 4, 4);
+	}
+	return 1;
+}
+
+// write the aggregated backfill value of the current bucket in `level`, if the bucket is not covered by level 0
+void Alog::bfflush(int level)
+{
+	uint32_t round = bfround[level];
+	uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
+	if (round > 0 && round <= lv[level].time && round - lv[level].step + lv[0].step < mintime0)
+	{
+		int32_t pos = lvtimepos(round, lv[level].time, lv[level].pos, lv[level].len, lv[level].step);
+		if (pos >= 0)
+		{
+			setbucket(level, pos, bfcnt[level] > 0 ? bfsum[level] / bfcnt[level] : NAN, bfcnt[level]);
+		}
+	}
+	bfround[level] = 0;
+	bfsum[level] = 0;
+	bfcnt[level] = 0;
+}
+
+// finish backfilling: write the pending aggregated upper level values, re-aggregate upper level buckets covering
+// history values written to level 0, and write everything to file
+int Alog::backfillend()
+{
+	if (!inited)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
+	if (bfsum.empty())
+		return 0;
+	{
+		WriteSection ws(this);
+		uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
+		for (int level = 1; level < h.lvnum; ++level)
+		{
+			bfflush(level);
+			if (bfmin > bfmax)
+				continue;
+			uint32_t endround = std::min(roundtime(bfmax, lv[level].step), lv[level].time);
+			for (uint32_t round = roundtime(bfmin, lv[level].step); round <= endround; round += lv[level].step)
+			{
+				int32_t pos = lvtimepos(round, lv[level].time, lv[level].pos, lv[level].len, lv[level].step);
+				if (pos < 0 || round - lv[level].step + lv[0].step < mintime0)	// not covered by level 0
+					continue;
+				int32_t aggrc = 0;
+				double aggrv = aggr0(round, lv[level].step, aggrc);
+				setbucket(level, pos, aggrv, aggrc);
+			}
+		}
+	}
+	bfsum.clear();
+	bfcnt.clear();
+	bfround.clear();
+	return updatefile(true);
+}
+
 int Alog::updatelevel(int level)
 {
-	const int32_t UPDELAY = 60;	// delay writing in case of delayed data
+	const int32_t UPDELAY = conf->sealdelay;	// delay writing in case of delayed data
 
 	assert(lv[level].time % lv[level].step == 0);
 	uint32_t lrtime = roundtime(lv[level].time, lv[level].step);
@@ -288,29 +974,12 @@ int Alog::updatelevel(int level)
 	if (datatime < lrtime + lv[level].step + UPDELAY)	// no need to write yet
 		return 0;
 	// prepare data
-	uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
 	for (uint32_t curround = lrtime + lv[level].step; curround <= datatime - UPDELAY; curround += lv[level].step)
 	{
-		uint32_t btime0 = std::max(curround - lv[level].step + lv[0].step, mintime0);
-		int32_t bpos0 = lvtimepos(btime0, lv[0].time, lv[0].pos, lv[0].len, lv[0].step);
-		double aggrv = 0;
 		int32_t aggrc = 0;
-		if (bpos0 >= 0)
-		{
-			for (uint32_t steptime = btime0; steptime <= curround; steptime += lv[0].step, bpos0++)
-			{
-				if (bpos0 >= lv[0].len)
-					bpos0 = 0;
-				if (!isnan(value0[bpos0]))
-				{
-					aggrv += value0[bpos0];
-					aggrc++;
-				}
-			}
-		}
-		aggrv = aggrc > 0 ? (float)(aggrv / aggrc) : NAN;
+		double aggrv = aggr0(curround, lv[level].step, aggrc);
 		// record new value
-		value[level][lv[level].pos] = aggrc > 0 ? raw2store(aggrv) : setnan();
+		int32_t wpos = lv[level].pos;
 		lv[level].time = curround;
 		lv[level].pos++;
 		if (lv[level].pos >= lv[level].len)	// need rotating
@@ -323,33 +992,127 @@ int Alog::updatelevel(int level)
 				size_t orilen = value[level].size();
 				size_t oriperiod = value[level].size() * lv[level].step;
 				size_t expandlen = std::max(86400, std::min(30 * 86400, (int)roundup(oriperiod / 4, 86400))) / lv[level].step;
-				value[level].resize(value[level].size() + expandlen, setnan());
-				// also expand the file
-				FILEGuard fp = fopen(filename.c_str(), "r+b");
-				if (!fp)
-					PELOG_ERROR_RETURN((PLV_ERROR, "Expand data file failed %s\n", filename.c_str()), -1);
-				fseek(fp, lv[level].off + sizeof(value[level][0]) * lv[level].len, SEEK_SET);
-				if (fwrite(&value[level][orilen], sizeof(value[level][0]), expandlen, fp) != expandlen)
-					PELOG_ERROR_RETURN((PLV_ERROR, "Expand data file failed %d %s\n", (int)expandlen, filename.c_str()), -1);
+				// grow into new buffers, keeping the old ones for concurrent readers
+				std::vector<uint16_t> grown(value[level].size() + expandlen, setnan());
+				std::copy(value[level].begin(), value[level].end(), grown.begin());
+				retired.push_back(Retired{repoch.load(std::memory_order_relaxed), std::move(value[level]), {}});
+				value[level] = std::move(grown);
+				if (hascover())
+				{
+					std::vector<uint8_t> grownc(cover[level].size() + expandlen, 0);
+					std::copy(cover[level].begin(), cover[level].end(), grownc.begin());
+					retired.back().cover = std::move(cover[level]);
+					cover[level] = std::move(grownc);
+				}
+				int32_t oriblk = (int32_t)(orilen * sizeof(value[level][0]) / ALOG_BLKSIZE);
+				int32_t blkcap = h.blkcap;
 				lv[level].len += expandlen;
-				// level info will be written in updatefile(). datafile integrity is still OK before that.
+				layout();
+				// also expand the file, in updatefile(). datafile integrity is still OK before that
+				if (h.blkcap != blkcap || hascover())	// crc table is full or coverage areas moved, relocate all data
+					relocate = true;
+				else
+				{
+					for (int32_t blk = blkbase[level] + oriblk; blk < blkbase[level + 1]; ++blk)
+					{
+						if (!blkdirty[blk])
+						{
+							blkdirty[blk] = true;
+							ndirty++;
+						}
+					}
+				}
 			}
 		}
-		pending[level]++;
+		setbucket(level, wpos, aggrv, aggrc);
 		ispending = true;
 	}
 	return 0;
 }
 
+// average of non-NAN level 0 values within (round - step, round]. number of values is returned in `cnt`
+double Alog::aggr0(uint32_t round, int32_t step, int32_t &cnt) const
+{
+	uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
+	uint32_t btime0 = std::max(round - step + lv[0].step, mintime0);
+	int32_t bpos0 = btime0 <= lv[0].time ? lvtimepos(btime0, lv[0].time, lv[0].pos, lv[0].len, lv[0].step) : -1;
+	double aggrv = 0;
+	cnt = 0;
+	if (bpos0 >= 0)
+	{
+		for (uint32_t steptime = btime0; steptime <= round && steptime <= lv[0].time; steptime += lv[0].step, bpos0++)
+		{
+			if (bpos0 >= lv[0].len)
+				bpos0 = 0;
+			if (!isnan(value0[bpos0]))
+			{
+				aggrv += value0[bpos0];
+				cnt++;
+			}
+		}
+	}
+	return cnt > 0 ? (float)(aggrv / cnt) : NAN;
+}
+
+// record aggregated value of `cnt` level 0 values to `pos` of `level`, with its coverage
+void Alog::setbucket(int level, int32_t pos, double aggrv, int32_t cnt)
+{
+	value[level][pos] = cnt > 0 ? raw2store(aggrv) : setnan();
+	setdirty(level, pos);
+	if (hascover())
+	{
+		int32_t full = lv[level].step / lv[0].step;
+		cover[level][pos] = cnt > 0 ? (uint8_t)std::max(1, std::min(255, (cnt * 255 + full / 2) / full)) : 0;
+		setdirty(coverarea(level), pos);
+	}
+}
+
+// apply late values in reorder buffer to level 0, and re-aggregate the sealed upper level buckets they fall in.
+// each affected bucket is re-aggregated only once
+void Alog::reseal()
+{
+	std::stable_sort(late.begin(), late.end(), [](const LateVal &a, const LateVal &b) { return a.time < b.time; });
+	uint32_t mintime0 = lvmintime(lv[0].time, lv[0].len, lv[0].step);
+	for (const LateVal &lval: late)
+	{
+		if (lval.time < mintime0)	// rotated out meanwhile
+			continue;
+		int32_t pos = lvtimepos(lval.time, lv[0].time, lv[0].pos, lv[0].len, lv[0].step);
+		value0[pos] = lval.value;
+		setdirty(0, pos);
+	}
+	for (int level = 1; level < h.lvnum; ++level)
+	{
+		uint32_t lastround = 0;
+		for (const LateVal &lval: late)
+		{
+			uint32_t round = roundtime(lval.time, lv[level].step);
+			if (round == lastround || round > lv[level].time || lval.time < mintime0)	// done, not sealed yet, or dropped
+				continue;
+			lastround = round;
+			int32_t pos = lvtimepos(round, lv[level].time, lv[level].pos, lv[level].len, lv[level].step);
+			if (pos < 0)
+				continue;
+			int32_t aggrc = 0;
+			double aggrv = aggr0(round, lv[level].step, aggrc);
+			setbucket(level, pos, aggrv, aggrc);
+		}
+	}
+	late.clear();
+	ispending = true;
+}
+
 int Alog::updatefile(bool force)
 {
 	const int32_t MINWRITESTEP = 600;	// write to disk every WRITESTEP (data) seconds
 	const int32_t MINWRITETIME = 120;	// write to disk every WRITETIME (system) seconds
 	//const int32_t MINWRITETIME = 1;	// write to disk every WRITETIME (system) seconds
 
-	if (force && !ispending && pending[0] == 0 || !force && (!ispending || lv[0].time < writestep + MINWRITESTEP))	// no pending data
+	if (relocate)
+		;	// written now, as the data areas in file no longer match the level info
+	else if (force && !ispending && ndirty == 0 || !force && (!ispending || lv[0].time < writestep + MINWRITESTEP))	// no pending data
 		return 0;
-	if (!force)
+	else if (!force)
 	{
 		uint32_t curtime = (uint32_t)time(NULL);
 		if (curtime < writetime + MINWRITETIME && curtime + MINWRITETIME > writetime)
@@ -358,41 +1121,95 @@ int Alog::updatefile(bool force)
 	}
 	writetime = (uint32_t)time(NULL);
 	writestep = lv[0].time;
+	if (!late.empty())
+	{
+		WriteSection ws(this);
+		reseal();
+	}
+	if (relocate)
+	{
+		if (writeall() != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Expand data file failed %s\n", filename.c_str()), -1);
+		relocate = false;
+		ispending = false;
+		return 0;
+	}
 	// to write to file
 	PELOG_LOG((PLV_DEBUG, "To write to file %s\n", filename.c_str()));
 	FILEGuard fp = fopen(filename.c_str(), "r+b");
 	if (!fp)
 		PELOG_ERROR_RETURN((PLV_WARNING, "Write failed %s\n", filename.c_str()), -1);
-	// write level info
-	fseek(fp, sizeof(FileHeader), SEEK_SET);
-	if ((int)fwrite(lv.data(), sizeof(lv[0]), h.lvnum, fp) != h.lvnum)
-		PELOG_ERROR_RETURN((PLV_WARNING, "Write lvinfo failed %s\n", filename.c_str()), -1);
-	for (int level = 0; level < h.lvnum; ++level)
+	// write dirty level data, in whole blocks so that crc in blkcrc always matches file content
+	for (int area = 0; area < areanum() && ndirty > 0; ++area)
 	{
-		if (pending[level] <= 0)
-			continue;
-		pending[level] = std::min(pending[level], lv[level].len);
-		int bpos = std::max(lv[level].pos - pending[level], 0);
-		size_t isize = level == 0 ? sizeof(value0[0]) : sizeof(value[level][0]);
-		const void *pdata = level == 0 ? (const void *)&value0[bpos] : (const void *)&value[level][bpos];
-		fseek(fp, lv[level].off + isize * bpos, SEEK_SET);
-		if ((int)fwrite(pdata, isize, lv[level].pos - bpos, fp) != lv[level].pos - bpos)
-			PELOG_ERROR_RETURN((PLV_WARNING, "Write lvdata failed %s\n", filename.c_str()), -1);
-		if (lv[level].pos < pending[level])	// more to write at the end of data buffer
-		{
-			bpos = lv[level].len - (pending[level] - lv[level].pos);
-			pdata = level == 0 ? (const void *)&value0[bpos] : (const void *)&value[level][bpos];
-			fseek(fp, lv[level].off + isize * bpos, SEEK_SET);
-			if ((int)fwrite(pdata, isize, lv[level].len - bpos, fp) != lv[level].len - bpos)
-				PELOG_ERROR_RETURN((PLV_WARNING, "Write lvdata failed %s\n", filename.c_str()), -1);
-		}
-		pending[level] = 0;
+		for (int32_t blk = 0, blknum = lvblocks(area); blk < blknum; )
+		{
+			if (!blkdirty[blkbase[area] + blk])
+			{
+				++blk;
+				continue;
+			}
+			int32_t eblk = blk + 1;
+			while (eblk < blknum && blkdirty[blkbase[area] + eblk])
+				++eblk;
+			if (writeblocks(fp, area, blk, eblk) != 0)
+				return -1;
+			blk = eblk;
+		}
 	}
+	// write crc and level info
+	if (writeheader(fp) != 0)
+		return -1;
 	ispending = false;
 
 	return 0;
 }
 
+// verify data blocks in file against their crc, at most `budget` bytes. return 1 if a whole pass has been finished
+// blocks failed verification are rewritten with in memory data on next file update if that is known good, or
+// discarded otherwise, as their data was loaded from the same file
+int Alog::scrub(size_t &budget)
+{
+	if (!inited || blkcrc.empty() || relocate)	// the file is rewritten on next update anyway
+		return 1;
+	FILEGuard fp = fopen(filename.c_str(), "rb");
+	if (!fp)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Scrub open failed %s\n", filename.c_str()), 1);
+	uint8_t buf[ALOG_BLKSIZE];
+	int area = 0;
+	for (; budget > 0 && scrubblk < (int32_t)blkcrc.size(); ++scrubblk)
+	{
+		while (scrubblk >= blkbase[area + 1])
+			++area;
+		size_t boff = (size_t)(scrubblk - blkbase[area]) * ALOG_BLKSIZE;
+		size_t len = std::min((size_t)ALOG_BLKSIZE, lvbytes(area) - boff);
+		fseek(fp, areaoff[area] + boff, SEEK_SET);
+		if (blkdirty[scrubblk])
+			;	// to be rewritten anyway
+		else if (fread(buf, 1, len, fp) == len && crc32c(buf, len) == blkcrc[scrubblk])
+			blkchecked[scrubblk] = true;
+		else if (blkchecked[scrubblk])
+		{
+			PELOG_LOG((PLV_ERROR, "Scrub data block crc mismatch %d:%d, to rewrite %s\n",
+				area, (int)(scrubblk - blkbase[area]), filename.c_str()));
+			blkdirty[scrubblk] = true;
+			ndirty++;
+			ispending = true;
+		}
+		else
+		{
+			PELOG_LOG((PLV_ERROR, "Scrub data block crc mismatch %d:%d, discarded %s\n",
+				area, (int)(scrubblk - blkbase[area]), filename.c_str()));
+			discardblock(area, scrubblk - blkbase[area]);
+		}
+		budget -= std::min(budget, len);
+	}
+	if (scrubblk < (int32_t)blkcrc.size())
+		return 0;
+	scrubblk = 0;
+	return 1;
+}
+
 void Alog::dump()
 {
 	if (!inited)
@@ -426,8 +1243,40 @@ void Alog::dump()
 	}
 }
 
-// obtain best fit [start, end) and step (return value), based on suggested [start, end), curtime, and lenth
-int32_t Alog::getrangeparam(uint32_t &start, uint32_t &end, uint32_t cur, int32_t len/* = 500*/)
+int32_t gcd(int32_t a, int32_t b)
+{
+	while (b != 0)
+	{
+		int32_t n = a % b;
+		a = b;
+		b = n;
+	}
+	return a;
+}
+
+// step of the level to read for a range starting from `start`
+int32_t Alog::levelstep(uint32_t start, uint32_t cur) const
+{
+	if (!inited)
+		return 0;
+	int level = 0;
+	for (level = 0; level < h.lvnum - 1; ++level)
+		if (start >= cur || cur - start <= (uint32_t)(lv[level].step * lv[level].len))
+			break;
+	return lv[level].step;
+}
+
+// least common multiple of level steps
+int32_t Alog::commonstep(int32_t a, int32_t b)
+{
+	if (a == 0 || b == 0)
+		return a + b;
+	return a / gcd(a, b) * b;
+}
+
+// obtain best fit [start, end) and step (return value), based on suggested [start, end), curtime, and lenth.
+// the step is a multiple of `lvstep`, the steps of the levels to read from
+int32_t Alog::getrangeparam(uint32_t &start, uint32_t &end, uint32_t cur, int32_t lvstep, int32_t len/* = 500*/)
 {
 	end = std::min(end, cur);
 	if (start >= end)
@@ -435,45 +1284,110 @@ int32_t Alog::getrangeparam(uint32_t &start, uint32_t &end, uint32_t cur, int32_
 		start = end = 0;
 		return 0;
 	}
-	// determine the level to use
-	int level = 0;
-	for (level = 0; level < ALOG_DEF_LVNUM - 1; ++level)
-		if (cur - start <= (uint32_t)VPERIOD[level])
-			break;
+	if (lvstep == 0)	// no data at all
+		lvstep = AMON_DEFSTEP;
 	// determine the step
-	int32_t step = VSTEP[level];
-	step = roundup((end - start) / len, step);
+	int32_t step = roundup((end - start) / len, lvstep);
 	// determine the real range
 	start = roundup(start, step);
 	end = std::max(start + step, roundup(end, step));
 	return step;
 }
 
-int32_t gcd(int32_t a, int32_t b)
+// copy level info and data pointers into `v` when no write is in progress. return the seqlock sequence of the copy
+uint32_t Alog::snapshot(View &v) const
 {
-	while (b != 0)
+	while (true)
 	{
-		int32_t n = a % b;
-		a = b;
-		b = n;
+		uint32_t seq = wseq.load();
+		if (seq & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		v.lvnum = h.lvnum;
+		v.hascover = hascover();
+		v.store2raw = store2raw;
+		v.value0 = value0.data();
+		for (int level = 0; level < h.lvnum; ++level)
+		{
+			v.lv[level] = lv[level];
+			v.value[level] = level == 0 ? NULL : value[level].data();
+			v.cover[level] = level == 0 || !v.hascover ? NULL : cover[level].data();
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (wseq.load(std::memory_order_relaxed) == seq)
+			return seq;
 	}
-	return a;
 }
 
-int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
+// run `func` on a snapshot `v` of the log, until no write happened during the run
+template <typename F>
+int Alog::readview(View &v, F func) const
 {
+	uint32_t epoch;
+	while (true)	// register in the current epoch, retry if it advanced meanwhile
+	{
+		epoch = repoch.load();
+		nreaders[epoch & 1]++;
+		if (repoch.load() == epoch)
+			break;
+		nreaders[epoch & 1]--;
+	}
+	int ret = 0;
+	while (true)
+	{
+		uint32_t seq = snapshot(v);
+		ret = func();
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (wseq.load(std::memory_order_relaxed) == seq)
+			break;
+	}
+	nreaders[epoch & 1]--;
+	return ret;
+}
+
+// free retired level buffers once no reader of their epoch or an earlier one is left, and advance the epoch for
+// the ones retired in the current epoch. called by the writer at the end of a write section
+void Alog::reclaim()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint32_t epoch = repoch.load();
+	if (nreaders[(epoch + 1) & 1].load() != 0)	// readers of the previous epoch still running
+		return;
+	retired.erase(std::remove_if(retired.begin(), retired.end(), [epoch](const Retired &r) { return r.epoch != epoch; }),
+		retired.end());
+	if (!retired.empty())
+		repoch.store(epoch + 1);
+}
+
+int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf, float *coverbuf) const
+{
+	if (!inited)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
 	if (start >= end || start % step != 0 || end % step != 0)
 		PELOG_ERROR_RETURN((PLV_WARNING, "Alog getrange param error\n"), -1);
+	View v;
+	return readview(v, [&]() { return getrange(v, start, end, step, buf, coverbuf); });
+}
+
+// getrange() on snapshot `v`
+int Alog::getrange(const View &v, uint32_t start, uint32_t end, int32_t step, float *buf, float *coverbuf)
+{
+	const LevelInfo *lv = v.lv;
+	const float *value0 = v.value0;
+	const uint16_t *const *value = v.value;
+	double (*store2raw)(uint16_t) = v.store2raw;
 	// look for a matched level
 	int32_t level = -1;
-	for (level = h.lvnum - 1; level >= 0; --level)
+	for (level = v.lvnum - 1; level >= 0; --level)
 	{
 		if (lv[level].time > 0 && lvmintime(lv[level].time, lv[level].len, lv[level].step) <= start && step % lv[level].step == 0)
 			break;
 	}
 	if (level < 0)	// if no perfectly suitible level found, look for an approximation
 	{
-		for (level = 0; level < h.lvnum - 1; ++level)	// look for the first level that covers the whole range
+		for (level = 0; level < v.lvnum - 1; ++level)	// look for the first level that covers the whole range
 			if (lv[level].time == 0 || lvmintime(lv[level].time, lv[level].len, lv[level].step) <= start)
 				break;
 		if (level > 0 && lv[level].time == 0)	// no data, use the one that has most data
@@ -483,7 +1397,7 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 		else if (lv[level].step < step) // look for the level with smaller step and largest gcd(step)
 		{
 			int32_t higcd = gcd(lv[level].step, step);
-			for (int32_t nowlevel = level + 1; nowlevel < h.lvnum && lv[nowlevel].step < step; nowlevel++)
+			for (int32_t nowlevel = level + 1; nowlevel < v.lvnum && lv[nowlevel].step < step; nowlevel++)
 			{
 				int32_t nowgcd = gcd(lv[nowlevel].step, step);
 				if (nowgcd >= higcd)
@@ -498,18 +1412,22 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 			;
 	}
 	// fill the data
+	auto put = [&buf, &coverbuf](float val, float cov) {
+		*buf++ = val;
+		if (coverbuf)
+			*coverbuf++ = cov;
+	};
 	uint32_t lvtime = lvmintime(lv[level].time, lv[level].len, lv[level].step);
 	if (lvtime == 0)	// no data at all
 	{
 		assert(level == 0);
-		for (; start < end; start += step, ++buf)
-			*buf = NAN;
+		for (; start < end; start += step)
+			put(NAN, 0);
 		return 0;
 	}
-	int fillidx = 0;
 	// before earliest data
-	for (; start < lvtime && start < end; start += step, ++buf)
-		*buf = NAN;
+	for (; start < lvtime && start < end; start += step)
+		put(NAN, 0);
 	// data within lv[level]
 	int lvpos = 0;
 	if (lvtime > 0 && lvtime < end)
@@ -526,20 +1444,23 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 	}
 	if (lv[level].step <= step)
 	{
-		for (; start <= lv[level].time && start < end; start += step, ++buf)
+		// average of level values weighted by their coverage, so that the result matches averaging level 0 values
+		for (; start <= lv[level].time && start < end; start += step)
 		{
 			float val = 0;
+			float wsum = 0;
 			int cnt = 0;
-			for (; lvtime <= start; lvtime += lv[level].step, lvpos = (lvpos + 1) % lv[level].len)
+			for (; lvtime <= start; lvtime += lv[level].step, lvpos = (lvpos + 1) % lv[level].len, ++cnt)
 			{
 				float fval = level == 0 ? value0[lvpos] : store2raw(value[level][lvpos]);
-				if (!isnan(fval))
+				float w = v.coverof(level, lvpos, fval);
+				if (w > 0)
 				{
-					val += fval;
-					cnt++;
+					val += fval * w;
+					wsum += w;
 				}
 			}
-			*buf = cnt > 0 ? val / cnt : NAN;
+			put(wsum > 0 ? val / wsum : NAN, cnt > 0 ? wsum / cnt : 0);
 		}
 	}
 	else
@@ -547,8 +1468,9 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 		for (; lvtime <= lv[level].time && lvtime < end; lvtime += lv[level].step, lvpos = (lvpos + 1) % lv[level].len)
 		{
 			float val = level == 0 ? value0[lvpos] : store2raw(value[level][lvpos]);
-			for (; start <= lvtime && start < end; start += step, ++buf)
-				*buf = val;
+			float cov = v.coverof(level, lvpos, val);
+			for (; start <= lvtime && start < end; start += step)
+				put(val, cov);
 		}
 	}
 	// data not in lv[level] but in lv[0]
@@ -560,20 +1482,21 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 		lvpos = lvtimepos(lvtime, lv[0].time, lv[0].pos, lv[0].len, lv[0].step);
 		if (lv[0].step <= step)
 		{
-			for (; start <= lv[0].time && start < end; start += step, ++buf)
+			for (; start <= lv[0].time && start < end; start += step)
 			{
 				float val = 0;
+				int vcnt = 0;
 				int cnt = 0;
-				for (; lvtime <= start; lvtime += lv[0].step, lvpos = (lvpos + 1) % lv[0].len)
+				for (; lvtime <= start; lvtime += lv[0].step, lvpos = (lvpos + 1) % lv[0].len, ++cnt)
 				{
 					float fval = value0[lvpos];
 					if (!isnan(fval))
 					{
 						val += fval;
-						cnt++;
+						vcnt++;
 					}
 				}
-				*buf = cnt > 0 ? val / cnt : NAN;
+				put(vcnt > 0 ? val / vcnt : NAN, cnt > 0 ? (float)vcnt / cnt : 0);
 			}
 		}
 		else
@@ -581,26 +1504,39 @@ int Alog::getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const
 			for (; lvtime <= lv[0].time && lvtime < end; lvtime += lv[0].step, lvpos = (lvpos + 1) % lv[0].len)
 			{
 				float val = value0[lvpos];
-				for (; start <= lvtime && start < end; start += step, ++buf)
-					*buf = val;
+				for (; start <= lvtime && start < end; start += step)
+					put(val, isnan(val) ? 0 : 1);
 			}
 		}
 	}
 	// unavailable new data
-	for (; start < end; start += step, ++buf)
-		*buf = NAN;
+	for (; start < end; start += step)
+		put(NAN, 0);
 	return 0;
 }
 
 // obtain aggregated (sum(stepval*steptime)) values of given time ranges: [ranges[i], ranges[i+1]) -> buf[i]. buf should have been pre-allocated for ranges.
 // Unlike getrange(), ranges in aggrrange() can be of different lengths, to support monthly/yearly aggregation
-int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
+int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf, float *coverbuf) const
 {
+	if (!inited)
+		PELOG_ERROR_RETURN((PLV_WARNING, "Alog not inited %s\n", name.c_str()), -1);
+	View v;
+	return readview(v, [&]() { return aggrrange(v, ranges, buf, coverbuf); });
+}
+
+// aggrrange() on snapshot `v`
+int Alog::aggrrange(const View &v, const std::vector<uint32_t> &ranges, float *buf, float *coverbuf)
+{
+	const LevelInfo *lv = v.lv;
+	const float *value0 = v.value0;
+	const uint16_t *const *value = v.value;
+	double (*store2raw)(uint16_t) = v.store2raw;
 	if (ranges.size() < 2 || lv[0].time == 0)
 		return 0;
 	// determine the level to use
 	int level = 0;
-	for (level = lv.size() - 1; level >= 0; --level)	// find the first level with appropriate step
+	for (level = v.lvnum - 1; level >= 0; --level)	// find the first level with appropriate step
 	{
 		if (lv[level].step <= (int)(ranges[1] - ranges[0]) && lv[level].time > 0)
 			break;
@@ -613,19 +1549,24 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 		assert(lv[0].step > (int)(ranges[1] - ranges[0]));
 		level = 0;
 	}
-	while (level < (int)lv.size() - 1 && lv[level].time > 0 && lvmintime(lv[level].time, lv[level].len, lv[level].step) > ranges[0])
+	while (level < (int)v.lvnum - 1 && lv[level].time > 0 && lvmintime(lv[level].time, lv[level].len, lv[level].step) > ranges[0])
 		level++;
 	if (lv[level].time == 0)
 		level--;
 	// calculate data
+	auto put = [&buf, &coverbuf, &ranges](size_t ridx, float val, float covtime) {
+		*buf++ = val;
+		if (coverbuf)
+			*coverbuf++ = covtime / (ranges[ridx] - ranges[ridx - 1]);
+	};
 	size_t ridx = 1;
 	uint32_t lvend = lvmintime(lv[level].time, lv[level].len, lv[level].step);
 	uint32_t lvbegin = lvend - lv[level].step;
 	int32_t lvpos = lvtimepos(lvend, lv[level].time, lv[level].pos, lv[level].len, lv[level].step);
 	assert(lvend != 0 && lvend > lvbegin);
 	// values before level data
-	for (; ridx < ranges.size() && ranges[ridx] <= lvbegin; ridx++, buf++)
-		*buf = 0;
+	for (; ridx < ranges.size() && ranges[ridx] <= lvbegin; ridx++)
+		put(ridx, 0, 0);
 	// values within level
 	while (lvend <= ranges[ridx - 1] && lvend <= lv[level].time)	// locate the first value in level for range
 	{
@@ -634,7 +1575,8 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 		lvpos = lvpos < lv[level].len - 1 ? (lvpos + 1) : 0;
 	}
 	float rangeval = 0;
-	for (; ridx < ranges.size() && lvend <= lv[level].time; ridx++, buf++)
+	float rangecov = 0;	// time covered by level 0 values
+	for (; ridx < ranges.size() && lvend <= lv[level].time; ridx++)
 	{
 		uint32_t rgbegin = ranges[ridx - 1];
 		uint32_t rgend = ranges[ridx];
@@ -644,8 +1586,12 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 			int covertime = std::min(lvend, rgend) - std::max(lvbegin, rgbegin);
 			assert(covertime > 0);
 			float stepval = level == 0 ? value0[lvpos] : store2raw(value[level][lvpos]);
-			if (!isnan(stepval))
-				rangeval += stepval * covertime;
+			float stepcov = v.coverof(level, lvpos, stepval);
+			if (stepcov > 0)
+			{
+				rangeval += stepval * covertime * stepcov;
+				rangecov += covertime * stepcov;
+			}
 			if (lvend <= rgend)	// range covers all current value, go to next value in level
 			{
 				lvbegin = lvend;
@@ -660,8 +1606,9 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 		if (lvend <= lv[level].time && lvend >= rgend || lvend > lv[level].time && lvbegin >= rgend)  // current level value go beyond current range, finish current range
 		{
 			assert(!isnan(rangeval));
-			*buf = rangeval;
+			put(ridx, rangeval, rangecov);
 			rangeval = 0;
+			rangecov = 0;
 			continue;
 		}
 		else	// current range is not finished but no more level values in range
@@ -677,7 +1624,7 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 		lvend = lvbegin + lv[0].step;
 		lvpos = lvtimepos(lvend, lv[0].time, lv[0].pos, lv[0].len, lv[0].step);
 		assert(lvpos >= 0);
-		for (; ridx < ranges.size() && lvend <= lv[0].time; ridx++, buf++)
+		for (; ridx < ranges.size() && lvend <= lv[0].time; ridx++)
 		{
 			uint32_t rgbegin = ranges[ridx - 1];
 			uint32_t rgend = ranges[ridx];
@@ -685,27 +1632,32 @@ int Alog::aggrrange(const std::vector<uint32_t> &ranges, float *buf) const
 			assert(lvbegin < rgend && rgbegin < lvend);
 			while (lvend <= rgend && lvend <= lv[0].time)
 			{
-				if (!isnan(value0[lvpos]))
-					rangeval += value0[lvpos] * lv[0].step;
+				float val = value0[lvpos];	// read once, it may be changed by the writer meanwhile
+				if (!isnan(val))
+				{
+					rangeval += val * lv[0].step;
+					rangecov += lv[0].step;
+				}
 				lvbegin = lvend;
 				lvend += lv[0].step;
 				lvpos = lvpos < lv[0].len - 1 ? (lvpos + 1) : 0;
 			}
 			assert(!isnan(rangeval));
-			*buf = rangeval;
+			put(ridx, rangeval, rangecov);
 			rangeval = 0;
+			rangecov = 0;
 		}
 	}
 	assert(!isnan(rangeval));
 	if (rangeval > 0)	// Aggregation should only be performed on positive values. Just drop the negatives.
 	{
 		assert(ridx < ranges.size());
-		*buf++ = rangeval;
+		put(ridx, rangeval, rangecov);
 		ridx++;
 	}
 	// having done with all avaiable data, fill in the left ranges with 0
-	for (; ridx < ranges.size(); ridx++, buf++)
-		*buf = 0;
+	for (; ridx < ranges.size(); ridx++)
+		put(ridx, 0, 0);
 	return 0;
 }
 
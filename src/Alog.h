@@ -3,17 +3,50 @@
 #include <vector>
 #include <stdint.h>
 #include <array>
+#include <algorithm>
+#include <math.h>
+#include <atomic>
 #include "AMon.h"
 #include "resguard.h"
 #include "pe_log.h"
 
 #define ALOG_DEF_LVNUM 4
+#define ALOG_MAXLV 20	// max number of levels of a schema
 static_assert(ALOG_DEF_LVNUM >= 2, "Too few levels");
+#define ALOG_MAGIC 0x474f4c41	// "ALOG"
+#define ALOG_VERSION 2
+#define ALOG_BLKSIZE 4096	// size (bytes) of data blocks, each protected by a crc
+#define ALOG_FLAG_COVER 0x1	// upper level values are stored with their level 0 sample coverage
+
+// level setup of new data files. a new series uses the first schema whose `match` is a prefix of its name
+// memory (and disk) cost per series is 4 * periods[0] / steps[0] + 2 * sum(periods[i] / steps[i]) (i > 0) bytes,
+// which is 195KB for the default schema (5s:1d, 60s:15d, 600s:183d, 1800s:365d), and 465KB for 1s:1d with the same
+// upper levels. `coverage` adds 1 byte per upper level value. the last level keeps growing after its initial period
+struct AlogSchema
+{
+	std::string match;	// series name prefix, empty to match all
+	std::vector<int32_t> steps;	// step (seconds) of each level
+	std::vector<int32_t> periods;	// time span (seconds) of each level
+	bool coverage = false;	// record level 0 sample coverage of upper level values
+	size_t bytes() const;
+	int check() const;
+};
+
+// storage options shared by all Alog of an AMon
+struct AlogConf
+{
+	bool fullverify = false;	// verify crc of all data blocks on load. otherwise only header crc is checked
+	int32_t sealdelay = 60;	// seconds to wait for delayed level 0 data before sealing an upper level bucket
+	int32_t lateness = 60;	// max seconds a value may fall behind the latest one. limited by level 0 period
+	std::vector<AlogSchema> schemas;	// the default schema is used if none matches
+	int loadschemas(const config_setting_t *config);
+	const AlogSchema &schema(const char *name) const;
+};
 
 class Alog
 {
 public:
-	Alog();
+	Alog(const AlogConf *conf = NULL);
 	int init(const char *dir, const char *name, StoreType type);
 	~Alog();
 
@@ -24,21 +57,117 @@ public:
 		return addv(time, value);
 	}
 	int addv(uint32_t time, double value);
+	// add `n` values in one go, like addv() for each but with upper levels updated and file written once at the end
+	int addv_batch(const uint32_t *times, const float *values, size_t n, StoreType type)
+	{
+		if (type != h.stype)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Type not match %s\n", filename.c_str()), -1);
+		return addv_batch(times, values, n);
+	}
+	int addv_batch(const uint32_t *times, const float *values, size_t n);
+	// bulk write of history data, `times` must be sorted. call backfillend() after the last block
+	int backfill(const uint32_t *times, const float *values, size_t n);
+	int backfillend();
+	// write all pending data to file
+	int flush() { return inited ? updatefile(true) : 0; }
+	bool dirty() const { return inited && (ispending || relocate || ndirty > 0); }
+	// append level 0 values not yet safely in file to a journal instead of writing the file, which is quicker for many
+	// logs. the log is closed without writing after that. replay with readjournal() and backfill()
+	int journal(FILE *fp);
+	// read next journal record. return 1 if got one, 0 at end of journal
+	static int readjournal(FILE *fp, std::string &name, StoreType &type, std::vector<uint32_t> &times, std::vector<float> &values);
 	void dump();
 
-	// obtain best fit [start, end) and step (return value), based on suggested [start, end), curtime, and lenth
-	static int32_t getrangeparam(uint32_t &start, uint32_t &end, uint32_t cur, int32_t len=500);
-	// obtain average values of given time ranges
-	int getrange(uint32_t start, uint32_t end, int32_t step, float *buf) const;
+	// level 0 step of this log
+	int32_t step0() const { return inited ? lv[0].step : conf->schema(name.c_str()).steps[0]; }
+	// step of the level to read for a range starting from `start`
+	int32_t levelstep(uint32_t start, uint32_t cur) const;
+	// a step that is a multiple of both level steps `a` and `b`. 0 is ignored
+	static int32_t commonstep(int32_t a, int32_t b);
+	// obtain best fit [start, end) and step (return value), based on suggested [start, end), curtime, and lenth.
+	// `lvstep` is levelstep() (or commonstep() of them for multiple logs) of the logs to read
+	static int32_t getrangeparam(uint32_t &start, uint32_t &end, uint32_t cur, int32_t lvstep, int32_t len=500);
+	// getrange() and aggrrange() may be called from other threads concurrently with the writing thread. they read a
+	// consistent snapshot of the log, and are retried if it was updated meanwhile
+	// obtain average values of given time ranges. if `coverbuf` is given, fraction of level 0 steps having values within
+	// each range is also returned
+	int getrange(uint32_t start, uint32_t end, int32_t step, float *buf, float *coverbuf = NULL) const;
 	// obtain aggregated (sum(stepval*steptime)) values of given time ranges: [ranges[i], ranges[i+1]) -> buf[i]. buf should have been pre-allocated for ranges.
 	// Unlike getrange(), ranges in aggrrange() can be of different lengths, to support monthly/yearly aggregation
-	int aggrrange(const std::vector<uint32_t> &ranges, float *buf) const;
+	// values in upper levels are weighted by their coverage, and coverage of each range is returned in `coverbuf` if given
+	int aggrrange(const std::vector<uint32_t> &ranges, float *buf, float *coverbuf = NULL) const;
+	// verify data blocks in file against their crc, at most `budget` bytes. return 1 if a whole pass has been finished
+	int scrub(size_t &budget);
 
 private:
 	int updatelevels() { for (int i = 1; i < h.lvnum; ++i) if (updatelevel(i) < 0) return -1; return 0; }
 	int updatelevel(int level);
+	void uplevels();
+	int put(uint32_t time, float value);
+	void append(uint32_t time, float value);
+	void bfflush(int level);
+	double aggr0(uint32_t round, int32_t step, int32_t &cnt) const;
+	void setbucket(int level, int32_t pos, double aggrv, int32_t cnt);
+	void reseal();
 	int updatefile(bool force=false);
+	// concurrent readers: the writer marks updates of levels in memory with a seqlock (`wseq` is odd while updating),
+	// and writes files outside of it. readers copy level info and data pointers into a View, run on it, and retry if
+	// `wseq` has changed. level buffers replaced by expansion are kept in `retired` until no reader can see them, see
+	// reclaim()
+	struct View;
+	struct WriteSection
+	{
+		Alog *log;
+		WriteSection(Alog *log): log(log)
+		{
+			log->wseq.store(log->wseq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		~WriteSection()
+		{
+			log->wseq.store(log->wseq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			if (!log->retired.empty())
+				log->reclaim();
+		}
+	};
+	void reclaim();
+	uint32_t snapshot(View &v) const;
+	template <typename F> int readview(View &v, F func) const;
+	static int getrange(const View &v, uint32_t start, uint32_t end, int32_t step, float *buf, float *coverbuf);
+	static int aggrrange(const View &v, const std::vector<uint32_t> &ranges, float *buf, float *coverbuf);
+	// file layout & crc helpers
+	// data areas in file: values of each level, followed by coverage of level 1+ if ALOG_FLAG_COVER is set
+	bool hascover() const { return (h.flags & ALOG_FLAG_COVER) != 0; }
+	int areanum() const { return hascover() ? h.lvnum * 2 - 1 : h.lvnum; }
+	int arealevel(int area) const { return area < h.lvnum ? area : area - h.lvnum + 1; }
+	int coverarea(int level) const { return h.lvnum + level - 1; }
+	size_t itemsize(int area) const { return area == 0 ? sizeof(float) : area < h.lvnum ? sizeof(uint16_t) : sizeof(uint8_t); }
+	void layout();
+	size_t lvbytes(int area) const { return (size_t)lv[arealevel(area)].len * itemsize(area); }
+	const uint8_t *lvdata(int area) const
+	{
+		return area == 0 ? (const uint8_t *)value0.data() :
+			area < h.lvnum ? (const uint8_t *)value[area].data() : cover[arealevel(area)].data();
+	}
+	int32_t lvblocks(int area) const { return (int32_t)((lvbytes(area) + ALOG_BLKSIZE - 1) / ALOG_BLKSIZE); }
+	uint32_t blockcrc(int area, int32_t blk) const;
+	int writeblocks(FILE *fp, int area, int32_t bblk, int32_t eblk);
+	int writeheader(FILE *fp);
+	int writeall();
+	int32_t checklevels(int32_t basepos, bool hastable, long fsize);
+	void discardblock(int area, int32_t blk);
+	void extendlast(uint32_t time);
+	void setdirty(int area, int32_t pos)
+	{
+		int32_t blk = blkbase[area] + (int32_t)(pos * itemsize(area) / ALOG_BLKSIZE);
+		if (!blkdirty[blk])
+		{
+			blkdirty[blk] = true;
+			ndirty++;
+		}
+	}
 
+	const AlogConf *conf;
 	std::string name;
 	std::string filename;
 	bool inited = false;
@@ -48,14 +177,37 @@ private:
 	bool (*testnan)(uint16_t) = NULL;
 	uint16_t (*setnan)() = NULL;
 
-	// storage file struct:
-	// Header, LevelInfo[LEVEL_NUM], databuf
+	// storage file struct, 2 header slots written alternately:
+	// (Header, LevelInfo[lvnum]) of slot 0 and 1, each HDRSIZE bytes, blkcrc[blkcap] of slot 0 and 1, databuf
 #pragma pack(push, 4)
 	struct FileHeader
 	{
+		uint32_t magic = ALOG_MAGIC;
+		uint16_t version = ALOG_VERSION;
+		uint16_t flags = 0;
 		int32_t stype = AMON_AUINT;
 		int32_t lvnum = ALOG_DEF_LVNUM;
+		int32_t blkcap = 0;	// capacity of blkcrc table in file
+		uint32_t gen = 0;	// incremented on each header write, which goes to slot gen % 2
+		uint32_t tcrc = 0;	// crc of blkcrc table
+		uint32_t hcrc = 0;	// crc of header (with hcrc being 0) and LevelInfo
 	} h;
+	struct FileHeaderV0	// unversioned header of early data files
+	{
+		int32_t stype;
+		int32_t lvnum;
+	};
+	struct FileHeaderV1	// single header of version 1 data files: Header, LevelInfo[lvnum], blkcrc[blkcap], databuf
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t flags;
+		int32_t stype;
+		int32_t lvnum;
+		int32_t blkcap;
+		uint32_t tcrc;
+		uint32_t hcrc;
+	};
 	struct LevelInfo
 	{
 		int32_t step = 0;	// time length (seconds) of each value in this level
@@ -66,11 +218,72 @@ private:
 	};
 	std::vector<LevelInfo> lv;
 #pragma pack(pop)
+	static const int32_t HDRSIZE = sizeof(FileHeader) + sizeof(LevelInfo) * ALOG_MAXLV;	// of a header slot
+	int32_t tableoff(int slot) const { return 2 * HDRSIZE + slot * (int32_t)sizeof(uint32_t) * h.blkcap; }
+	int32_t dataoff() const { return tableoff(2); }
+	// levels of the log as seen by a reader
+	struct View
+	{
+		int lvnum;
+		bool hascover;
+		double (*store2raw)(uint16_t);
+		LevelInfo lv[ALOG_MAXLV];
+		const float *value0;
+		const uint16_t *value[ALOG_MAXLV];
+		const uint8_t *cover[ALOG_MAXLV];
+		// fraction of level 0 steps having values in a level value
+		float coverof(int level, int32_t pos, float val) const
+		{
+			if (isnan(val))
+				return 0;
+			return level == 0 || !hascover ? 1.f : std::max(cover[level][pos], (uint8_t)1) / 255.f;
+		}
+	};
+	std::vector<uint32_t> blkcrc;	// crc of each data block, as in file. blocks of level i start at blkbase[i]
+	std::vector<int32_t> blkbase;	// first block of each data area
+	std::vector<int32_t> areaoff;	// file offset of each data area
+	std::vector<bool> blkdirty;	// blocks with data not written to file yet
+	std::vector<bool> blkchecked;	// blocks whose data in memory is known good: verified against crc, or written
+	int32_t ndirty = 0;	// number of dirty blocks
+	int32_t scrubblk = 0;	// next block to scrub
 	std::vector<float> value0;
 	std::vector<std::vector<uint16_t>> value;
+	std::vector<std::vector<uint8_t>> cover;	// level 0 coverage of upper level values, 0: none, 255: full
+	mutable std::atomic<uint32_t> wseq{0};
+	// readers register in the slot of the epoch they start in. the epoch advances once no reader of the previous one
+	// is left, so buffers retired before the current epoch are unreachable when the other slot is empty
+	mutable std::atomic<uint32_t> repoch{0};
+	mutable std::atomic<int> nreaders[2] {{0}, {0}};
+	// replaced level buffers, with the reader epoch of their replacement
+	struct Retired
+	{
+		uint32_t epoch;
+		std::vector<uint16_t> value;
+		std::vector<uint8_t> cover;
+	};
+	std::vector<Retired> retired;
 	// pending data info
-	std::vector<int32_t> pending;	// number of pending values of each level
-	bool ispending = false;	// are there any pending values (exclude level 0)
+	bool ispending = false;	// are there any pending values (exclude level 0 values in time order)
+	bool relocate = false;	// data areas moved by level expansion, the whole file is to be rewritten
+	// reorder buffer for late values falling in sealed upper level buckets
+	struct LateVal
+	{
+		uint32_t time;
+		float value;
+	};
+	static const size_t REORDERLEN = 64;
+	std::vector<LateVal> late;
+	int32_t maxlate = 60;	// values older than (lv[0].time - maxlate) are dropped
+	// addv_batch() state: upper levels are updated at the end of batch, unless level 0 has moved far since `batchup`
+	bool batching = false;
+	bool batchpending = false;	// upper levels not updated yet
+	uint32_t batchup = 0;	// lv[0].time of last upper levels update
+	// backfill state: level 0 time range to re-aggregate, and the upper level buckets being aggregated
+	uint32_t bfmin = UINT32_MAX;
+	uint32_t bfmax = 0;
+	std::vector<double> bfsum;
+	std::vector<int32_t> bfcnt;
+	std::vector<uint32_t> bfround;
 	uint32_t firsttime = UINT32_MAX;	// (data) time of first received value
 	uint32_t writetime = 0;	// last file write (system clock) time
 	uint32_t writestep = 0;	// last file write (data) time
@@ -1,65 +1,212 @@
 #include "CollectdReceiver.h"
 #include <endian.h>
 #include <map>
-#include <set>
 #include "resguard.h"
+#include "crc32c.h"
 #include "AMon.h"
 
+const char *CollectdReceiver::FIELDS[] = { "host", "plugin", "instance", "type", "subtype" };
+const char *CollectdReceiver::DEFAULTCONF = R"(
+filter = (
+	{ plugin = "interface"; type = "if_octets"; subtype = ""; },
+	{ plugin = "cpu"; type = "percent"; subtype = "idle"; },
+	{ plugin = "memory"; type = "percent"; subtype = "free"; },
+	{ plugin = "load"; type = "load"; subtype = ""; }
+);
+transforms = (
+	{ name = "load"; plugin = "load"; type = "load"; values = [0]; scale = 100.0; rename = { type = "load100"; }; },
+	{ name = "usage"; plugin = ["cpu", "memory"]; type = "percent"; subtype = ["idle", "free"]; invert = true;
+		rename = { subtype = "usage"; }; }
+);
+)";
+
+#ifdef __linux__
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_RXQ_OVFL> rxq_ovfl;
+static const size_t CTRLSIZE = CMSG_SPACE(sizeof(uint32_t));	// room for the SO_RXQ_OVFL counter
+#endif
+
 int CollectdReceiver::start()
 {
-	// start receive
-	fprintf(stderr, "start\n");
-	asio::error_code ec;
-	m_socket.set_option(asio::socket_base::reuse_address(true));
-	m_socket.set_option(asio::ip::v6_only(false));
-	if (m_socket.bind(asio::ip::udp::endpoint(asio::ip::udp::v6(), port), ec))
-		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] UDP bind failed: %s\n",
-		m_name, ec.message().c_str()), ec.value());
-	int res = 0;
-	if ((res = recv()) != 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] start failed.\n", m_name), res);
+#ifndef __linux__
+	socknum = 1;	// no SO_REUSEPORT
+#endif
+	for (int i = 0; i < socknum; ++i)
+	{
+		sockets.emplace_back(new Socket(*m_ioServices[i % m_ioServices.size()], amon));
+		Socket &sock = *sockets.back();
+		asio::error_code ec;
+		sock.socket.set_option(asio::socket_base::reuse_address(true));
+		sock.socket.set_option(asio::ip::v6_only(false));
+#ifdef __linux__
+		if (socknum > 1 && sock.socket.set_option(reuse_port(true), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] SO_REUSEPORT failed: %s\n", m_name, ec.message().c_str()), ec.value());
+		if (sock.socket.set_option(rxq_ovfl(true), ec))
+			PELOG_LOG((PLV_WARNING, "[%s] SO_RXQ_OVFL failed, kernel drops not counted: %s\n", m_name, ec.message().c_str()));
+		if (sock.socket.non_blocking(true, ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] set non-blocking failed: %s\n", m_name, ec.message().c_str()), ec.value());
+		sock.bufs.resize(batch * bufsize);
+		sock.msgs.resize(batch);
+		sock.iovs.resize(batch);
+		sock.addrs.resize(batch);
+		sock.ctrls.resize(batch * CTRLSIZE);
+#else
+		sock.buf.resize(bufsize);
+#endif
+		if (rcvbuf > 0 && sock.socket.set_option(asio::socket_base::receive_buffer_size(rcvbuf), ec))
+			PELOG_LOG((PLV_WARNING, "[%s] SO_RCVBUF failed: %s\n", m_name, ec.message().c_str()));
+		if (sock.socket.bind(asio::ip::udp::endpoint(asio::ip::udp::v6(), port), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] UDP bind failed: %s\n",
+			m_name, ec.message().c_str()), ec.value());
+		int res = 0;
+		if ((res = recv(sock)) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] start failed.\n", m_name), res);
+	}
+	PELOG_LOG((PLV_INFO, "[%s] Listening on UDP %d, %d sockets, %d datagrams of max %d bytes per read\n", m_name, port,
+		socknum, batch, (int)bufsize));
 	return 0;
 }
 
 int CollectdReceiver::stop()
 {
-	if (m_socket.is_open())
-		m_socket.close();
+	for (auto &sock: sockets)
+		if (sock->socket.is_open())
+			sock->socket.close();
 	return 0;
 }
 
-int CollectdReceiver::recv()
+#ifdef __linux__
+// wait until the socket is readable, then read all pending datagrams with recvmmsg()
+int CollectdReceiver::recv(Socket &sock)
 {
-	m_remote = asio::ip::udp::endpoint();	// clear remote
-	m_buf.resize(std::max((size_t)1452, m_buf.size()));
-	m_socket.async_receive_from(asio::buffer(m_buf, m_buf.size()), m_remote,
-		std::bind(&CollectdReceiver::onRecv, this, std::placeholders::_1 /*error*/, std::placeholders::_2 /*bytes_transferred*/));
+	sock.socket.async_wait(asio::socket_base::wait_read,
+		std::bind(&CollectdReceiver::onReadable, this, std::ref(sock), std::placeholders::_1 /*error*/));
 	return 0;
 }
 
-void CollectdReceiver::onRecv(const asio::error_code& error, size_t size)
+void CollectdReceiver::onReadable(Socket &sock, const asio::error_code &error)
 {
 	if (error)
 		PELOG_LOG((PLV_ERROR, "[%s] recv failed. %s\n", m_name, error.message().c_str()));
 	else
 	{
-		auto addr6 = m_remote.address().to_v6();
-		std::string addrs = addr6.is_v4_mapped() || addr6.is_v4_compatible() ? addr6.to_v4().to_string() : addr6.to_string();
-		PELOG_LOG((PLV_VERBOSE, "[%s] Got packet from %s:%d size " PL_SIZET "\n", m_name,
-			addrs.c_str(), (int)m_remote.port(), size));
-		std::unique_ptr<TaskWrite> dwrite = TaskWrite::alloc(size);
-		dwrite->processor = std::bind(&CollectdReceiver::parse, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
-		memcpy(dwrite->data, &m_buf[0], size);
-		taskq->put(std::move(dwrite));
-		//parse(&m_buf[0], size);
-//		FILE *fp = fopen("data.dump", "wb");
-//		fwrite(&m_buf[0], 1, size, fp);
-//		fclose(fp);
-//		exit(0);
+		// drain the socket, but yield to other sockets of the thread after some batches
+		for (int round = 0; round < 8; ++round)
+		{
+			for (int i = 0; i < batch; ++i)
+			{
+				sock.iovs[i].iov_base = &sock.bufs[i * bufsize];
+				sock.iovs[i].iov_len = bufsize;
+				msghdr &hdr = sock.msgs[i].msg_hdr;
+				hdr.msg_name = &sock.addrs[i];
+				hdr.msg_namelen = sizeof(sock.addrs[i]);
+				hdr.msg_iov = &sock.iovs[i];
+				hdr.msg_iovlen = 1;
+				hdr.msg_control = &sock.ctrls[i * CTRLSIZE];
+				hdr.msg_controllen = CTRLSIZE;
+				hdr.msg_flags = 0;
+			}
+			int n = recvmmsg(sock.socket.native_handle(), sock.msgs.data(), batch, MSG_DONTWAIT, NULL);
+			if (n <= 0)
+			{
+				if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					PELOG_LOG((PLV_ERROR, "[%s] recvmmsg failed. %s\n", m_name, strerror(errno)));
+				break;
+			}
+			stats.recvcalls.fetch_add(1, std::memory_order_relaxed);
+			stats.packets.fetch_add(n, std::memory_order_relaxed);
+			for (int i = 0; i < n; ++i)
+			{
+				msghdr &hdr = sock.msgs[i].msg_hdr;
+				// the kernel counts drops of the socket since creation, and reports it with each datagram
+				for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+				{
+					if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+						continue;
+					uint32_t overflows;
+					memcpy(&overflows, CMSG_DATA(cmsg), sizeof(overflows));
+					if ((int32_t)(overflows - sock.overflows) > 0)
+					{
+						PELOG_LOG((PLV_DEBUG, "[%s] %u datagrams dropped by kernel\n", m_name, overflows - sock.overflows));
+						stats.kerneldrops.fetch_add(overflows - sock.overflows, std::memory_order_relaxed);
+						sock.overflows = overflows;
+					}
+				}
+				stats.bytes.fetch_add(sock.msgs[i].msg_len, std::memory_order_relaxed);
+				if (hdr.msg_flags & MSG_TRUNC)
+				{
+					onTruncated();
+					continue;
+				}
+				onPacket(sock, &sock.bufs[i * bufsize], sock.msgs[i].msg_len, sock.addrs[i].sin6_addr.s6_addr,
+					ntohs(sock.addrs[i].sin6_port));
+			}
+			sock.outbox.flush();
+			if (n < batch)	// drained
+				break;
+		}
+	}
+	if (sock.socket.is_open() && recv(sock) != 0)
+		PELOG_ERROR_RETURNVOID((PLV_ERROR, "[%s] start recv failed.\n", m_name));
+}
+#else
+int CollectdReceiver::recv(Socket &sock)
+{
+	sock.remote = asio::ip::udp::endpoint();	// clear remote
+	sock.socket.async_receive_from(asio::buffer(sock.buf, sock.buf.size()), sock.remote,
+		std::bind(&CollectdReceiver::onRecv, this, std::ref(sock), std::placeholders::_1 /*error*/, std::placeholders::_2 /*bytes_transferred*/));
+	return 0;
+}
+
+void CollectdReceiver::onRecv(Socket &sock, const asio::error_code& error, size_t size)
+{
+	if (error == asio::error::message_size)	// WSAEMSGSIZE, the datagram did not fit
+		onTruncated();
+	else if (error)
+		PELOG_LOG((PLV_ERROR, "[%s] recv failed. %s\n", m_name, error.message().c_str()));
+	else
+	{
+		stats.recvcalls.fetch_add(1, std::memory_order_relaxed);
+		stats.packets.fetch_add(1, std::memory_order_relaxed);
+		stats.bytes.fetch_add(size, std::memory_order_relaxed);
+		onPacket(sock, &sock.buf[0], size, sock.remote.address().to_v6().to_bytes().data(), sock.remote.port());
+		sock.outbox.flush();
 	}
-	if (m_socket.is_open() && recv() != 0)
+	if (sock.socket.is_open() && recv(sock) != 0)
 		PELOG_ERROR_RETURNVOID((PLV_ERROR, "[%s] start recv failed.\n", m_name));
 }
+#endif
+
+// a datagram larger than the buffer. its values are lost, as a cut packet can't be parsed reliably
+void CollectdReceiver::onTruncated()
+{
+	uint64_t n = stats.truncated.fetch_add(1, std::memory_order_relaxed);
+	if (n % 1000 == 0)
+		PELOG_LOG((PLV_WARNING, "[%s] datagram larger than max_packet_size (%d) dropped, %llu so far. raise it to "
+			"MaxPacketSize of the senders\n", m_name, (int)bufsize, (unsigned long long)n + 1));
+}
+
+// parse a received datagram and queue its values. `addr6` is the 16 bytes IPv6 (or v4 mapped) sender address
+void CollectdReceiver::onPacket(Socket &sock, const uint8_t *data, size_t size, const uint8_t *addr6, uint16_t port)
+{
+	// address string is only built for logging, to keep the packet path free of allocations
+	auto addrs = [addr6]() {
+		asio::ip::address_v6::bytes_type bytes;
+		memcpy(bytes.data(), addr6, bytes.size());
+		asio::ip::address_v6 addr(bytes);
+		return addr.is_v4_mapped() || addr.is_v4_compatible() ? addr.to_v4().to_string() : addr.to_string();
+	};
+	if (pelog_getlevel() <= PLV_VERBOSE)
+		PELOG_LOG((PLV_VERBOSE, "[%s] Got packet from %s:%d size " PL_SIZET "\n", m_name,
+			addrs().c_str(), (int)port, size));
+	thread_local std::vector<SeriesPoint> points;
+	points.clear();
+	if (parse(data, size, sock.names, points) != 0)
+		PELOG_LOG((PLV_WARNING, "[%s] Invalid packet from %s\n", m_name, addrs().c_str()));
+	// shed by sender address when overloaded
+	if (!sock.outbox.add(points.data(), points.size(), crc32c(addr6, 16)) && pelog_getlevel() <= PLV_DEBUG)
+		PELOG_LOG((PLV_DEBUG, "[%s] Dropped values from %s, task queue overloaded\n", m_name, addrs().c_str()));
+}
 
 uint64_t fmttime(time_t time)
 {
@@ -71,11 +218,11 @@ uint64_t fmttime(time_t time)
 
 
 // helper parsers
-std::string parsestring(const uint8_t *data, uint16_t len)
+StrRef parsestring(const uint8_t *data, uint16_t len)
 {
 	if (len > 0 && data[len - 1] == 0)
-		return (const char *)data;
-	return std::string((const char *)data, len); 
+		return StrRef((const char *)data, strnlen((const char *)data, len));
+	return StrRef((const char *)data, len);
 }
 uint64_t parseint(const uint8_t *data, uint16_t len)
 {
@@ -83,9 +230,35 @@ uint64_t parseint(const uint8_t *data, uint16_t len)
 		PELOG_ERROR_RETURN((PLV_ERROR, "parse invalid int %d\n", (int)len), 0);
 	return be64toh(*(const uint64_t *)data);
 }
-int parsevalues(const uint8_t *data, uint16_t len, std::vector<double> &res)
+
+struct CollectdRec
 {
-	res.clear();
+	StrRef host;
+	StrRef plugin;
+	StrRef instance;
+	StrRef type;
+	StrRef subtype;
+	uint32_t interval = 0;
+	uint32_t time = 0;
+	// values part, decoded by value()
+	uint16_t nvalues = 0;
+	const uint8_t *vtypes = NULL;
+	const uint8_t *vdata = NULL;
+	double value(size_t idx) const
+	{
+		const uint8_t *pval = vdata + idx * 8;
+		if (vtypes[idx] == CollectdReceiver::COUNTER || vtypes[idx] == CollectdReceiver::ABSOLUTE)
+			return be64toh(*(const uint64_t *)pval);
+		else if (vtypes[idx] == CollectdReceiver::GAUGE)
+			return *(const double *)pval;
+		return (int64_t)be64toh(*(const uint64_t *)pval);	// DERIVE
+	}
+};
+
+// check a values part and point `rec` into it
+int parsevalues(const uint8_t *data, uint16_t len, CollectdRec &rec)
+{
+	rec.nvalues = 0;
 	if (len < sizeof(uint16_t))
 		PELOG_ERROR_RETURN((PLV_ERROR, "parse value no num\n", (int)len), -1);
 	uint16_t num = htons(*(const uint16_t *)data);
@@ -93,36 +266,15 @@ int parsevalues(const uint8_t *data, uint16_t len, std::vector<double> &res)
 	len -= sizeof(uint16_t);
 	if (len != num * (1 + 8))
 		PELOG_ERROR_RETURN((PLV_ERROR, "parse value too few values %d:%d\n", (int)num, (int)len), -1);
-	const uint8_t *pval = data + num;
-	for (int i = 0; i < num; ++i, ++data, pval += 8)
-	{
-		double val = 0;
-		if (*data == CollectdReceiver::COUNTER || *data == CollectdReceiver::ABSOLUTE)	// COUNTER or ABSOLUTE
-			val = be64toh(*(const uint64_t *)pval);
-		else if (*data == CollectdReceiver::GAUGE)	// GAUGE
-			val = *(const double *)pval;
-		else if (*data == CollectdReceiver::DERIVE)	// DERIVE
-			val = (int64_t)be64toh(*(const uint64_t *)pval);
-		else
-			PELOG_ERROR_RETURN((PLV_ERROR, "parse value unsupported datatype %d\n", (int)*data), -1);
-//		PELOG_LOG((PLV_DEBUG, "val_type %d val %f\n",(int)*data, val));
-		res.push_back(val);
-	}
+	for (int i = 0; i < num; ++i)
+		if (data[i] > CollectdReceiver::ABSOLUTE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "parse value unsupported datatype %d\n", (int)data[i]), -1);
+	rec.nvalues = num;
+	rec.vtypes = data;
+	rec.vdata = data + num;
 	return 0;
 }
 
-struct CollectdRec
-{
-	std::string host;
-	std::string plugin;
-	std::string instance;
-	std::string type;
-	std::string subtype;
-	uint32_t interval;
-	uint32_t time;
-	std::vector<double> values;
-};
-
 // part types from collectd
 #define TYPE_HOST 0x0000
 #define TYPE_TIME 0x0001
@@ -139,7 +291,7 @@ struct CollectdRec
 #define TYPE_SIGN_SHA256 0x0200
 #define TYPE_ENCR_AES256 0x0210
 
-int CollectdReceiver::parse(const uint8_t *data, size_t size, AMon *amon)
+int CollectdReceiver::parse(const uint8_t *data, size_t size, NameCache &names, std::vector<SeriesPoint> &points)
 {
 	CollectdRec rec;
 	PELOG_LOG((PLV_DEBUG, "to parse packet size %d\n", size));
@@ -158,10 +310,7 @@ int CollectdReceiver::parse(const uint8_t *data, size_t size, AMon *amon)
 		switch (type)
 		{
 		case TYPE_HOST:
-			rec.host = parsestring(pdata, pdatalen);
-			for (char &c: rec.host)	// remove '.' in hostname
-				if (c == '.')
-					c = '_';
+			rec.host = parsestring(pdata, pdatalen);	// '.' in hostname is replaced when building names
 //			PELOG_LOG((PLV_INFO, "parse host: %s\n", rec.host.c_str()));
 			break;
 		case TYPE_PLUGIN:
@@ -198,7 +347,7 @@ int CollectdReceiver::parse(const uint8_t *data, size_t size, AMon *amon)
 			break;
 		case TYPE_VALUES:
 //			PELOG_LOG((PLV_INFO, "parse values len %d\n", (int)pdatalen));
-			parsevalues(pdata, pdatalen, rec.values);
+			parsevalues(pdata, pdatalen, rec);
 			break;
 		default:
 			PELOG_LOG((PLV_INFO, "Packet part: len(%d), type(%d), datalen(%d)\n", (int)plen, (int)type, (int)pdatalen));
@@ -217,15 +366,77 @@ int CollectdReceiver::parse(const uint8_t *data, size_t size, AMon *amon)
 //					   rec.time, fmttime(rec.time), rec.host.c_str(), rec.plugin.c_str(), rec.instance.c_str(),
 //					   rec.type.c_str(), rec.subtype.c_str(), valbuf));
 //		}
-		process(rec, amon);
+		process(rec, names, points);
 	}
 
 	return 0;
 }
 
-int CollectdReceiver::init(const char *typesdbfile, TaskQueue *taskq)
+void CollectdReceiver::addcounters()
+{
+	amon->addcounter("ingest.collectd.packets", &stats.packets, AMON_AUINT);
+	amon->addcounter("ingest.collectd.recvcalls", &stats.recvcalls, AMON_AUINT);
+	amon->addcounter("ingest.collectd.kernel_dropped", &stats.kerneldrops);
+	amon->addcounter("ingest.collectd.truncated", &stats.truncated);
+	amon->addcounter("ingest.collectd.bytes", &stats.bytes, AMON_AUINT);
+	filter->addcounters(amon, "ingest.collectd.filter");
+	transformsel->addcounters(amon, "ingest.collectd.transform");
+}
+
+// a number config, int or float
+static bool lookupnumber(const config_setting_t *config, const char *name, double *value)
+{
+	const config_setting_t *setting = config_setting_get_member(config, name);
+	if (!setting)
+		return false;
+	if (config_setting_type(setting) == CONFIG_TYPE_INT)
+		*value = config_setting_get_int(setting);
+	else if (config_setting_type(setting) == CONFIG_TYPE_FLOAT)
+		*value = config_setting_get_float(setting);
+	else
+		return false;
+	return true;
+}
+
+int CollectdReceiver::inittransforms(const config_setting_t *config)
+{
+	if (!(transformsel = IngestFilter::byConfig(config, "exclude", { FIELDS, FIELDS + FIELDNUM },
+		{ "values", "invert", "scale", "offset", "rename", "sum" })))
+		return -1;
+	transforms.clear();
+	for (int irule = 0; irule < (int)transformsel->size(); ++irule)
+	{
+		const config_setting_t *rconf = config_setting_get_elem(config, irule);
+		Transform trans;
+		if (getintlist(config_setting_get_member(rconf, "values"), trans.values) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid values of transform %d\n", irule), -1);
+		bool invert = false;
+		if (config_setting_lookup_bool(rconf, "invert", &invert) == CONFIG_TRUE)
+			trans.invert = invert;
+		if (config_setting_get_member(rconf, "scale") && !lookupnumber(rconf, "scale", &trans.scale) ||
+			config_setting_get_member(rconf, "offset") && !lookupnumber(rconf, "offset", &trans.offset))
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid scale or offset of transform %d\n", irule), -1);
+		if (const config_setting_t *rename = config_setting_get_member(rconf, "rename"))
+		{
+			for (size_t ifield = 0; ifield < FIELDNUM; ++ifield)
+			{
+				const char *name = NULL;
+				if (config_setting_lookup_string(rename, FIELDS[ifield], &name) == CONFIG_TRUE)
+					trans.rename[ifield] = name;
+			}
+		}
+		const char *sumname = NULL;
+		if ((trans.sum = config_setting_lookup_string(rconf, "sum", &sumname) == CONFIG_TRUE))
+			trans.sumname = sumname;
+		transforms.push_back(std::move(trans));
+	}
+	return 0;
+}
+
+int CollectdReceiver::init(const char *typesdbfile, AMon *amon)
 {
-	this->taskq = taskq;
+	this->amon = amon;
+	this->taskq = amon->gettaskq();
 	// load types.db
 	typesdb.clear();
 	FILEGuard fp = fopen(typesdbfile, "rb");
@@ -338,112 +549,222 @@ int CollectdReceiver::init(const char *typesdbfile, TaskQueue *taskq)
 	return 0;
 }
 
-int CollectdReceiver::process(struct CollectdRec &rec, AMon *amon)
+CollectdReceiver::CounterHist &CollectdReceiver::CounterTable::get(SeriesId id)
 {
-	static const std::set<std::tuple<std::string, std::string, std::string>> accepted = {
-		std::make_tuple("interface", "if_octets", ""),
-		std::make_tuple("cpu", "percent", "idle"),
-		std::make_tuple("memory", "percent", "free"),
-		std::make_tuple("load", "load", ""),
-	};
-	if (accepted.find(std::make_tuple(rec.plugin, rec.type, rec.subtype)) == accepted.end())
-		return 0;	// skip unnecessary data
+	if ((used + 1) * 2 > slots.size())	// grow and rehash
+	{
+		std::vector<CounterHist> old(std::max((size_t)64, slots.size() * 2));
+		old.swap(slots);
+		used = 0;
+		for (CounterHist &hist: old)
+			if (hist.id != AMON_NOSERIES)
+				get(hist.id) = std::move(hist);
+	}
+	// ids of a stripe share the same remainder, so hash the quotient
+	size_t mask = slots.size() - 1;
+	size_t idx = (size_t)(id / COUNTERSTRIPES * 2654435761u) & mask;
+	while (slots[idx].id != id && slots[idx].id != AMON_NOSERIES)
+		idx = (idx + 1) & mask;
+	if (slots[idx].id == AMON_NOSERIES)
+	{
+		slots[idx].id = id;
+		++used;
+	}
+	return slots[idx];
+}
 
-	// match types.db
-	auto itype = typesdb.find(rec.type);
-	if (itype == typesdb.end() || itype->second.size() != rec.values.size())
-		PELOG_ERROR_RETURN((PLV_ERROR, "types.db mismatch %s.%s.%s.%s.%s %d\n",
-			rec.host.c_str(), rec.plugin.c_str(), rec.instance.c_str(),
-			rec.type.c_str(), rec.subtype.c_str(), (int)rec.values.size()), -1);
-	std::vector<TypesdbVal> typedb = itype->second;	// make a copy, because some special rules may apply
-
-	PELOG_LOG((PLV_DEBUG, "Processing %s.%s.%s.%s.%s\n",
-		rec.host.c_str(), rec.plugin.c_str(), rec.instance.c_str(),
-		rec.type.c_str(), rec.subtype.c_str()));
-	// apply special type rules
-	if (rec.plugin == "load" && rec.type == "load")	// only keep 1min load
+// increase of a cumulative value from `prev` to `cur`. false if it has been reset.
+// a decreasing COUNTER in the upper half of 32 bits is taken as a 32 bit wrap, 64 bit counters do not wrap in practice
+static bool counterdiff(CollectdReceiver::ValType vtype, double prev, double cur, double &diff)
+{
+	if (cur >= prev)
+		diff = cur - prev;
+	else if (vtype == CollectdReceiver::COUNTER && prev >= 2147483648.0 && prev < 4294967296.0)
+		diff = 4294967296.0 - prev + cur;
+	else
+	{
+		PELOG_LOG((PLV_VERBOSE, "CollectdReceiver counter reset %.0f -> %.0f\n", prev, cur));
+		return false;
+	}
+	return true;
+}
+
+// find or build the series of the tuple of `rec`
+const CollectdReceiver::NameEntry &CollectdReceiver::resolve(const CollectdRec &rec, NameCache &names)
+{
+	const StrRef fields[FIELDNUM] = { rec.host, rec.plugin, rec.instance, rec.type, rec.subtype };
+	uint64_t hash = 14695981039346656037ull;	// FNV-1a
+	for (const StrRef &field: fields)
 	{
-	   rec.values.resize(1);
-	   typedb.resize(1);
-	   rec.values[0] *= 100;	// map load by 100*
-	   rec.type = "load100";
+		for (size_t i = 0; i < field.size; ++i)
+			hash = (hash ^ (uint8_t)field.data[i]) * 1099511628211ull;
+		hash *= 1099511628211ull;	// separator, as a 0 byte
 	}
-	if (rec.plugin == "cpu" && rec.type == "percent" && rec.subtype == "idle" ||
-		rec.plugin == "memory" && rec.type == "percent" && rec.subtype == "free")
+	auto ientry = names.find(hash);
+	if (ientry != names.end())
 	{
-		rec.subtype = "usage";
-		rec.values[0] = 100 - rec.values[0];
+		// compare the tuple with the key
+		const char *key = ientry->second.key.data();
+		const char *keyend = key + ientry->second.key.size();
+		bool match = true;
+		for (const StrRef &field: fields)
+		{
+			if (!(match = (size_t)(keyend - key) > field.size && memcmp(key, field.data, field.size) == 0 && key[field.size] == 0))
+				break;
+			key += field.size + 1;
+		}
+		if (match)
+			return ientry->second;
 	}
 
-	// process values
+	// not cached yet, resolve it
+	if (names.size() >= NAMECACHEMAX)
+		names.clear();
+	NameEntry &entry = names[hash];
+	entry = NameEntry();
+	for (const StrRef &field: fields)
+		entry.key.append(field.data, field.size).append(1, '\0');
+	entry.rule = filter->match(fields);
+	entry.accepted = filter->accepts(entry.rule);
+	if (!entry.accepted)
+		return entry;	// skip unnecessary data
+	// match types.db
+	auto itype = typesdb.find(rec.type.str());
+	if (itype == typesdb.end())
+		return entry;
+	entry.nvalues = (int)itype->second.size();
+	const std::vector<TypesdbVal> &typedb = itype->second;
+
+	// transform
+	entry.transform = transformsel->match(fields);
+	static const Transform notransform;
+	const Transform &trans = entry.transform < transforms.size() ? transforms[entry.transform] : notransform;
+	std::vector<uint16_t> srcs;
 	for (size_t ival = 0; ival < typedb.size(); ++ival)
+		if (trans.values.empty() || std::find(trans.values.begin(), trans.values.end(), (int)ival) != trans.values.end())
+			srcs.push_back((uint16_t)ival);
+	double scale = trans.invert ? -trans.scale : trans.scale;
+	double offset = trans.invert ? trans.offset + 100 * trans.scale : trans.offset;
+
+	// names of the values
+	std::string parts[FIELDNUM];
+	for (size_t ifield = 0; ifield < FIELDNUM; ++ifield)
+		parts[ifield] = trans.rename[ifield].empty() ? fields[ifield].str() : trans.rename[ifield];
+	for (char &c: parts[0])	// remove '.' in hostname
+		if (c == '.')
+			c = '_';
+	std::string prefix = parts[0] + "." + parts[1];
+	for (size_t ifield = 2; ifield < FIELDNUM; ++ifield)
+		if (!parts[ifield].empty())
+			prefix.append(1, '.').append(parts[ifield]);
+	auto addval = [&](const std::string &name, std::vector<uint16_t> &&valsrcs) {
+		SeriesId id = amon->intern(name);
+		const TypesdbVal &first = typedb[valsrcs[0]];	// a sum is stored as its first value
+		entry.vals.push_back(NameEntry::Val{id, first.vtype, first.stype, id == AMON_NOSERIES ? 0 : amon->getstep(id),
+			std::move(valsrcs), scale, offset});
+	};
+	if (srcs.empty())
+		return entry;
+	if (trans.sum)
+		addval(trans.sumname.empty() ? prefix : prefix + "." + trans.sumname, std::move(srcs));
+	else
 	{
-		// name
-		std::string name = rec.host + "." + rec.plugin;
-		if (!rec.instance.empty())
-			name += "." + rec.instance;
-		if (!rec.type.empty())
-			name += "." + rec.type;
-		if (!rec.subtype.empty())
-			name += "." + rec.subtype;
-		if (typedb.size() > 1)
-			name += "." + typedb[ival].name;
-		// time, round to DATAINTERVAL
-		uint32_t time = (rec.time + DATAINTERVAL / 2) / DATAINTERVAL * DATAINTERVAL;
-		// value
-		double value = rec.values[ival];
+		for (uint16_t src: srcs)
+			addval(srcs.size() > 1 ? prefix + "." + typedb[src].name : prefix, { src });
+	}
+	return entry;
+}
+
+int CollectdReceiver::process(const CollectdRec &rec, NameCache &names, std::vector<SeriesPoint> &points)
+{
+	const NameEntry &entry = resolve(rec, names);
+	filter->hit(entry.rule);
+	if (!entry.accepted)
+		return 0;	// skip unnecessary data
+	if (entry.nvalues != (int)rec.nvalues)
+		PELOG_ERROR_RETURN((PLV_ERROR, "types.db mismatch %.*s.%.*s.%.*s.%.*s.%.*s %d\n",
+			(int)rec.host.size, rec.host.data, (int)rec.plugin.size, rec.plugin.data, (int)rec.instance.size, rec.instance.data,
+			(int)rec.type.size, rec.type.data, (int)rec.subtype.size, rec.subtype.data, (int)rec.nvalues), -1);
+	transformsel->hit(entry.transform);
+
+	// process values
+	for (size_t ival = 0; ival < entry.vals.size(); ++ival)
+	{
+		const NameEntry::Val &val = entry.vals[ival];
+		if (val.id == AMON_NOSERIES)
+			continue;
+		// time, round to level 0 step of the series
+		const int32_t step = val.step;
+		uint32_t time = (rec.time + step / 2) / step * step;
 		// process one value
-		if (typedb[ival].vtype == DERIVE)	// DERIVE: cumulative -> average
+		if (val.vtype == DERIVE || val.vtype == COUNTER)	// cumulative -> rate
 		{
-			std::array<HistVal, HISTLEN> &bufval = histvals[name];	// get buffered history values
-			// find the last element in bufval with time before current
-			if (time < bufval[0].time)
+			CounterTable &table = counters[val.id % COUNTERSTRIPES];
+			std::lock_guard<std::mutex> lock(table.mutex);
+			std::array<HistVal, HISTLEN> &hist = table.get(val.id).hist;
+			if (hist[HISTLEN - 1].vals.size() != val.srcs.size())	// first value
+				for (HistVal &hv: hist)
+					hv.vals.assign(val.srcs.size(), 0);
+			if (time < hist[0].time)
 			{
 				PELOG_LOG((PLV_WARNING, "CollectdReceiver::process outdated value %s %llu %llu\n",
-						name.c_str(), fmttime(time), fmttime(bufval[0].time)));
+						amon->getname(val.id).c_str(), fmttime(time), fmttime(hist[0].time)));
 				continue;
 			}
-			int bufidx = 0;
-			while (bufidx < HISTLEN && bufval[bufidx].time < time)
-				++bufidx;
-			if (bufidx < HISTLEN && bufval[bufidx].time == time)	// already got the same value
+			int pos = 0;
+			while (pos < HISTLEN && hist[pos].time < time)
+				++pos;
+			if (pos < HISTLEN && hist[pos].time == time)	// already got the same value
 				continue;
-			--bufidx;	// now bufidx is the last idx in bufval who is erlier than the new value
-			assert(bufval[bufidx].time < time && bufval[bufidx].time % DATAINTERVAL == 0 && time % DATAINTERVAL == 0);
-			if (time - bufval[bufidx].time <= 60 && bufval[bufidx].val <= value)	// update bufval[bufidx] ~ time
-			{
-				double avg = (value - bufval[bufidx].val) / (time - bufval[bufidx].time);
-				for (uint32_t steptime = bufval[bufidx].time + DATAINTERVAL; steptime <= time; steptime += DATAINTERVAL)
+			--pos;	// now pos is the last idx in hist who is erlier than the new value
+			assert(hist[pos].time < time && hist[pos].time % step == 0 && time % step == 0);
+			// the rate of each side is stored for all steps it covers, as one point. sources are diffed one by one
+			// (NULL for the record), then the rates are summed and transformed
+			auto sumdiff = [&](const HistVal *prev, const HistVal *next, double &diff) {
+				diff = 0;
+				for (size_t isrc = 0; isrc < val.srcs.size(); ++isrc)
 				{
-					PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu %.3f\n", name.c_str(), fmttime(steptime), avg));
-					if (amon->addv(name.c_str(), steptime, avg, typedb[ival].stype) != 0)
-						PELOG_LOG((PLV_WARNING, "CollectdReceiver ADD value failed %s %llu %.3f\n", name.c_str(), fmttime(steptime), avg));
+					double d = 0;
+					if (!counterdiff(val.vtype, prev ? prev->vals[isrc] : rec.value(val.srcs[isrc]),
+							next ? next->vals[isrc] : rec.value(val.srcs[isrc]), d))
+						return false;
+					diff += d;
 				}
+				return true;
+			};
+			double diff = 0;
+			if (time - hist[pos].time <= 60 && sumdiff(&hist[pos], NULL, diff))	// hist[pos] ~ time
+			{
+				double avg = val.offset + val.scale * diff / (time - hist[pos].time);
+				PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu-%llu %.3f\n", amon->getname(val.id).c_str(),
+					fmttime(hist[pos].time + step), fmttime(time), avg));
+				points.push_back(SeriesPoint{val.id, time, avg, val.stype, time - hist[pos].time - step});
 			}
-			assert(bufidx == HISTLEN - 1 || bufval[bufidx + 1].time > time && bufval[bufidx + 1].time % DATAINTERVAL == 0);
-			if (bufidx < HISTLEN - 1 && bufval[bufidx + 1].time - time <= 60 && value <= bufval[bufidx + 1].val)	// update time ~ bufval[bufidx + 1]
+			assert(pos == HISTLEN - 1 || hist[pos + 1].time > time && hist[pos + 1].time % step == 0);
+			if (pos < HISTLEN - 1 && hist[pos + 1].time - time <= 60 && sumdiff(NULL, &hist[pos + 1], diff))	// time ~ hist[pos + 1]
 			{
-				double avg = (bufval[bufidx + 1].val - value) / (bufval[bufidx + 1].time - time);
-				for (uint32_t steptime = time + DATAINTERVAL; steptime <= bufval[bufidx + 1].time; steptime += DATAINTERVAL)
-				{
-					PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu %.3f\n", name.c_str(), fmttime(steptime), avg));
-					if (amon->addv(name.c_str(), steptime, avg, typedb[ival].stype) != 0)
-						PELOG_LOG((PLV_WARNING, "CollectdReceiver ADD value failed %s %llu %.3f\n", name.c_str(), fmttime(steptime), avg));
-				}
+				double avg = val.offset + val.scale * diff / (hist[pos + 1].time - time);
+				PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu-%llu %.3f\n", amon->getname(val.id).c_str(),
+					fmttime(time + step), fmttime(hist[pos + 1].time), avg));
+				points.push_back(SeriesPoint{val.id, hist[pos + 1].time, avg, val.stype, hist[pos + 1].time - time - step});
 			}
-			// add the new value to buffer
-			bufval[0].time = time;
-			bufval[0].val = value;
-			std::sort(bufval.begin(), bufval.end());
-		}	// if (rec.type == DERIVE)	// DERIVE: cumulative -> average
+			// insert the new value after pos, dropping the oldest
+			for (int i = 0; i < pos; ++i)
+				std::swap(hist[i], hist[i + 1]);
+			hist[pos].time = time;
+			for (size_t isrc = 0; isrc < val.srcs.size(); ++isrc)
+				hist[pos].vals[isrc] = rec.value(val.srcs[isrc]);
+		}	// cumulative -> rate
 		else
 		{
-			PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu %.3f\n", name.c_str(), fmttime(time), value));
-			if (amon->addv(name.c_str(), time, value, typedb[ival].stype) != 0)
-				PELOG_LOG((PLV_WARNING, "CollectdReceiver ADD value failed %s %llu %.3f\n", name.c_str(), fmttime(time), value));
+			double value = 0;
+			for (uint16_t src: val.srcs)
+				value += rec.value(src);
+			value = val.offset + val.scale * value;
+			PELOG_LOG((PLV_VERBOSE, "CollectdReceiver ADD value %s %llu %.3f\n", amon->getname(val.id).c_str(), fmttime(time), value));
+			points.push_back(SeriesPoint{val.id, time, value, val.stype});
 		}
 	}
 
 	return 0;
 }
-
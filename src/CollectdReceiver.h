@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -9,8 +10,13 @@
 #include "asio.hpp"
 #include "pe_log.h"
 #include "libconfig/libconfig.h"
-
-#define DATAINTERVAL 5
+#include "resguard.h"
+#include "strref.h"
+#include "IngestFilter.h"
+#ifdef __linux__
+#	include <sys/socket.h>
+#	include <netinet/in.h>
+#endif
 
 #ifdef _MSC_VER
 #	undef ABSOLUTE
@@ -19,23 +25,80 @@
 class CollectdReceiver: public Receiver
 {
 public:
-	static std::unique_ptr<CollectdReceiver> byConfig(asio::io_service &ioService, TaskQueue *taskq, config_setting_t *config)
+	// sockets are spread over `ioServices` round robin
+	static std::unique_ptr<CollectdReceiver> byConfig(const std::vector<asio::io_service *> &ioServices, AMon *amon,
+		config_setting_t *config)
 	{
 		if (!config)
 			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver config missing\n"), NULL);
 		int port;
 		if (config_setting_lookup_int(config, "port", &port) == CONFIG_FALSE)
 			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver port config missing\n"), NULL);
-		auto ret = std::unique_ptr<CollectdReceiver>(new CollectdReceiver(ioService, port));
+		if (ioServices.empty())
+			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver no I/O thread\n"), NULL);
+		auto ret = std::unique_ptr<CollectdReceiver>(new CollectdReceiver(ioServices, port));
+		// SO_REUSEPORT sockets on the port, so the kernel spreads senders over them. one per I/O thread by default
+		int socknum = (int)ioServices.size();
+		config_setting_lookup_int(config, "sockets", &socknum);
+		ret->socknum = std::min(256, std::max(1, socknum));
+		// datagrams per recvmmsg() call
+		int batch = ret->batch;
+		config_setting_lookup_int(config, "recv_batch", &batch);
+		ret->batch = std::min(1024, std::max(1, batch));
+		// largest datagram accepted, up to the UDP limit. collectd's default is 1452, set MaxPacketSize of the senders
+		// and this higher on jumbo frame networks. larger datagrams are dropped and counted as truncated
+		int maxpacket = (int)ret->bufsize;
+		config_setting_lookup_int(config, "max_packet_size", &maxpacket);
+		ret->bufsize = std::min(65507, std::max(1024, maxpacket));
+		// the buffers of a socket hold a full batch, keep them within BUFSMAX by reading fewer datagrams at once
+		if (ret->batch * ret->bufsize > BUFSMAX)
+		{
+			ret->batch = std::max<int>(1, BUFSMAX / ret->bufsize);
+			PELOG_LOG((PLV_INFO, "CollectdReceiver recv_batch lowered to %d for max_packet_size %d\n", ret->batch,
+				(int)ret->bufsize));
+		}
+		// SO_RCVBUF of the sockets in KB, 0 for the system default. the kernel doubles it and caps it by rmem_max
+		int rcvbufkb = 0;
+		config_setting_lookup_int(config, "recv_buffer_kb", &rcvbufkb);
+		ret->rcvbuf = std::max(0, rcvbufkb) * 1024;
 		const char *typesdbfile = NULL;
 		if (config_setting_lookup_string(config, "typesdbfile", &typesdbfile) == CONFIG_FALSE)
 			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver typesdb config missing\n"), NULL);
-		if (ret->init(typesdbfile, taskq) != 0)
+		if (ret->init(typesdbfile, amon) != 0)
 			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver init failed\n"), NULL);
+		// values to accept, by rules on host, plugin, instance, type and subtype. see IngestFilter
+		// built-in `filter` and `transforms`, when not configured
+		config_t defconf;
+		config_init(&defconf);
+		ResGuard<config_t> defconf_guard(&defconf, config_destroy);
+		if (config_read_string(&defconf, DEFAULTCONF) != CONFIG_TRUE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver default config invalid\n"), NULL);
+		// values to accept, by rules on host, plugin, instance, type and subtype. see IngestFilter
+		const char *defaction = "exclude";
+		config_setting_lookup_string(config, "filter_default", &defaction);
+		const config_setting_t *filterconf = config_setting_lookup(config, "filter");
+		if (!(ret->filter = IngestFilter::byConfig(filterconf ? filterconf : config_lookup(&defconf, "filter"), defaction,
+			{ FIELDS, FIELDS + FIELDNUM })))
+			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver filter config invalid\n"), NULL);
+		// transforms of accepted values, see Transform
+		const config_setting_t *transconf = config_setting_lookup(config, "transforms");
+		if (ret->inittransforms(transconf ? transconf : config_lookup(&defconf, "transforms")) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver transforms config invalid\n"), NULL);
+		ret->addcounters();
 		return ret;
 	}
 	int start();
 	int stop();
+	// receive counters, also exported as self metrics
+	struct Stats
+	{
+		std::atomic<uint64_t> packets{0};
+		std::atomic<uint64_t> recvcalls{0};	// syscalls receiving at least one datagram
+		std::atomic<uint64_t> kerneldrops{0};	// dropped by the kernel for full socket buffers, by SO_RXQ_OVFL
+		std::atomic<uint64_t> truncated{0};	// larger than max_packet_size, dropped
+		std::atomic<uint64_t> bytes{0};	// of received datagrams
+	};
+	const Stats &getstats() const { return stats; }
 	enum ValType
 	{
 		COUNTER = 0,
@@ -44,17 +107,86 @@ public:
 		ABSOLUTE = 3,
 	};
 private:
-	CollectdReceiver(asio::io_service &ioService, int port):
-		m_ioService(ioService), m_buf(1452), m_socket(m_ioService, asio::ip::udp::v6()), port(port) { }
-	int init(const char *typesdbfile, TaskQueue *taskq);
-	int parse(const uint8_t *data, size_t size, AMon *amon);
+	CollectdReceiver(const std::vector<asio::io_service *> &ioServices, int port): m_ioServices(ioServices), port(port) { }
+	int init(const char *typesdbfile, AMon *amon);
+	int inittransforms(const config_setting_t *config);
+	void addcounters();
+	// series of a (host, plugin, instance, type, subtype) tuple, resolved on first sight. keyed by hash of the tuple
+	struct NameEntry
+	{
+		std::string key;	// the tuple joined by '\0', to tell apart hash collisions
+		size_t rule = 0;	// of the ingest filter deciding the tuple
+		size_t transform = 0;	// index in `transforms`, or its size for none
+		bool accepted = false;	// false to skip the values
+		int nvalues = -1;	// number of values by types.db, -1 if type unknown
+		// values to store, with the transform compiled in
+		struct Val
+		{
+			SeriesId id;
+			ValType vtype;
+			StoreType stype;
+			int32_t step;
+			std::vector<uint16_t> srcs;	// indexes of the received values, summed
+			double scale;	// stored value is offset + scale * sum
+			double offset;
+		};
+		std::vector<Val> vals;
+	};
+	typedef std::unordered_map<uint64_t, NameEntry> NameCache;
+	static const size_t NAMECACHEMAX = 65536;	// entries per socket, cleared when exceeded
+	// parse a packet into values of interned series, appended to `points`. values before an invalid part are kept.
+	// nothing is allocated once the series of the packet are in `names`
+	int parse(const uint8_t *data, size_t size, NameCache &names, std::vector<SeriesPoint> &points);
 private:
 	const char *m_name = "CollectdReceiver";
+	AMon *amon = NULL;
+	std::unique_ptr<IngestFilter> filter;
+	// a rule on the values of a tuple, applied before they are stored. compiled into NameEntry::Val on first sight of
+	// the tuple, so rules cost nothing per record
+	struct Transform
+	{
+		std::vector<int> values;	// indexes of values to keep, by types.db. empty for all
+		bool invert = false;	// percentage to its complement, 100 - value. before scale and offset
+		double scale = 1;
+		double offset = 0;
+		std::string rename[5];	// new names of host, plugin, instance, type and subtype in series names. empty to keep
+		bool sum = false;	// store the sum of the values as one series, named by `sumname` after the tuple
+		std::string sumname;
+	};
+	std::vector<Transform> transforms;
+	std::unique_ptr<IngestFilter> transformsel;	// selects the transform of a tuple by the first matching rule
+	static const char *FIELDS[];	// identifier fields of a value, as in filter and transform rules
+	static const size_t FIELDNUM = 5;
+	static const char *DEFAULTCONF;	// filter and transforms when not configured
 	int port = 0;
-	asio::io_service &m_ioService;
-	asio::ip::udp::socket m_socket;
-	asio::ip::udp::endpoint m_remote;
-	std::vector<uint8_t> m_buf;
+	int socknum = 1;
+	int batch = 32;
+	size_t bufsize = 1452;	// max datagram size
+	static const size_t BUFSMAX = 16 << 20;	// receive buffers per socket
+	int rcvbuf = 0;	// SO_RCVBUF, 0 for default
+	std::vector<asio::io_service *> m_ioServices;
+	// a receiving socket, used only by the thread of its io_service. packets are parsed on that thread, and the values
+	// queued to the owning shards through `outbox`
+	struct Socket
+	{
+		Socket(asio::io_service &ioService, AMon *amon): socket(ioService, asio::ip::udp::v6()), outbox(amon) { }
+		asio::ip::udp::socket socket;
+		AMon::Outbox outbox;
+		NameCache names;
+#ifdef __linux__
+		std::vector<uint8_t> bufs;	// bufsize per datagram, allocated once and parsed in place
+		std::vector<struct mmsghdr> msgs;
+		std::vector<struct iovec> iovs;
+		std::vector<struct sockaddr_in6> addrs;
+		std::vector<uint8_t> ctrls;	// control messages, CTRLSIZE per datagram
+		uint32_t overflows = 0;	// last SO_RXQ_OVFL count of the socket
+#else
+		asio::ip::udp::endpoint remote;
+		std::vector<uint8_t> buf;
+#endif
+	};
+	std::vector<std::unique_ptr<Socket>> sockets;
+	Stats stats;
 	// types.db
 	struct TypesdbVal
 	{
@@ -63,17 +195,40 @@ private:
 		StoreType stype;
 	};
 	std::unordered_map<std::string, std::vector<TypesdbVal>> typesdb;
-	// buffered history values for DERIVE values
+	// latest values of a DERIVE or COUNTER series, sorted by time, to turn cumulative values into rates.
+	// a few are kept so that a value arriving out of order fills the gap on both sides. a series summing several
+	// values keeps each of them, as they wrap and reset on their own
 	struct HistVal
 	{
 		uint32_t time = 0;
-		double val = 0;
-		bool operator <(const HistVal &r) const { return time < r.time; }
+		std::vector<double> vals;	// raw values of the sources of the series, before scale and offset
 	};
 	static const int HISTLEN = 3;
-	std::map<std::string, std::array<HistVal, HISTLEN>> histvals;
+	struct CounterHist
+	{
+		SeriesId id = AMON_NOSERIES;
+		std::array<HistVal, HISTLEN> hist;
+	};
+	// open addressing table of CounterHist by series id, with linear probing. striped by id, each stripe with its own
+	// lock, as packets are parsed on all I/O threads
+	struct CounterTable
+	{
+		std::mutex mutex;
+		std::vector<CounterHist> slots;	// size is a power of 2, at most half used
+		size_t used = 0;
+		CounterHist &get(SeriesId id);
+	};
+	static const size_t COUNTERSTRIPES = 16;
+	CounterTable counters[COUNTERSTRIPES];
 private:
-	int recv();
-	void onRecv(const asio::error_code& error, size_t size);
-	int process(struct CollectdRec &rec, AMon *amon);
+	int recv(Socket &sock);
+#ifdef __linux__
+	void onReadable(Socket &sock, const asio::error_code &error);
+#else
+	void onRecv(Socket &sock, const asio::error_code& error, size_t size);
+#endif
+	void onTruncated();
+	void onPacket(Socket &sock, const uint8_t *data, size_t size, const uint8_t *addr6, uint16_t port);
+	const NameEntry &resolve(const struct CollectdRec &rec, NameCache &names);
+	int process(const struct CollectdRec &rec, NameCache &names, std::vector<SeriesPoint> &points);
 };
\ No newline at end of file
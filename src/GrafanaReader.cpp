@@ -26,7 +26,7 @@ int GrafanaReader::stop()
 
 void GrafanaReader::accept()
 {
-	std::shared_ptr<GRTask> task = std::make_shared<GRTask>(m_ioService);
+	std::shared_ptr<GRTask> task = std::make_shared<GRTask>(*m_services[m_nextservice++ % m_services.size()]);
 	PELOG_LOG((PLV_DEBUG, "[%s] async_accept begin wait %d\n", m_name, (int)task->socket.native_handle()));
 	m_acceptor.async_accept(task->socket, [task, this](const asio::error_code& error) {
 		if(error)
@@ -86,6 +86,7 @@ int GrafanaReader::parsereq(std::shared_ptr<GRTask> grtask, TaskRead *amontask)
 	amontask->start = amontask->end = 0;
 	amontask->names.clear();
 	amontask->aggr = TaskRead::AMON_NOAGGR;
+	amontask->coverage = false;
 	grtask->status = GRTask::GR_REQERR;
 	//fprintf(stderr, "toparse %s\n", grtask->buf.get());
 	if (strncmp(grtask->buf, "GET /amon", 9) != 0)
@@ -153,10 +154,12 @@ int GrafanaReader::parsereq(std::shared_ptr<GRTask> grtask, TaskRead *amontask)
 			if (amontask->aggr == TaskRead::AMON_NOAGGR)
 				PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Invalid aggr type %s\n", m_name, p), -1);
 		}
+		else if (strncmp(p, "coverage=", 9) == 0)
+			amontask->coverage = strcmp(p + 9, "1") == 0;
 	}	// for (p = strtok_r(p, "&", &pe); p; p = strtok_r(NULL, "&", &pe))
 	if (amontask->aggr == TaskRead::AMON_CURRENT)
 	{
-		amontask->end = time(NULL) - AMON_MINSTEP;
+		amontask->end = time(NULL) - AMON_DEFSTEP;
 		amontask->start = amontask->end - 60 * 2;
 	}
 	// verification
@@ -173,6 +176,7 @@ int GrafanaReader::setresult(std::shared_ptr<GrafanaReader::GRTask> grtask, Task
 	if (grtask->status == GRTask::GR_OK)
 	{
 		assert(amontask->datatime.size() * amontask->names.size() == amontask->databuf.size());
+		assert(amontask->coverbuf.empty() || amontask->coverbuf.size() == amontask->databuf.size());
 		grtask->buf.append("{\"values\":[\n");
 		for (size_t itime = 0; itime < amontask->datatime.size(); ++itime)
 		{
@@ -180,14 +184,17 @@ int GrafanaReader::setresult(std::shared_ptr<GrafanaReader::GRTask> grtask, Task
 			for (size_t ival = 0; ival < amontask->names.size(); ++ival)
 			{
 				float val = amontask->databuf[ival * amontask->datatime.size() + itime];
-				if (!isnan(val))
-					grtask->buf.printf(R"( ,"val%d":%f)", (int)ival, val);
+				if (isnan(val))
+					continue;
+				grtask->buf.printf(R"( ,"val%d":%f)", (int)ival, val);
+				if (!amontask->coverbuf.empty())	// coverage requested
+					grtask->buf.printf(R"( ,"cov%d":%.3f)", (int)ival, amontask->coverbuf[ival * amontask->datatime.size() + itime]);
 			}
 			grtask->buf.append("}\n");
 		}
 		grtask->buf.append("]}\n");
 	}
-	m_ioService.post(std::bind(&GrafanaReader::response, this, grtask));
+	grtask->socket.get_io_service().post(std::bind(&GrafanaReader::response, this, grtask));
 	return 0;
 }
 
@@ -74,12 +74,13 @@ public:
 class GrafanaReader : public Reader
 {
 public:
-	static std::unique_ptr<GrafanaReader> byConfig(asio::io_service &ioService, TaskQueue *taskq, config_setting_t *config)
+	// connections are accepted on the first of `services`, and spread over all of them
+	static std::unique_ptr<GrafanaReader> byConfig(const std::vector<asio::io_service *> &services, TaskQueue *taskq, config_setting_t *config)
 	{
 		int port;
 		if (config_setting_lookup_int(config, "port", &port) == CONFIG_FALSE)
 			PELOG_ERROR_RETURN((PLV_ERROR, "GrafanaReader port config missing\n"), NULL);
-		auto ret = std::unique_ptr<GrafanaReader>(new GrafanaReader(ioService, taskq, port));
+		auto ret = std::unique_ptr<GrafanaReader>(new GrafanaReader(services, taskq, port));
 		return ret;
 	}
 	int start();
@@ -99,8 +100,8 @@ public:
 		bool recvshutdown = false;
 	};
 private:
-	GrafanaReader(asio::io_service &ioService, TaskQueue *taskq, int port):
-		m_ioService(ioService), m_acceptor(ioService), port(port) { this->taskq = taskq; }
+	GrafanaReader(const std::vector<asio::io_service *> &services, TaskQueue *taskq, int port):
+		m_services(services), m_acceptor(*services[0]), port(port) { this->taskq = taskq; }
 	void accept();
 	void recv(std::shared_ptr<GRTask> task);
 	int parsereq(std::shared_ptr<GRTask> grtask, TaskRead *amontask);
@@ -109,7 +110,8 @@ private:
 private:
 	const char *m_name = "GrafanaReader";
 	int port = 0;
-	asio::io_service &m_ioService;
+	std::vector<asio::io_service *> m_services;
+	size_t m_nextservice = 0;	// for next connection
 	asio::ip::tcp::acceptor m_acceptor;
 //	asio::ip::tcp::socket m_socket;
 };
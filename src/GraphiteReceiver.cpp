@@ -0,0 +1,284 @@
+#include "GraphiteReceiver.h"
+#include <math.h>
+#include "crc32c.h"
+
+int GraphiteReceiver::start()
+{
+	for (size_t i = 0; i < m_ioServices.size(); ++i)
+		iostates.emplace_back(new IOState(amon));
+	asio::error_code ec;
+	asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v6(), port);
+	if (m_acceptor.open(endpoint.protocol(), ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed opening acceptor (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	m_acceptor.set_option(asio::ip::v6_only(false));
+	m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+	if (m_acceptor.bind(endpoint, ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed binding to TCP port (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	if (m_acceptor.listen(asio::socket_base::max_connections, ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed listening on port (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	accept();
+	if (udp)
+	{
+		if (m_udpsocket.open(asio::ip::udp::v6(), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed opening UDP socket (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+		m_udpsocket.set_option(asio::ip::v6_only(false));
+		m_udpsocket.set_option(asio::socket_base::reuse_address(true));
+		if (m_udpsocket.bind(asio::ip::udp::endpoint(asio::ip::udp::v6(), port), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed binding to UDP port (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+		m_udpbuf.resize(UDPMAX + 1);	// room for the terminator of the last line
+		recvudp();
+	}
+	PELOG_LOG((PLV_INFO, "[%s] Listening on TCP%s %d, %d I/O threads\n", m_name, udp ? " and UDP" : "", port,
+		(int)m_ioServices.size()));
+	return 0;
+}
+
+int GraphiteReceiver::stop()
+{
+	if (m_acceptor.is_open())
+		m_acceptor.close();
+	asio::error_code ec;
+	m_retrytimer.cancel(ec);
+	if (m_udpsocket.is_open())
+		m_udpsocket.close();
+	return 0;
+}
+
+void GraphiteReceiver::accept()
+{
+	size_t idx = m_nextservice++ % m_ioServices.size();
+	std::shared_ptr<Conn> conn = std::make_shared<Conn>(*m_ioServices[idx], *iostates[idx]);
+	m_acceptor.async_accept(conn->socket, [conn, this](const asio::error_code &error) {
+		if (error == asio::error::operation_aborted)
+			return;	// stopped
+		if (error)
+		{
+			PELOG_LOG((PLV_ERROR, "[%s] accept failed (%d:%s)\n", m_name, error.value(), error.message().c_str()));
+			// keep listening. retry a bit later, as errors like running out of descriptors would repeat at once
+			m_retrytimer.expires_after(std::chrono::milliseconds(100));
+			m_retrytimer.async_wait([this](const asio::error_code &error) {
+				if (!error && m_acceptor.is_open())
+					accept();
+			});
+			return;
+		}
+		asio::error_code ec;
+		asio::ip::tcp::endpoint remote = conn->socket.remote_endpoint(ec);
+		if (ec)	// socket is invalid
+		{
+			PELOG_LOG((PLV_ERROR, "[%s]: accept error. %s\n", m_name, ec.message().c_str()));
+			conn->socket.close();
+		}
+		else
+		{
+			stats.connections.fetch_add(1, std::memory_order_relaxed);
+			asio::ip::address_v6 addr = remote.address().is_v6() ? remote.address().to_v6() :
+				asio::ip::address_v6::v4_mapped(remote.address().to_v4());
+			conn->source = crc32c(addr.to_bytes().data(), 16);
+			conn->buf.resize(maxline + 1);	// room for the terminator of the last line
+			PELOG_LOG((PLV_DEBUG, "[%s] connection from %s\n", m_name, addr.to_string().c_str()));
+			recv(conn);
+		}
+		accept();
+	});
+}
+
+void GraphiteReceiver::recv(std::shared_ptr<Conn> conn)
+{
+	conn->socket.async_read_some(asio::buffer(conn->buf.data() + conn->len, maxline - conn->len),
+		std::bind(&GraphiteReceiver::onRecv, this, conn, std::placeholders::_1 /*error*/, std::placeholders::_2 /*bytes_transferred*/));
+}
+
+void GraphiteReceiver::onRecv(std::shared_ptr<Conn> conn, const asio::error_code &error, size_t size)
+{
+	bool eof = error == asio::error::eof;
+	if (error && !eof)
+	{
+		if (error != asio::error::operation_aborted)
+			PELOG_LOG((PLV_DEBUG, "[%s] connection closed. %s\n", m_name, error.message().c_str()));
+		return;
+	}
+	stats.bytes.fetch_add(size, std::memory_order_relaxed);
+	conn->len += size;
+	size_t done = 0;
+	if (conn->skipping)	// rest of a too long line
+	{
+		const char *eol = (const char *)memchr(conn->buf.data(), '\n', conn->len);
+		done = eol ? eol - conn->buf.data() + 1 : conn->len;
+		conn->skipping = !eol;
+	}
+	thread_local std::vector<SeriesPoint> points;
+	points.clear();
+	done += parse(conn->buf.data() + done, conn->len - done, eof, conn->io.names, (uint32_t)time(NULL), points);
+	conn->len -= done;
+	if (conn->len > 0)	// keep the partial line
+		memmove(conn->buf.data(), conn->buf.data() + done, conn->len);
+	if (conn->len == maxline)	// no line end in a full buffer
+	{
+		PELOG_LOG((PLV_DEBUG, "[%s] line longer than max_line %d skipped\n", m_name, (int)maxline));
+		stats.invalid.fetch_add(1, std::memory_order_relaxed);
+		conn->skipping = true;
+		conn->len = 0;
+	}
+	queue(conn->io, points, conn->source);
+	if (eof)
+		PELOG_LOG((PLV_DEBUG, "[%s] connection closed by peer\n", m_name));
+	else
+		recv(conn);
+}
+
+void GraphiteReceiver::recvudp()
+{
+	m_udpremote = asio::ip::udp::endpoint();
+	m_udpsocket.async_receive_from(asio::buffer(m_udpbuf.data(), UDPMAX), m_udpremote,
+		[this](const asio::error_code &error, size_t size) {
+			if (error == asio::error::operation_aborted)
+				return;
+			if (error)
+				PELOG_LOG((PLV_ERROR, "[%s] UDP recv failed. %s\n", m_name, error.message().c_str()));
+			else
+			{
+				stats.bytes.fetch_add(size, std::memory_order_relaxed);
+				thread_local std::vector<SeriesPoint> points;
+				points.clear();
+				parse(m_udpbuf.data(), size, true, iostates[0]->names, (uint32_t)time(NULL), points);
+				queue(*iostates[0], points, crc32c(m_udpremote.address().to_v6().to_bytes().data(), 16));
+			}
+			if (m_udpsocket.is_open())
+				recvudp();
+		});
+}
+
+void GraphiteReceiver::queue(IOState &io, std::vector<SeriesPoint> &points, uint32_t source)
+{
+	if (points.empty())
+		return;
+	if (!io.outbox.add(points.data(), points.size(), source))
+		PELOG_LOG((PLV_DEBUG, "[%s] Dropped values, task queue overloaded\n", m_name));
+	io.outbox.flush();
+}
+
+static inline bool isfieldsep(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+size_t GraphiteReceiver::parse(char *data, size_t size, bool final, NameCache &names, uint32_t now,
+	std::vector<SeriesPoint> &points)
+{
+	uint64_t lines = 0, invalid = 0;
+	char *p = data;
+	char *end = data + size;
+	while (p < end)
+	{
+		char *eol = (char *)memchr(p, '\n', end - p);
+		if (!eol && !final)
+			break;	// partial line, wait for the rest
+		if (!eol)
+			eol = end;	// the caller has room for the terminator
+		char *line = p;
+		p = eol + 1;
+		*eol = 0;	// terminate the last field, for strtod()
+		// path
+		while (isfieldsep(*line))
+			++line;
+		if (!*line)
+			continue;	// empty line
+		++lines;
+		char *pe = line;
+		while (*pe && !isfieldsep(*pe))
+			++pe;
+		StrRef path(line, pe - line);
+		// value
+		while (isfieldsep(*pe))
+			++pe;
+		char *ve = NULL;
+		double value = strtod(pe, &ve);
+		bool valid = ve != pe && (!*ve || isfieldsep(*ve));
+		// timestamp, optional
+		double ts = -1;
+		for (pe = ve; valid && isfieldsep(*pe); )
+			++pe;
+		if (valid && *pe)
+		{
+			ts = strtod(pe, &ve);
+			for (valid = ve != pe; isfieldsep(*ve); )
+				++ve;
+			valid = valid && !*ve && ts < 4294967296.0;
+		}
+		// paths are file names, so no directories, and no hidden files
+		if (!valid || path.data[0] == '.' || memchr(path.data, '/', path.size))
+		{
+			++invalid;
+			if (pelog_getlevel() <= PLV_DEBUG)
+				PELOG_LOG((PLV_DEBUG, "[%s] invalid line %.*s\n", m_name, (int)(eol - line), line));
+			continue;
+		}
+		if (!isfinite(value))
+			continue;	// no value
+		const NameEntry &entry = resolve(path, names);
+		filter->hit(entry.rule);
+		if (!entry.accepted || entry.id == AMON_NOSERIES)
+			continue;
+		uint32_t time = ts <= 0 ? now : (uint32_t)ts;
+		time = (time + entry.step / 2) / entry.step * entry.step;	// round to level 0 step of the series
+		if (entry.stype == AMON_AUINT)
+			value = std::min(4294967295.0, std::max(0.0, value));
+		points.push_back(SeriesPoint{entry.id, time, value, entry.stype, 0});
+	}
+	stats.lines.fetch_add(lines, std::memory_order_relaxed);
+	if (invalid > 0)
+		stats.invalid.fetch_add(invalid, std::memory_order_relaxed);
+	return std::min(size, (size_t)(p - data));
+}
+
+// find or build the series of `path`
+const GraphiteReceiver::NameEntry &GraphiteReceiver::resolve(const StrRef &path, NameCache &names)
+{
+	uint64_t hash = 14695981039346656037ull;	// FNV-1a
+	for (size_t i = 0; i < path.size; ++i)
+		hash = (hash ^ (uint8_t)path.data[i]) * 1099511628211ull;
+	auto ientry = names.find(hash);
+	if (ientry != names.end() && StrRef(ientry->second.path.data(), ientry->second.path.size()) == path)
+		return ientry->second;
+
+	// not cached yet, resolve it
+	if (names.size() >= namecachemax)
+		names.clear();
+	NameEntry &entry = names[hash];
+	entry = NameEntry();
+	entry.path = path.str();
+	entry.rule = filter->match(&path);
+	entry.accepted = filter->accepts(entry.rule);
+	if (!entry.accepted)
+		return entry;
+	entry.id = amon->intern(entry.path);
+	entry.stype = stores[entry.rule];
+	if (entry.id != AMON_NOSERIES)
+		entry.step = amon->getstep(entry.id);
+	return entry;
+}
+
+int GraphiteReceiver::initstores(const config_setting_t *config, const char *defstore)
+{
+	stores.assign(filter->size() + 1, AMON_AUINT);
+	for (size_t irule = 0; irule < stores.size(); ++irule)
+	{
+		const char *store = defstore;
+		if (irule < filter->size())
+			config_setting_lookup_string(config_setting_get_elem(config, (int)irule), "store", &store);
+		if (strcmp(store, "auint") == 0)
+			stores[irule] = AMON_AUINT;
+		else if (strcmp(store, "fp16") == 0)
+			stores[irule] = AMON_FP16;
+		else
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid store type %s of rule %d\n", store, (int)irule), -1);
+	}
+	return 0;
+}
+
+void GraphiteReceiver::addcounters()
+{
+	amon->addcounter("ingest.graphite.lines", &stats.lines, AMON_AUINT);
+	amon->addcounter("ingest.graphite.invalid", &stats.invalid);
+	amon->addcounter("ingest.graphite.connections", &stats.connections);
+	amon->addcounter("ingest.graphite.bytes", &stats.bytes, AMON_AUINT);
+	filter->addcounters(amon, "ingest.graphite.filter");
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include "AMon.h"
+#include "asio.hpp"
+#include "pe_log.h"
+#include "libconfig/libconfig.h"
+#include "strref.h"
+#include "IngestFilter.h"
+
+// Graphite plaintext protocol, "<path> <value> [<timestamp>]\n" lines over persistent TCP connections, and optionally
+// UDP datagrams on the same port. a missing or -1 timestamp is the receiving time
+class GraphiteReceiver: public Receiver
+{
+public:
+	// connections are accepted on the first of `ioServices`, and spread over all of them
+	static std::unique_ptr<GraphiteReceiver> byConfig(const std::vector<asio::io_service *> &ioServices, AMon *amon,
+		config_setting_t *config)
+	{
+		if (!config)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver config missing\n"), NULL);
+		int port;
+		if (config_setting_lookup_int(config, "port", &port) == CONFIG_FALSE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver port config missing\n"), NULL);
+		if (ioServices.empty())
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver no I/O thread\n"), NULL);
+		auto ret = std::unique_ptr<GraphiteReceiver>(new GraphiteReceiver(ioServices, amon, port));
+		bool udp = false;
+		if (config_setting_lookup_bool(config, "udp", &udp) == CONFIG_TRUE)
+			ret->udp = udp;
+		// longest line accepted on TCP connections, longer ones are skipped
+		int maxline = (int)ret->maxline;
+		config_setting_lookup_int(config, "max_line", &maxline);
+		ret->maxline = std::min(65507, std::max(256, maxline));
+		// paths cached per I/O thread. each path is a series, so set it above the series count of a thread
+		int namecache = (int)ret->namecachemax;
+		config_setting_lookup_int(config, "name_cache", &namecache);
+		ret->namecachemax = std::max(1024, namecache);
+		// paths to accept, by rules on `path`, see IngestFilter. a rule may set `store` ("auint" or "fp16") of its
+		// series, `store_default` otherwise
+		const char *defaction = "include";
+		config_setting_lookup_string(config, "filter_default", &defaction);
+		if (!(ret->filter = IngestFilter::byConfig(config_setting_get_member(config, "filter"), defaction, { "path" },
+			{ "store" })))
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver filter config invalid\n"), NULL);
+		const char *defstore = "auint";
+		config_setting_lookup_string(config, "store_default", &defstore);
+		if (ret->initstores(config_setting_get_member(config, "filter"), defstore) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver store config invalid\n"), NULL);
+		ret->addcounters();
+		return ret;
+	}
+	int start();
+	int stop();
+	// receive counters, also exported as self metrics
+	struct Stats
+	{
+		std::atomic<uint64_t> lines{0};
+		std::atomic<uint64_t> invalid{0};	// lines not parsed, or too long
+		std::atomic<uint64_t> connections{0};
+		std::atomic<uint64_t> bytes{0};
+	};
+	const Stats &getstats() const { return stats; }
+private:
+	GraphiteReceiver(const std::vector<asio::io_service *> &ioServices, AMon *amon, int port):
+		amon(amon), port(port), m_ioServices(ioServices), m_acceptor(*ioServices[0]), m_retrytimer(*ioServices[0]),
+		m_udpsocket(*ioServices[0])
+	{
+		taskq = amon->gettaskq();
+	}
+	int initstores(const config_setting_t *config, const char *defstore);
+	void addcounters();
+	// series of a path, resolved on first sight. keyed by hash of the path
+	struct NameEntry
+	{
+		std::string path;	// to tell apart hash collisions
+		size_t rule = 0;	// of the ingest filter deciding the path
+		bool accepted = false;
+		SeriesId id = AMON_NOSERIES;
+		StoreType stype = AMON_AUINT;
+		int32_t step = 1;
+	};
+	typedef std::unordered_map<uint64_t, NameEntry> NameCache;
+public:
+	// parse the complete lines of `data` into values, appended to `points`. lines are modified in place.
+	// return bytes parsed, up to after the last '\n', or all of `data` if `final`.
+	// nothing is allocated once the paths are in `names`
+	size_t parse(char *data, size_t size, bool final, NameCache &names, uint32_t now, std::vector<SeriesPoint> &points);
+private:
+	const char *m_name = "GraphiteReceiver";
+	AMon *amon = NULL;
+	int port = 0;
+	bool udp = false;
+	size_t maxline = 4096;
+	size_t namecachemax = 262144;	// entries per I/O thread, cleared when exceeded
+	std::unique_ptr<IngestFilter> filter;
+	std::vector<StoreType> stores;	// by filter rule, the last one for no match
+	std::vector<asio::io_service *> m_ioServices;
+	size_t m_nextservice = 0;	// for next connection
+	asio::ip::tcp::acceptor m_acceptor;
+	asio::system_timer m_retrytimer;	// to accept again after a failure
+	asio::ip::udp::socket m_udpsocket;
+	asio::ip::udp::endpoint m_udpremote;
+	std::vector<char> m_udpbuf;
+	static const size_t UDPMAX = 65507;	// largest datagram, so none is truncated
+	// state of an I/O thread, used only by that thread. values of all its connections are queued by one outbox
+	struct IOState
+	{
+		IOState(AMon *amon): outbox(amon) { }
+		AMon::Outbox outbox;
+		NameCache names;
+	};
+	std::vector<std::unique_ptr<IOState>> iostates;	// by index in m_ioServices
+	struct Conn
+	{
+		Conn(asio::io_service &ioService, IOState &io): socket(ioService), io(io) { }
+		asio::ip::tcp::socket socket;
+		IOState &io;
+		uint32_t source = 0;	// hash of the peer address, for load shedding
+		std::vector<char> buf;	// lines received, parsed up to the last '\n'
+		size_t len = 0;
+		bool skipping = false;	// in a line longer than the buffer, skipped until its end
+	};
+	Stats stats;
+private:
+	void accept();
+	void recv(std::shared_ptr<Conn> conn);
+	void onRecv(std::shared_ptr<Conn> conn, const asio::error_code &error, size_t size);
+	void recvudp();
+	const NameEntry &resolve(const StrRef &path, NameCache &names);
+	// values of `points` to the shards, shedding by `source`
+	void queue(IOState &io, std::vector<SeriesPoint> &points, uint32_t source);
+};
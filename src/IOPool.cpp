@@ -0,0 +1,50 @@
+#include "IOPool.h"
+
+IOPool::IOPool(int threadnum/* = 1*/)
+{
+	for (int i = 0; i < threadnum; ++i)
+		services.push_back(std::unique_ptr<asio::io_service>(new asio::io_service(1)));
+}
+
+int IOPool::start()
+{
+	if (!threads.empty())
+		PELOG_ERROR_RETURN((PLV_ERROR, "IOPool already running\n"), -1);
+	for (size_t i = 0; i < services.size(); ++i)
+	{
+		services[i]->reset();
+		works.push_back(std::unique_ptr<asio::io_service::work>(new asio::io_service::work(*services[i])));
+		threads.push_back(std::thread([this, i]() {
+			PELOG_LOG((PLV_VERBOSE, "IO thread %d started\n", (int)i));
+			services[i]->run();
+			PELOG_LOG((PLV_VERBOSE, "IO thread %d finished\n", (int)i));
+		}));
+		setaffinity(threads.back(), cpus, i);
+	}
+	PELOG_LOG((PLV_INFO, "IOPool started with %d threads\n", (int)threads.size()));
+	return 0;
+}
+
+int IOPool::stop()
+{
+	works.clear();
+	for (auto &service: services)
+		service->stop();
+	for (std::thread &thrd: threads)
+		thrd.join();
+	threads.clear();
+	return 0;
+}
+
+std::vector<asio::io_service *> IOPool::byindex(const config_setting_t *config, const std::vector<int> &defidx)
+{
+	std::vector<int> idx;
+	if (getintlist(config, idx) != 0)
+		PELOG_LOG((PLV_WARNING, "Invalid I/O thread config, using default\n"));
+	if (idx.empty())
+		idx = defidx;
+	std::vector<asio::io_service *> ret;
+	for (int i: idx)
+		ret.push_back(&get(i));
+	return ret;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <thread>
+#include "AMon.h"
+#include "asio.hpp"
+#include "libconfig/libconfig.h"
+
+// I/O threads, each running its own io_service, so a busy worker (e.g. many HTTP responses) does not delay the
+// others (e.g. UDP reads). workers are assigned to threads by index in their config
+class IOPool
+{
+public:
+	static std::unique_ptr<IOPool> byConfig(const config_t *config)
+	{
+		int threadnum = config_get_int(config, "io.threads", 1);
+		if (threadnum <= 0)
+			threadnum = std::max(1u, std::thread::hardware_concurrency());
+		auto ret = std::unique_ptr<IOPool>(new IOPool(std::min(threadnum, 256)));
+		if (getintlist(config_lookup(config, "io.affinity"), ret->cpus) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid io.affinity config\n"), NULL);
+		return ret;
+	}
+	IOPool(int threadnum = 1);
+	~IOPool() { stop(); }
+	int start();
+	// stop all io_services and wait for the threads to finish
+	int stop();
+	size_t size() const { return services.size(); }
+	asio::io_service &get(size_t idx) { return *services[idx % services.size()]; }
+	// io_services of thread indexes in `config` (an int or a list), `defidx` if missing
+	std::vector<asio::io_service *> byindex(const config_setting_t *config, const std::vector<int> &defidx);
+private:
+	std::vector<std::unique_ptr<asio::io_service>> services;
+	std::vector<std::unique_ptr<asio::io_service::work>> works;	// keep io_services running while idle
+	std::vector<std::thread> threads;
+	std::vector<int> cpus;	// cpus to pin threads to, by thread index. empty for no pinning
+};
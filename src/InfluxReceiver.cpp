@@ -0,0 +1,801 @@
+#include "InfluxReceiver.h"
+#include <math.h>
+#include <algorithm>
+#include "crc32c.h"
+
+InfluxReceiver::Conn::~Conn()
+{
+#ifdef AMON_ZLIB
+	if (zinit)
+		inflateEnd(&zs);
+#endif
+}
+
+int InfluxReceiver::start()
+{
+	for (size_t i = 0; i < m_ioServices.size(); ++i)
+		iostates.emplace_back(new IOState(amon));
+	asio::error_code ec;
+	asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v6(), port);
+	if (m_acceptor.open(endpoint.protocol(), ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed opening acceptor (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	m_acceptor.set_option(asio::ip::v6_only(false));
+	m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+	if (m_acceptor.bind(endpoint, ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed binding to port (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	if (m_acceptor.listen(asio::socket_base::max_connections, ec))
+		PELOG_ERROR_RETURN((PLV_ERROR, "[%s] Failed listening on port (%d:%s)\n", m_name, ec.value(), ec.message().c_str()), 1);
+	accept();
+#ifdef AMON_ZLIB
+	const char *gzip = "with";
+#else
+	const char *gzip = "without";
+#endif
+	PELOG_LOG((PLV_INFO, "[%s] Listening on HTTP %d, %d I/O threads, %s gzip\n", m_name, port, (int)m_ioServices.size(), gzip));
+	return 0;
+}
+
+int InfluxReceiver::stop()
+{
+	if (m_acceptor.is_open())
+		m_acceptor.close();
+	asio::error_code ec;
+	m_retrytimer.cancel(ec);
+	return 0;
+}
+
+void InfluxReceiver::accept()
+{
+	size_t idx = m_nextservice++ % m_ioServices.size();
+	std::shared_ptr<Conn> conn = std::make_shared<Conn>(*m_ioServices[idx], *iostates[idx]);
+	m_acceptor.async_accept(conn->socket, [conn, this](const asio::error_code &error) {
+		if (error == asio::error::operation_aborted)
+			return;	// stopped
+		if (error)
+		{
+			PELOG_LOG((PLV_ERROR, "[%s] accept failed (%d:%s)\n", m_name, error.value(), error.message().c_str()));
+			// keep listening. retry a bit later, as errors like running out of descriptors would repeat at once
+			m_retrytimer.expires_after(std::chrono::milliseconds(100));
+			m_retrytimer.async_wait([this](const asio::error_code &error) {
+				if (!error && m_acceptor.is_open())
+					accept();
+			});
+			return;
+		}
+		asio::error_code ec;
+		asio::ip::tcp::endpoint remote = conn->socket.remote_endpoint(ec);
+		if (ec)	// socket is invalid
+		{
+			PELOG_LOG((PLV_ERROR, "[%s]: accept error. %s\n", m_name, ec.message().c_str()));
+			conn->socket.close();
+		}
+		else
+		{
+			asio::ip::address_v6 addr = remote.address().is_v6() ? remote.address().to_v6() :
+				asio::ip::address_v6::v4_mapped(remote.address().to_v4());
+			conn->source = crc32c(addr.to_bytes().data(), 16);
+			conn->peer = addr.is_v4_mapped() ? addr.to_v4().to_string() : addr.to_string();
+			conn->socket.set_option(asio::ip::tcp::no_delay(true));
+			conn->in.resize(INSIZE);
+			conn->lines.resize(maxline + 1);	// room for the terminator of the last line
+			recv(conn);
+		}
+		accept();
+	});
+}
+
+void InfluxReceiver::recv(std::shared_ptr<Conn> conn)
+{
+	conn->socket.async_read_some(asio::buffer(conn->in.data() + conn->inlen, INSIZE - conn->inlen),
+		std::bind(&InfluxReceiver::onRecv, this, conn, std::placeholders::_1 /*error*/, std::placeholders::_2 /*bytes_transferred*/));
+}
+
+void InfluxReceiver::onRecv(std::shared_ptr<Conn> conn, const asio::error_code &error, size_t size)
+{
+	if (error)
+	{
+		if (error != asio::error::eof && error != asio::error::operation_aborted)
+			PELOG_LOG((PLV_DEBUG, "[%s] connection from %s closed. %s\n", m_name, conn->peer.c_str(), error.message().c_str()));
+		return;
+	}
+	conn->inlen += size;
+	thread_local std::vector<SeriesPoint> points;
+	points.clear();
+	bool more = process(conn, points);
+	queue(conn->io, points, conn->source);
+	if (more)
+		recv(conn);
+}
+
+static void consume(std::vector<char> &buf, size_t &len, size_t n)
+{
+	len -= n;
+	if (len > 0)
+		memmove(buf.data(), buf.data() + n, len);
+}
+
+bool InfluxReceiver::process(std::shared_ptr<Conn> conn, std::vector<SeriesPoint> &points)
+{
+	while (true)
+	{
+		if (conn->state == Conn::ST_HEAD)
+		{
+			char *end = (char *)memmem(conn->in.data(), conn->inlen, "\r\n\r\n", 4);
+			if (!end)
+			{
+				if (conn->inlen < INSIZE)
+					return true;	// wait for the rest
+				conn->keepalive = false;
+				respond(conn, 431, "request head too long");
+				return false;
+			}
+			*end = 0;
+			int code = parsehead(*conn, conn->in.data());
+			consume(conn->in, conn->inlen, end + 4 - conn->in.data());
+			if (code != 0)
+			{
+				respond(conn, code, code >= 400 ? conn->error : "");
+				return false;
+			}
+			if (!conn->chunked && conn->bodyleft == 0)
+			{
+				finish(conn, points);
+				return false;
+			}
+			if (conn->expect)	// the client waits for this before sending the body, read on once it is sent
+			{
+				static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+				conn->expect = false;
+				asio::async_write(conn->socket, asio::buffer(CONTINUE, sizeof(CONTINUE) - 1),
+					[this, conn](const asio::error_code &error, size_t) { onRecv(conn, error, 0); });
+				return false;
+			}
+			continue;
+		}
+		// body
+		size_t used = conn->inlen;
+		if (conn->chunked)
+			used = dechunk(*conn, conn->in.data(), conn->inlen, points);
+		else
+		{
+			used = (size_t)std::min(conn->bodyleft, (uint64_t)conn->inlen);
+			feed(*conn, conn->in.data(), used, points);
+			conn->bodyleft -= used;
+		}
+		consume(conn->in, conn->inlen, used);
+		if (conn->chunked ? conn->chunkstate == Conn::CH_DONE : conn->bodyleft == 0)
+		{
+			finish(conn, points);
+			return false;
+		}
+		return true;
+	}
+}
+
+// parse the request line and headers, terminated by '\0'. 0 if a body follows, or the status code to respond with
+int InfluxReceiver::parsehead(Conn &conn, char *head)
+{
+	// reset the request
+	conn.state = Conn::ST_HEAD;
+	conn.chunked = conn.gzip = conn.skipping = conn.expect = false;
+	conn.bodyleft = conn.chunkleft = conn.received = 0;
+	conn.chunkstate = Conn::CH_SIZE;
+	conn.tsdiv = 1000000000;
+	conn.tsmul = 1;
+	conn.linelen = 0;
+	conn.error.clear();
+	conn.bstats = BodyStats();
+	conn.stime = std::chrono::steady_clock::now();
+#ifdef AMON_ZLIB
+	if (conn.zinit)
+		inflateReset(&conn.zs);
+	conn.zend = false;
+#endif
+	// request line
+	char *pe = NULL;
+	char *method = strtok_r(head, " ", &pe);
+	char *target = method ? strtok_r(NULL, " ", &pe) : NULL;
+	char *version = target ? strtok_r(NULL, "\r\n", &pe) : NULL;
+	if (!version || strncmp(version, "HTTP/1.", 7) != 0)
+	{
+		conn.keepalive = false;
+		conn.error = "invalid request line";
+		return 400;
+	}
+	conn.keepalive = strcmp(version, "HTTP/1.0") != 0;
+	// headers
+	bool haslength = false;
+	for (char *line = strtok_r(NULL, "\r\n", &pe); line; line = strtok_r(NULL, "\r\n", &pe))
+	{
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = 0;
+		while (*value == ' ' || *value == '\t')
+			++value;
+		if (strcasecmp(line, "Content-Length") == 0)
+		{
+			conn.bodyleft = strtoull(value, NULL, 10);
+			haslength = true;
+		}
+		else if (strcasecmp(line, "Transfer-Encoding") == 0)
+			conn.chunked = strcasestr(value, "chunked") != NULL;
+		else if (strcasecmp(line, "Content-Encoding") == 0)
+			conn.gzip = strcasecmp(value, "gzip") == 0;
+		else if (strcasecmp(line, "Connection") == 0)
+			conn.keepalive = strcasecmp(value, "close") != 0 && (conn.keepalive || strcasecmp(value, "keep-alive") == 0);
+		else if (strcasecmp(line, "Expect") == 0)
+			conn.expect = strcasecmp(value, "100-continue") == 0;
+	}
+	// route
+	char *query = strchr(target, '?');
+	if (query)
+		*query++ = 0;
+	if (strcmp(target, "/ping") == 0 || strcmp(target, "/health") == 0)
+	{
+		if (conn.chunked || conn.bodyleft > 0)
+			conn.keepalive = false;	// the body is not read
+		return 204;
+	}
+	if (strcmp(target, "/write") != 0 && strcmp(target, "/api/v2/write") != 0)
+	{
+		conn.keepalive = false;	// the body, if any, is not read
+		conn.error = "not found";
+		return 404;
+	}
+	if (strcmp(method, "POST") != 0)
+	{
+		conn.keepalive = false;
+		conn.error = "method not allowed";
+		return 405;
+	}
+	if (!conn.chunked && !haslength)
+	{
+		conn.keepalive = false;
+		conn.error = "length required";
+		return 411;
+	}
+#ifndef AMON_ZLIB
+	if (conn.gzip)
+	{
+		conn.keepalive = false;
+		conn.error = "gzip not supported";
+		return 415;
+	}
+#endif
+	// precision of timestamps, v1 and v2 names
+	for (char *param = query ? strtok_r(query, "&", &pe) : NULL; param; param = strtok_r(NULL, "&", &pe))
+	{
+		if (strncmp(param, "precision=", 10) != 0)
+			continue;
+		static const struct { const char *name; uint64_t div; uint32_t mul; } precisions[] = {
+			{ "n", 1000000000, 1 }, { "ns", 1000000000, 1 }, { "u", 1000000, 1 }, { "us", 1000000, 1 },
+			{ "ms", 1000, 1 }, { "s", 1, 1 }, { "m", 1, 60 }, { "h", 1, 3600 },
+		};
+		bool found = false;
+		for (const auto &precision: precisions)
+		{
+			if (strcmp(param + 10, precision.name) == 0)
+			{
+				conn.tsdiv = precision.div;
+				conn.tsmul = precision.mul;
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			conn.keepalive = false;
+			conn.error = std::string("invalid precision ") + (param + 10);
+			return 400;
+		}
+	}
+	conn.state = Conn::ST_BODY;
+	return 0;
+}
+
+// decode chunked transfer encoding, feeding the chunk data. return bytes used
+size_t InfluxReceiver::dechunk(Conn &conn, char *data, size_t size, std::vector<SeriesPoint> &points)
+{
+	size_t pos = 0;
+	while (pos < size && conn.chunkstate != Conn::CH_DONE)
+	{
+		if (conn.chunkstate == Conn::CH_DATA)
+		{
+			size_t n = (size_t)std::min(conn.chunkleft, (uint64_t)(size - pos));
+			feed(conn, data + pos, n, points);
+			pos += n;
+			if ((conn.chunkleft -= n) == 0)
+				conn.chunkstate = Conn::CH_DATAEND;
+			continue;
+		}
+		char *eol = (char *)memmem(data + pos, size - pos, "\r\n", 2);
+		if (!eol)
+		{
+			if (size - pos > 1024)	// chunk size line or trailer too long
+			{
+				conn.error = "invalid chunked encoding";
+				conn.keepalive = false;
+				conn.chunkstate = Conn::CH_DONE;
+				return size;
+			}
+			break;	// wait for the line end
+		}
+		char *line = data + pos;
+		pos = eol + 2 - data;
+		if (conn.chunkstate == Conn::CH_DATAEND)
+		{
+			if (eol != line)
+			{
+				conn.error = "invalid chunked encoding";
+				conn.keepalive = false;
+				conn.chunkstate = Conn::CH_DONE;
+				return size;
+			}
+			conn.chunkstate = Conn::CH_SIZE;
+		}
+		else if (conn.chunkstate == Conn::CH_SIZE)
+		{
+			char *end = NULL;
+			conn.chunkleft = strtoull(line, &end, 16);
+			if (end == line || *end != ';' && *end != '\r')
+			{
+				conn.error = "invalid chunked encoding";
+				conn.keepalive = false;
+				conn.chunkstate = Conn::CH_DONE;
+				return size;
+			}
+			conn.chunkstate = conn.chunkleft > 0 ? Conn::CH_DATA : Conn::CH_TRAILER;
+		}
+		else if (conn.chunkstate == Conn::CH_TRAILER && eol == line)	// empty line ends the trailer
+			conn.chunkstate = Conn::CH_DONE;
+	}
+	return pos;
+}
+
+// body data as received, decompressed into `lines` if needed
+void InfluxReceiver::feed(Conn &conn, const char *data, size_t size, std::vector<SeriesPoint> &points)
+{
+	conn.received += size;
+	while (size > 0 && conn.error.empty())	// the rest of the body is skipped after an error
+	{
+#ifdef AMON_ZLIB
+		if (conn.gzip)
+		{
+			if (conn.zend)
+				return;	// data after the compressed stream
+			if (!conn.zinit)
+			{
+				memset(&conn.zs, 0, sizeof(conn.zs));
+				if (inflateInit2(&conn.zs, 16 + MAX_WBITS) != Z_OK)	// gzip header
+				{
+					conn.error = "gzip init failed";
+					return;
+				}
+				conn.zinit = true;
+			}
+			conn.zs.next_in = (Bytef *)data;
+			conn.zs.avail_in = (uInt)size;
+			conn.zs.next_out = (Bytef *)conn.lines.data() + conn.linelen;
+			conn.zs.avail_out = (uInt)(maxline - conn.linelen);
+			int res = inflate(&conn.zs, Z_NO_FLUSH);
+			if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+			{
+				conn.error = std::string("gzip: ") + (conn.zs.msg ? conn.zs.msg : "invalid data");
+				return;
+			}
+			conn.zend = res == Z_STREAM_END;
+			data += size - conn.zs.avail_in;
+			size = conn.zs.avail_in;
+			conn.bstats.bytes += maxline - conn.zs.avail_out - conn.linelen;
+			conn.linelen = maxline - conn.zs.avail_out;
+			drain(conn, false, points);
+			continue;
+		}
+#endif
+		size_t n = std::min(size, maxline - conn.linelen);
+		memcpy(conn.lines.data() + conn.linelen, data, n);
+		conn.linelen += n;
+		conn.bstats.bytes += n;
+		data += n;
+		size -= n;
+		drain(conn, false, points);
+	}
+}
+
+// parse the complete lines of the body received so far, or all if `final`
+void InfluxReceiver::drain(Conn &conn, bool final, std::vector<SeriesPoint> &points)
+{
+	size_t done = 0;
+	if (conn.skipping)	// rest of a too long line
+	{
+		const char *eol = (const char *)memchr(conn.lines.data(), '\n', conn.linelen);
+		done = eol ? eol - conn.lines.data() + 1 : conn.linelen;
+		conn.skipping = !eol;
+	}
+	done += parse(conn.lines.data() + done, conn.linelen - done, final, conn.io.names, (uint32_t)time(NULL), conn.tsdiv,
+		conn.tsmul, points, conn.bstats);
+	conn.linelen -= done;
+	if (conn.linelen > 0)	// keep the partial line
+		memmove(conn.lines.data(), conn.lines.data() + done, conn.linelen);
+	if (conn.linelen == maxline)	// no line end in a full buffer
+	{
+		++conn.bstats.lines;
+		++conn.bstats.invalid;
+		conn.skipping = true;
+		conn.linelen = 0;
+	}
+}
+
+// the body is complete, respond
+void InfluxReceiver::finish(std::shared_ptr<Conn> conn, std::vector<SeriesPoint> &points)
+{
+	drain(*conn, true, points);
+#ifdef AMON_ZLIB
+	if (conn->gzip && conn->error.empty() && !conn->zend)
+		conn->error = "gzip: unexpected end of body";
+#endif
+	const BodyStats &bstats = conn->bstats;
+	stats.requests.fetch_add(1, std::memory_order_relaxed);
+	stats.lines.fetch_add(bstats.lines, std::memory_order_relaxed);
+	stats.values.fetch_add(bstats.values, std::memory_order_relaxed);
+	stats.invalid.fetch_add(bstats.invalid, std::memory_order_relaxed);
+	stats.bytes.fetch_add(bstats.bytes, std::memory_order_relaxed);
+	if (pelog_getlevel() <= PLV_DEBUG)
+	{
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - conn->stime).count();
+		PELOG_LOG((PLV_DEBUG, "[%s] write from %s: %llu lines, %llu values, %llu invalid, %llu bytes (%llu received) in "
+			"%.1fms, %.0f lines/s\n", m_name, conn->peer.c_str(), (unsigned long long)bstats.lines,
+			(unsigned long long)bstats.values, (unsigned long long)bstats.invalid, (unsigned long long)bstats.bytes,
+			(unsigned long long)conn->received, secs * 1000, secs > 0 ? bstats.lines / secs : 0.0));
+	}
+	if (conn->error.empty() && bstats.invalid > 0)
+		conn->error = "partial write: " + std::to_string(bstats.invalid) + " invalid lines";
+	conn->state = Conn::ST_HEAD;
+	respond(conn, conn->error.empty() ? 204 : 400, conn->error);
+}
+
+// send a response, then go on with the next request of the connection, if kept alive
+void InfluxReceiver::respond(std::shared_ptr<Conn> conn, int code, const std::string &error)
+{
+	const char *reason = code == 204 ? "No Content" : code == 400 ? "Bad Request" : code == 404 ? "Not Found" :
+		code == 405 ? "Method Not Allowed" : code == 411 ? "Length Required" : code == 415 ? "Unsupported Media Type" :
+		code == 431 ? "Request Header Fields Too Large" : "Error";
+	std::string body;
+	if (!error.empty())
+	{
+		body = "{\"error\":\"";
+		for (char c: error)
+			body.append(c == '"' || c == '\\' ? "\\" : "").append(1, c);
+		body += "\"}\n";
+	}
+	conn->resp = "HTTP/1.1 " + std::to_string(code) + " " + reason + "\r\n";
+	if (!body.empty())
+		conn->resp += "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+	conn->resp += conn->keepalive ? "\r\n" : "Connection: close\r\n\r\n";
+	conn->resp += body;
+	asio::async_write(conn->socket, asio::buffer(conn->resp), [conn, this](const asio::error_code &error, size_t len) {
+		if (error || !conn->keepalive)
+		{
+			asio::error_code ec;
+			conn->socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+			conn->socket.close(ec);
+			return;
+		}
+		thread_local std::vector<SeriesPoint> points;
+		points.clear();
+		bool more = process(conn, points);	// pipelined requests
+		queue(conn->io, points, conn->source);
+		if (more)
+			recv(conn);
+	});
+}
+
+void InfluxReceiver::queue(IOState &io, std::vector<SeriesPoint> &points, uint32_t source)
+{
+	if (points.empty())
+		return;
+	if (!io.outbox.add(points.data(), points.size(), source))
+		PELOG_LOG((PLV_DEBUG, "[%s] Dropped values, task queue overloaded\n", m_name));
+	io.outbox.flush();
+}
+
+size_t InfluxReceiver::parse(char *data, size_t size, bool final, NameCache &names, uint32_t now, uint64_t tsdiv,
+	uint32_t tsmul, std::vector<SeriesPoint> &points, BodyStats &bstats)
+{
+	char *p = data;
+	char *end = data + size;
+	while (p < end)
+	{
+		char *eol = (char *)memchr(p, '\n', end - p);
+		if (!eol && !final)
+			break;	// partial line, wait for the rest
+		if (!eol)
+			eol = end;	// the caller has room for the terminator
+		char *line = p;
+		p = eol + 1;
+		*eol = 0;
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = 0;
+		while (*line == ' ' || *line == '\t')
+			++line;
+		if (!*line || *line == '#')
+			continue;	// empty line or comment
+		++bstats.lines;
+		size_t npoints = points.size();
+		if (parseline(line, names, now, tsdiv, tsmul, points) != 0)
+		{
+			points.erase(points.begin() + npoints, points.end());	// a line is written entirely or not at all
+			++bstats.invalid;
+			if (pelog_getlevel() <= PLV_DEBUG)
+				PELOG_LOG((PLV_DEBUG, "[%s] invalid line %s\n", m_name, line));
+		}
+		else
+			bstats.values += points.size() - npoints;
+	}
+	return std::min(size, (size_t)(p - data));
+}
+
+// skip to the first `stop` or `stop2` not escaped by '\\', or the end of string
+static inline char *scanto(char *p, char stop, char stop2 = 0)
+{
+	while (*p && *p != stop && *p != stop2)
+		p += *p == '\\' && p[1] ? 2 : 1;
+	return p;
+}
+
+static inline uint64_t fnv1a(uint64_t hash, const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+	return hash;
+}
+
+// one line, terminated by '\0'
+int InfluxReceiver::parseline(char *line, NameCache &names, uint32_t now, uint64_t tsdiv, uint32_t tsmul,
+	std::vector<SeriesPoint> &points)
+{
+	// series key, measurement and tags
+	char *p = scanto(line, ' ');
+	if (!*p || *line == ',')
+		return -1;
+	StrRef serieskey(line, p - line);
+	uint64_t keyhash = fnv1a(14695981039346656037ull, serieskey.data, serieskey.size) * 1099511628211ull;
+	while (*p == ' ')
+		++p;
+	// fields, up to a space not escaped or quoted
+	char *fields = p;
+	for (bool quoted = false; *p && (quoted || *p != ' '); ++p)
+	{
+		if (*p == '\\' && p[1])
+			++p;
+		else if (*p == '"')
+			quoted = !quoted;
+	}
+	char *fieldsend = p;
+	// timestamp, optional
+	uint32_t time = now;
+	while (*p == ' ')
+		++p;
+	if (*p)
+	{
+		char *te = NULL;
+		long long ts = strtoll(p, &te, 10);
+		while (*te == ' ')
+			++te;
+		if (te == p || *te || ts < 0 || (uint64_t)ts / tsdiv > 0xffffffffull / tsmul)
+			return -1;
+		time = (uint32_t)((uint64_t)ts / tsdiv * tsmul);
+	}
+	*fieldsend = 0;
+	if (fields == fieldsend)
+		return -1;
+	for (p = fields; *p; )
+	{
+		char *key = p;
+		p = scanto(p, '=', ',');
+		if (*p != '=' || p == key)
+			return -1;
+		StrRef fieldkey(key, p - key);
+		char *value = ++p;
+		double val = 0;
+		bool numeric = true;
+		if (*value == '"')	// string, skipped
+		{
+			for (++p; *p && *p != '"'; ++p)
+				if (*p == '\\' && p[1])
+					++p;
+			if (*p++ != '"')
+				return -1;
+			numeric = false;
+		}
+		else
+		{
+			p = scanto(p, ',');
+			char term = *p;
+			*p = 0;
+			if ((*value == 't' || *value == 'T') && (!value[1] || strcmp(value, "true") == 0 ||
+				strcmp(value, "True") == 0 || strcmp(value, "TRUE") == 0))
+				val = 1;
+			else if ((*value == 'f' || *value == 'F') && (!value[1] || strcmp(value, "false") == 0 ||
+				strcmp(value, "False") == 0 || strcmp(value, "FALSE") == 0))
+				val = 0;
+			else
+			{
+				char *ve = NULL;
+				val = strtod(value, &ve);
+				if (ve != value && (*ve == 'i' || *ve == 'u'))	// integer
+					++ve;
+				if (ve == value || *ve || !isfinite(val))
+					return -1;
+			}
+			*p = term;
+		}
+		if (*p == ',')
+			++p;
+		else if (*p)
+			return -1;
+		if (!numeric)
+			continue;
+		const NameEntry &entry = resolve(serieskey, fieldkey, fnv1a(keyhash, fieldkey.data, fieldkey.size), names);
+		filter->hit(entry.rule);
+		if (!entry.accepted || entry.id == AMON_NOSERIES)
+			continue;
+		if (entry.stype == AMON_AUINT)
+			val = std::min(4294967295.0, std::max(0.0, val));
+		points.push_back(SeriesPoint{entry.id, (time + entry.step / 2) / entry.step * entry.step, val, entry.stype, 0});
+	}
+	return 0;
+}
+
+// the text of an escaped part of a line
+static std::string unescape(const char *p, const char *end)
+{
+	std::string ret;
+	for (; p < end; ++p)
+		ret.append(1, *p == '\\' && p + 1 < end ? *++p : *p);
+	return ret;
+}
+
+// find or build the series of a field
+const InfluxReceiver::NameEntry &InfluxReceiver::resolve(const StrRef &serieskey, const StrRef &fieldkey, uint64_t hash,
+	NameCache &names)
+{
+	auto ientry = names.find(hash);
+	if (ientry != names.end())
+	{
+		const std::string &key = ientry->second.key;
+		if (key.size() == serieskey.size + 1 + fieldkey.size && memcmp(key.data(), serieskey.data, serieskey.size) == 0 &&
+			memcmp(key.data() + serieskey.size + 1, fieldkey.data, fieldkey.size) == 0)
+			return ientry->second;
+	}
+
+	// not cached yet, resolve it
+	if (names.size() >= namecachemax)
+		names.clear();
+	NameEntry &entry = names[hash];
+	entry = NameEntry();
+	entry.key.assign(serieskey.data, serieskey.size).append(1, '\0').append(fieldkey.data, fieldkey.size);
+	// split the series key, a copy terminated by '\0' for scanto()
+	std::string keystr = serieskey.str();
+	char *p = &keystr[0];
+	char *pe = scanto(p, ',');
+	std::string measurement = unescape(p, pe);
+	std::vector<std::pair<std::string, std::string>> tags;
+	while (*pe == ',')
+	{
+		p = pe + 1;
+		char *eq = scanto(p, '=', ',');
+		pe = scanto(eq, ',');
+		if (*eq == '=')
+			tags.emplace_back(unescape(p, eq), unescape(eq + 1, pe));
+	}
+	std::sort(tags.begin(), tags.end());
+	std::string field = unescape(fieldkey.data, fieldkey.data + fieldkey.size);
+	const StrRef parts[2] = { StrRef(measurement.data(), measurement.size()), StrRef(field.data(), field.size()) };
+	entry.rule = filter->match(parts);
+	entry.accepted = filter->accepts(entry.rule);
+	if (!entry.accepted)
+		return entry;
+
+	// name by template
+	std::string name;
+	auto append = [&name](std::string part, bool tagvalue) {
+		for (char &c: part)	// names are file names
+			if (c == '/' || c == ' ' || c == '\t' || c == '\0' || c == ',' || tagvalue && c == '.')
+				c = '_';
+		if (part.empty())
+			return;
+		if (!name.empty())
+			name.append(1, '.');
+		name.append(part);
+	};
+	for (const TemplatePart &tpart: tmpl)
+	{
+		if (tpart.type == TemplatePart::MEASUREMENT)
+			append(measurement, false);
+		else if (tpart.type == TemplatePart::FIELD)
+			append(field == "value" ? "" : field, false);	// a single value is named by the rest
+		else if (tpart.type == TemplatePart::TAG)
+		{
+			for (const auto &tag: tags)
+				if (tag.first == tpart.tag)
+					append(tag.second, true);
+		}
+		else	// TAGS, those not named in the template, by key
+		{
+			for (const auto &tag: tags)
+				if (std::find_if(tmpl.begin(), tmpl.end(), [&tag](const TemplatePart &t) {
+					return t.type == TemplatePart::TAG && t.tag == tag.first; }) == tmpl.end())
+					append(tag.second, true);
+		}
+	}
+	if (name.empty())
+	{
+		entry.accepted = false;
+		return entry;
+	}
+	if (name[0] == '.')
+		name[0] = '_';
+	entry.id = amon->intern(name);
+	entry.stype = stores[entry.rule];
+	if (entry.id != AMON_NOSERIES)
+		entry.step = amon->getstep(entry.id);
+	return entry;
+}
+
+// '.' separated parts: "measurement", "field", "tags" for the values of tags not in other parts, sorted by key, or a
+// tag key for its value. parts missing in a line are left out
+int InfluxReceiver::inittemplate(const char *str)
+{
+	tmpl.clear();
+	bool hasfield = false;
+	for (const char *p = str, *pe = str; *pe; p = pe + 1)
+	{
+		pe = strchr(p, '.');
+		if (!pe)
+			pe = p + strlen(p);
+		std::string part(p, pe);
+		if (part.empty())
+			PELOG_ERROR_RETURN((PLV_ERROR, "Empty part in template %s\n", str), -1);
+		if (part == "measurement")
+			tmpl.push_back(TemplatePart{TemplatePart::MEASUREMENT, ""});
+		else if (part == "field")
+			tmpl.push_back(TemplatePart{TemplatePart::FIELD, ""});
+		else if (part == "tags")
+			tmpl.push_back(TemplatePart{TemplatePart::TAGS, ""});
+		else
+			tmpl.push_back(TemplatePart{TemplatePart::TAG, part});
+		hasfield = hasfield || part == "field";
+	}
+	if (!hasfield)	// fields of a line would share the name
+		PELOG_ERROR_RETURN((PLV_ERROR, "No field in template %s\n", str), -1);
+	return 0;
+}
+
+int InfluxReceiver::initstores(const config_setting_t *config, const char *defstore)
+{
+	stores.assign(filter->size() + 1, AMON_AUINT);
+	for (size_t irule = 0; irule < stores.size(); ++irule)
+	{
+		const char *store = defstore;
+		if (irule < filter->size())
+			config_setting_lookup_string(config_setting_get_elem(config, (int)irule), "store", &store);
+		if (strcmp(store, "auint") == 0)
+			stores[irule] = AMON_AUINT;
+		else if (strcmp(store, "fp16") == 0)
+			stores[irule] = AMON_FP16;
+		else
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid store type %s of rule %d\n", store, (int)irule), -1);
+	}
+	return 0;
+}
+
+void InfluxReceiver::addcounters()
+{
+	amon->addcounter("ingest.influx.requests", &stats.requests);
+	amon->addcounter("ingest.influx.lines", &stats.lines, AMON_AUINT);
+	amon->addcounter("ingest.influx.values", &stats.values, AMON_AUINT);
+	amon->addcounter("ingest.influx.invalid", &stats.invalid);
+	amon->addcounter("ingest.influx.bytes", &stats.bytes, AMON_AUINT);
+	filter->addcounters(amon, "ingest.influx.filter");
+}
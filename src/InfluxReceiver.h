@@ -0,0 +1,194 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include "AMon.h"
+#include "asio.hpp"
+#include "pe_log.h"
+#include "libconfig/libconfig.h"
+#include "strref.h"
+#include "IngestFilter.h"
+#ifdef AMON_ZLIB
+#	include <zlib.h>
+#endif
+
+// InfluxDB line protocol over HTTP: POST /write (v1) or /api/v2/write, with a body of
+// "<measurement>[,<tag>=<value>...] <field>=<value>[,<field>=<value>...] [<timestamp>]" lines, gzip compressed if
+// Content-Encoding says so (when built with zlib). the body is parsed as it arrives, and the values of each read are
+// queued together. string fields are skipped, booleans are stored as 1 and 0
+class InfluxReceiver: public Receiver
+{
+public:
+	// connections are accepted on the first of `ioServices`, and spread over all of them
+	static std::unique_ptr<InfluxReceiver> byConfig(const std::vector<asio::io_service *> &ioServices, AMon *amon,
+		config_setting_t *config)
+	{
+		if (!config)
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver config missing\n"), NULL);
+		int port;
+		if (config_setting_lookup_int(config, "port", &port) == CONFIG_FALSE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver port config missing\n"), NULL);
+		if (ioServices.empty())
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver no I/O thread\n"), NULL);
+		auto ret = std::unique_ptr<InfluxReceiver>(new InfluxReceiver(ioServices, amon, port));
+		// longest line accepted, longer ones are skipped
+		int maxline = (int)ret->maxline;
+		config_setting_lookup_int(config, "max_line", &maxline);
+		ret->maxline = std::min(16 << 20, std::max(1024, maxline));
+		// series names, see inittemplate()
+		const char *tmpl = "host.tags.measurement.field";
+		config_setting_lookup_string(config, "template", &tmpl);
+		if (ret->inittemplate(tmpl) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver template invalid: %s\n", tmpl), NULL);
+		// names cached per I/O thread. one entry per field of a series
+		int namecache = (int)ret->namecachemax;
+		config_setting_lookup_int(config, "name_cache", &namecache);
+		ret->namecachemax = std::max(1024, namecache);
+		// values to accept, by rules on `measurement` and `field`, see IngestFilter. a rule may set `store` ("auint" or
+		// "fp16") of its series, `store_default` otherwise
+		const char *defaction = "include";
+		config_setting_lookup_string(config, "filter_default", &defaction);
+		if (!(ret->filter = IngestFilter::byConfig(config_setting_get_member(config, "filter"), defaction,
+			{ "measurement", "field" }, { "store" })))
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver filter config invalid\n"), NULL);
+		const char *defstore = "auint";
+		config_setting_lookup_string(config, "store_default", &defstore);
+		if (ret->initstores(config_setting_get_member(config, "filter"), defstore) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver store config invalid\n"), NULL);
+		ret->addcounters();
+		return ret;
+	}
+	int start();
+	int stop();
+	// receive counters, also exported as self metrics
+	struct Stats
+	{
+		std::atomic<uint64_t> requests{0};
+		std::atomic<uint64_t> lines{0};
+		std::atomic<uint64_t> values{0};
+		std::atomic<uint64_t> invalid{0};	// lines not parsed, or too long
+		std::atomic<uint64_t> bytes{0};	// of bodies, after decompression
+	};
+	const Stats &getstats() const { return stats; }
+private:
+	InfluxReceiver(const std::vector<asio::io_service *> &ioServices, AMon *amon, int port):
+		amon(amon), port(port), m_ioServices(ioServices), m_acceptor(*ioServices[0]), m_retrytimer(*ioServices[0])
+	{
+		taskq = amon->gettaskq();
+	}
+	int inittemplate(const char *tmpl);
+	int initstores(const config_setting_t *config, const char *defstore);
+	void addcounters();
+	// series of a field of a series key (measurement and tags as received), resolved on first sight. keyed by hash
+	struct NameEntry
+	{
+		std::string key;	// series key, '\0' and field key, to tell apart hash collisions
+		size_t rule = 0;	// of the ingest filter deciding the field
+		bool accepted = false;
+		SeriesId id = AMON_NOSERIES;
+		StoreType stype = AMON_AUINT;
+		int32_t step = 1;
+	};
+	typedef std::unordered_map<uint64_t, NameEntry> NameCache;
+public:
+	// counts of a request body
+	struct BodyStats
+	{
+		uint64_t lines = 0;
+		uint64_t values = 0;
+		uint64_t invalid = 0;
+		uint64_t bytes = 0;
+	};
+	// parse the complete lines of `data` into values, appended to `points`. lines are modified in place, and
+	// `data[size]` must be writable. timestamps are divided by `tsdiv` and multiplied by `tsmul` into seconds.
+	// return bytes parsed, up to after the last '\n', or all of `data` if `final`.
+	// nothing is allocated once the names are in `names`
+	size_t parse(char *data, size_t size, bool final, NameCache &names, uint32_t now, uint64_t tsdiv, uint32_t tsmul,
+		std::vector<SeriesPoint> &points, BodyStats &bstats);
+private:
+	const char *m_name = "InfluxReceiver";
+	AMon *amon = NULL;
+	int port = 0;
+	size_t maxline = 65536;
+	size_t namecachemax = 262144;	// entries per I/O thread, cleared when exceeded
+	// a part of series names
+	struct TemplatePart
+	{
+		enum Type { MEASUREMENT, FIELD, TAGS, TAG } type;
+		std::string tag;	// key of a TAG part
+	};
+	std::vector<TemplatePart> tmpl;
+	std::unique_ptr<IngestFilter> filter;
+	std::vector<StoreType> stores;	// by filter rule, the last one for no match
+	std::vector<asio::io_service *> m_ioServices;
+	size_t m_nextservice = 0;	// for next connection
+	asio::ip::tcp::acceptor m_acceptor;
+	asio::system_timer m_retrytimer;	// to accept again after a failure
+	// state of an I/O thread, used only by that thread. values of all its connections are queued by one outbox
+	struct IOState
+	{
+		IOState(AMon *amon): outbox(amon) { }
+		AMon::Outbox outbox;
+		NameCache names;
+	};
+	std::vector<std::unique_ptr<IOState>> iostates;	// by index in m_ioServices
+	static const size_t INSIZE = 65536;	// read buffer, also the longest request head
+	// an HTTP connection, with the request being received
+	struct Conn
+	{
+		Conn(asio::io_service &ioService, IOState &io): socket(ioService), io(io) { }
+		~Conn();
+		asio::ip::tcp::socket socket;
+		IOState &io;
+		uint32_t source = 0;	// hash of the peer address, for load shedding
+		std::string peer;
+		std::vector<char> in;	// received, not processed yet
+		size_t inlen = 0;
+		enum State { ST_HEAD, ST_BODY } state = ST_HEAD;
+		bool keepalive = true;
+		bool expect = false;	// the client waits for "100 Continue" before sending the body
+		// body
+		bool chunked = false;
+		uint64_t bodyleft = 0;	// by Content-Length
+		enum ChunkState { CH_SIZE, CH_DATA, CH_DATAEND, CH_TRAILER, CH_DONE } chunkstate = CH_SIZE;
+		uint64_t chunkleft = 0;
+		bool gzip = false;
+#ifdef AMON_ZLIB
+		z_stream zs;
+		bool zinit = false;
+		bool zend = false;	// end of the compressed stream
+#endif
+		uint64_t tsdiv = 1000000000;	// precision of timestamps, ns by default
+		uint32_t tsmul = 1;
+		std::vector<char> lines;	// body, parsed up to the last '\n'
+		size_t linelen = 0;
+		bool skipping = false;	// in a line longer than the buffer, skipped until its end
+		std::string error;	// of the request, reported in the response
+		BodyStats bstats;
+		uint64_t received = 0;	// body bytes as received
+		std::chrono::steady_clock::time_point stime;
+		std::string resp;
+	};
+	Stats stats;
+private:
+	void accept();
+	void recv(std::shared_ptr<Conn> conn);
+	void onRecv(std::shared_ptr<Conn> conn, const asio::error_code &error, size_t size);
+	// process received bytes, until a response is sent or more is needed. false if not to read on, for a response
+	bool process(std::shared_ptr<Conn> conn, std::vector<SeriesPoint> &points);
+	int parsehead(Conn &conn, char *head);
+	size_t dechunk(Conn &conn, char *data, size_t size, std::vector<SeriesPoint> &points);
+	void feed(Conn &conn, const char *data, size_t size, std::vector<SeriesPoint> &points);
+	void drain(Conn &conn, bool final, std::vector<SeriesPoint> &points);
+	void finish(std::shared_ptr<Conn> conn, std::vector<SeriesPoint> &points);
+	void respond(std::shared_ptr<Conn> conn, int code, const std::string &error);
+	int parseline(char *line, NameCache &names, uint32_t now, uint64_t tsdiv, uint32_t tsmul,
+		std::vector<SeriesPoint> &points);
+	const NameEntry &resolve(const StrRef &serieskey, const StrRef &fieldkey, uint64_t hash, NameCache &names);
+	// values of `points` to the shards, shedding by `source`
+	void queue(IOState &io, std::vector<SeriesPoint> &points, uint32_t source);
+};
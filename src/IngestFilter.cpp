@@ -0,0 +1,132 @@
+#include "IngestFilter.h"
+#include <algorithm>
+
+// '*' any chars, '?' one char
+static bool globmatch(const char *p, const char *pe, const char *s, const char *se)
+{
+	const char *star = NULL;	// last '*' seen, to backtrack to
+	const char *starmatch = NULL;	// where the chars matched by `star` end
+	while (s < se)
+	{
+		if (p < pe && (*p == '?' || *p == *s))
+		{
+			++p;
+			++s;
+		}
+		else if (p < pe && *p == '*')
+		{
+			star = p++;
+			starmatch = s;
+		}
+		else if (star)	// let the last '*' match one more char
+		{
+			p = star + 1;
+			s = ++starmatch;
+		}
+		else
+			return false;
+	}
+	while (p < pe && *p == '*')
+		++p;
+	return p == pe;
+}
+
+void IngestFilter::Matcher::add(const std::string &pattern)
+{
+	any = false;
+	size_t wild = pattern.find_first_of("*?");
+	if (wild == std::string::npos)
+		exact.insert(std::upper_bound(exact.begin(), exact.end(), pattern), pattern);
+	else if (wild == pattern.size() - 1 && pattern[wild] == '*')
+		prefixes.push_back(pattern.substr(0, wild));
+	else
+		globs.push_back(pattern);
+}
+
+bool IngestFilter::Matcher::match(const StrRef &s) const
+{
+	if (any)
+		return true;
+	auto iexact = std::lower_bound(exact.begin(), exact.end(), s, [](const std::string &l, const StrRef &r) {
+		int cmp = memcmp(l.data(), r.data, std::min(l.size(), r.size));
+		return cmp < 0 || cmp == 0 && l.size() < r.size;
+	});
+	if (iexact != exact.end() && StrRef(iexact->data(), iexact->size()) == s)
+		return true;
+	for (const std::string &prefix: prefixes)
+		if (prefix.size() <= s.size && memcmp(prefix.data(), s.data, prefix.size()) == 0)
+			return true;
+	for (const std::string &glob: globs)
+		if (globmatch(glob.data(), glob.data() + glob.size(), s.data, s.data + s.size))
+			return true;
+	return false;
+}
+
+int IngestFilter::init(const config_setting_t *config, const char *defaction)
+{
+	if (strcmp(defaction, "include") != 0 && strcmp(defaction, "exclude") != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Invalid filter default action %s\n", defaction), -1);
+	definclude = strcmp(defaction, "include") == 0;
+	rules.clear();
+	if (config && !config_setting_is_list(config))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Filter config is not a list of rules\n"), -1);
+	for (int irule = 0; config && irule < config_setting_length(config); ++irule)
+	{
+		const config_setting_t *rconf = config_setting_get_elem(config, irule);
+		if (!config_setting_is_group(rconf))
+			PELOG_ERROR_RETURN((PLV_ERROR, "Filter rule %d is not a group\n", irule), -1);
+		Rule rule;
+		rule.name = "rule" + std::to_string(irule);
+		rule.matchers.resize(fields.size());
+		for (int ikey = 0; ikey < config_setting_length(rconf); ++ikey)
+		{
+			const config_setting_t *kconf = config_setting_get_elem(rconf, ikey);
+			const char *key = config_setting_name(kconf);
+			if (strcmp(key, "action") == 0 || strcmp(key, "name") == 0)
+			{
+				const char *val = config_setting_get_string(kconf);
+				if (!val || strcmp(key, "action") == 0 && strcmp(val, "include") != 0 && strcmp(val, "exclude") != 0)
+					PELOG_ERROR_RETURN((PLV_ERROR, "Invalid %s of filter rule %d\n", key, irule), -1);
+				if (strcmp(key, "action") == 0)
+					rule.include = strcmp(val, "include") == 0;
+				else
+					rule.name = val;
+				continue;
+			}
+			if (std::find(extrakeys.begin(), extrakeys.end(), key) != extrakeys.end())
+				continue;
+			size_t ifield = std::find(fields.begin(), fields.end(), key) - fields.begin();
+			std::vector<std::string> patterns;
+			if (ifield == fields.size() || getstrlist(kconf, patterns) != 0)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Invalid field %s of filter rule %d\n", key, irule), -1);
+			for (const std::string &pattern: patterns)
+				rule.matchers[ifield].add(pattern);
+		}
+		rules.push_back(std::move(rule));
+	}
+	hits.reset(new std::atomic<uint64_t>[rules.size() + 1]);
+	for (size_t i = 0; i <= rules.size(); ++i)
+		hits[i].store(0, std::memory_order_relaxed);
+	PELOG_LOG((PLV_INFO, "Ingest filter with " PL_SIZET " rules, %s others\n", rules.size(), definclude ? "include" : "exclude"));
+	return 0;
+}
+
+size_t IngestFilter::match(const StrRef *parts) const
+{
+	for (size_t irule = 0; irule < rules.size(); ++irule)
+	{
+		const Rule &rule = rules[irule];
+		size_t ifield = 0;
+		while (ifield < fields.size() && rule.matchers[ifield].match(parts[ifield]))
+			++ifield;
+		if (ifield == fields.size())
+			return irule;
+	}
+	return rules.size();
+}
+
+void IngestFilter::addcounters(AMon *amon, const std::string &prefix) const
+{
+	for (size_t i = 0; i <= rules.size(); ++i)
+		amon->addcounter(prefix + "." + (i < rules.size() ? rules[i].name : "default"), &hits[i], AMON_AUINT);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "AMon.h"
+#include "strref.h"
+#include "pe_log.h"
+#include "libconfig/libconfig.h"
+
+// include / exclude rules on the identifier parts (fields) of incoming values, first matching rule wins.
+// a rule has patterns for some fields, each a string or a list of strings matching any of them:
+//   "abc" exact, "abc*" prefix, "a?c*" glob ('*' any chars, '?' one char). a field not in the rule matches anything
+// e.g. for collectd: { action = "include"; host = ["web*", "db1"]; plugin = "cpu"; type = "percent"; }
+class IngestFilter
+{
+public:
+	// `config`: list of rules, `defaction`: "include" or "exclude" when no rule matches. `fields` are names of the
+	// identifier parts, in the order they are passed to match(). `extrakeys` are other keys allowed in rules, used by
+	// the caller, e.g. to select a transform by the first matching rule
+	static std::unique_ptr<IngestFilter> byConfig(const config_setting_t *config, const char *defaction,
+		const std::vector<std::string> &fields, const std::vector<std::string> &extrakeys = {})
+	{
+		auto ret = std::unique_ptr<IngestFilter>(new IngestFilter(fields, extrakeys));
+		if (ret->init(config, defaction) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid ingest filter config\n"), NULL);
+		return ret;
+	}
+	// index of the first rule matching `parts` (one per field), or size() if none
+	size_t match(const StrRef *parts) const;
+	bool accepts(size_t rule) const { return rule < rules.size() ? rules[rule].include : definclude; }
+	// count a value (or a record of values) decided by `rule`, as returned by match()
+	void hit(size_t rule) { hits[rule].fetch_add(1, std::memory_order_relaxed); }
+	size_t size() const { return rules.size(); }
+	// export hit counters as self metrics `<prefix>.<rule name>`, and `<prefix>.default` for no match
+	void addcounters(AMon *amon, const std::string &prefix) const;
+private:
+	IngestFilter(const std::vector<std::string> &fields, const std::vector<std::string> &extrakeys):
+		fields(fields), extrakeys(extrakeys) { }
+	int init(const config_setting_t *config, const char *defaction);
+private:
+	// patterns of one field, compiled by kind
+	struct Matcher
+	{
+		bool any = true;
+		std::vector<std::string> exact;	// sorted, for binary search
+		std::vector<std::string> prefixes;
+		std::vector<std::string> globs;
+		void add(const std::string &pattern);
+		bool match(const StrRef &s) const;
+	};
+	struct Rule
+	{
+		std::string name;
+		bool include = true;
+		std::vector<Matcher> matchers;	// by field
+	};
+	std::vector<std::string> fields;
+	std::vector<std::string> extrakeys;
+	std::vector<Rule> rules;
+	bool definclude = false;
+	std::unique_ptr<std::atomic<uint64_t>[]> hits;	// by rule, the last one for no match
+};
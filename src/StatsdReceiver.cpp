@@ -0,0 +1,471 @@
+#include "StatsdReceiver.h"
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+int StatsdReceiver::start()
+{
+#ifndef __linux__
+	socknum = 1;	// no SO_REUSEPORT
+#endif
+	for (int i = 0; i < socknum; ++i)
+	{
+		sockets.emplace_back(new Socket(*m_ioServices[i % m_ioServices.size()], amon));
+		Socket &sock = *sockets.back();
+		asio::error_code ec;
+		sock.socket.set_option(asio::socket_base::reuse_address(true));
+		sock.socket.set_option(asio::ip::v6_only(false));
+#ifdef __linux__
+		if (socknum > 1 && sock.socket.set_option(reuse_port(true), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] SO_REUSEPORT failed: %s\n", m_name, ec.message().c_str()), ec.value());
+#endif
+		if (sock.socket.non_blocking(true, ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] set non-blocking failed: %s\n", m_name, ec.message().c_str()), ec.value());
+		sock.buf.resize(UDPMAX + 1);	// room for the terminator of the last line
+		sock.rng += i;
+		if (sock.socket.bind(asio::ip::udp::endpoint(asio::ip::udp::v6(), port), ec))
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] UDP bind failed: %s\n", m_name, ec.message().c_str()), ec.value());
+		int res = 0;
+		if ((res = recv(sock)) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "[%s] start failed.\n", m_name), res);
+		schedule(sock);
+	}
+	PELOG_LOG((PLV_INFO, "[%s] Listening on UDP %d, %d sockets, flush every %ds\n", m_name, port, socknum, interval));
+	return 0;
+}
+
+// values of the last interval not flushed yet are dropped
+int StatsdReceiver::stop()
+{
+	for (auto &sock: sockets)
+	{
+		if (sock->socket.is_open())
+			sock->socket.close();
+		asio::error_code ec;
+		sock->timer.cancel(ec);
+	}
+	return 0;
+}
+
+int StatsdReceiver::recv(Socket &sock)
+{
+	sock.socket.async_receive_from(asio::buffer(sock.buf.data(), UDPMAX), sock.remote,
+		std::bind(&StatsdReceiver::onRecv, this, std::ref(sock), std::placeholders::_1 /*error*/, std::placeholders::_2 /*bytes_transferred*/));
+	return 0;
+}
+
+void StatsdReceiver::onRecv(Socket &sock, const asio::error_code &error, size_t size)
+{
+	if (error == asio::error::operation_aborted)
+		return;
+	if (error)
+		PELOG_LOG((PLV_ERROR, "[%s] recv failed. %s\n", m_name, error.message().c_str()));
+	else
+	{
+		// read the datagrams already queued without waiting on the socket again, but yield to other sockets of the
+		// thread after some
+		asio::error_code ec;
+		uint64_t packets = 1;
+		parse(sock.buf.data(), size, sock.metrics, sock.rng);
+		for (; packets < 64; ++packets)
+		{
+			size = sock.socket.receive_from(asio::buffer(sock.buf.data(), UDPMAX), sock.remote, 0, ec);
+			if (ec)
+				break;
+			parse(sock.buf.data(), size, sock.metrics, sock.rng);
+		}
+		stats.packets.fetch_add(packets, std::memory_order_relaxed);
+		if (ec && ec != asio::error::would_block && ec != asio::error::try_again)
+			PELOG_LOG((PLV_ERROR, "[%s] recv failed. %s\n", m_name, ec.message().c_str()));
+	}
+	if (sock.socket.is_open() && recv(sock) != 0)
+		PELOG_ERROR_RETURNVOID((PLV_ERROR, "[%s] start recv failed.\n", m_name));
+}
+
+static inline uint64_t fnv1a(const char *data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+	return hash;
+}
+
+int StatsdReceiver::parse(char *data, size_t size, MetricMap &metrics, uint32_t &rng)
+{
+	uint64_t events = 0, invalid = 0;
+	char *end = data + size;
+	*end = 0;
+	for (char *line = data, *eol = NULL; line < end; line = eol + 1)
+	{
+		if (!(eol = (char *)memchr(line, '\n', end - line)))
+			eol = end;
+		*eol = 0;
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = 0;
+		if (!*line)
+			continue;	// empty line
+		++events;
+		// <name>:<value>|<type>[|@<rate>][|#<tags>]
+		char *colon = strchr(line, ':');
+		char *bar = colon ? strchr(colon + 1, '|') : NULL;
+		if (!bar || colon == line || *line == '.' || memchr(line, '/', colon - line))	// names are file names
+		{
+			++invalid;
+			continue;
+		}
+		StrRef name(line, colon - line);
+		StrRef value(colon + 1, bar - colon - 1);
+		*bar = 0;	// terminate the value, for strtod()
+		char *type = bar + 1;
+		char *typeend = strchr(type, '|');
+		double rate = 1;
+		if (typeend)
+		{
+			*typeend = 0;
+			for (char *field = typeend + 1; field; )	// optional fields
+			{
+				char *fieldend = strchr(field, '|');
+				if (fieldend)
+					*fieldend++ = 0;
+				if (*field == '@')
+					rate = strtod(field + 1, NULL);
+				field = fieldend;
+			}
+			if (!(rate > 0 && rate <= 1))
+				rate = 1;
+		}
+		Kind kind;
+		if (strcmp(type, "c") == 0)
+			kind = COUNTER;
+		else if (strcmp(type, "g") == 0)
+			kind = GAUGE;
+		else if (strcmp(type, "s") == 0)
+			kind = SET;
+		else if (strcmp(type, "ms") == 0 || strcmp(type, "h") == 0)
+			kind = TIMER;
+		else
+		{
+			++invalid;
+			continue;
+		}
+		double val = 0;
+		if (kind != SET)
+		{
+			char *ve = NULL;
+			val = strtod(value.data, &ve);
+			if (value.empty() || *ve || !isfinite(val))
+			{
+				++invalid;
+				continue;
+			}
+		}
+
+		// the metric of the name, resolved on first sight
+		uint64_t hash = fnv1a(name.data, name.size);
+		auto imetric = metrics.find(hash);
+		if (imetric == metrics.end() || StrRef(imetric->second.name.data(), imetric->second.name.size()) != name)
+		{
+			if (imetric == metrics.end() && metrics.size() >= METRICSMAX)
+			{
+				++invalid;
+				continue;
+			}
+			Metric &metric = metrics[hash];
+			metric = Metric();
+			metric.name = name.str();
+			metric.rule = filter->match(&name);
+			metric.accepted = filter->accepts(metric.rule);
+			metric.agg.kind = kind;
+			imetric = metrics.find(hash);
+		}
+		Metric &metric = imetric->second;
+		filter->hit(metric.rule);
+		if (!metric.accepted)
+			continue;
+		Agg &agg = metric.agg;
+		if (agg.kind != kind)
+		{
+			if (agg.events > 0)	// a name has one type in an interval
+			{
+				++invalid;
+				continue;
+			}
+			agg.kind = kind;
+		}
+		++agg.events;
+		switch (kind)
+		{
+		case COUNTER:
+			agg.sum += val / rate;
+			break;
+		case GAUGE:
+			if (*value.data == '+' || *value.data == '-')
+				agg.sum += val;
+			else
+			{
+				agg.gaugeset = true;
+				agg.gauge = val;
+				agg.sum = 0;
+			}
+			break;
+		case SET:
+			agg.uniques.insert(fnv1a(value.data, value.size));
+			break;
+		case TIMER:
+			if (agg.count == 0 || val < agg.min)
+				agg.min = val;
+			if (agg.count == 0 || val > agg.max)
+				agg.max = val;
+			agg.count += 1 / rate;
+			agg.sum += val / rate;
+			// keep a uniform sample of the values, algorithm R
+			if (agg.samples.size() < samplemax)
+				agg.samples.push_back((float)val);
+			else
+			{
+				rng ^= rng << 13;	// xorshift32
+				rng ^= rng >> 17;
+				rng ^= rng << 5;
+				uint64_t idx = rng % agg.events;
+				if (idx < samplemax)
+					agg.samples[idx] = (float)val;
+			}
+			break;
+		}
+	}
+	stats.events.fetch_add(events, std::memory_order_relaxed);
+	if (invalid > 0)
+		stats.invalid.fetch_add(invalid, std::memory_order_relaxed);
+	return 0;
+}
+
+// wait for the end of the current interval, by the clock
+void StatsdReceiver::schedule(Socket &sock)
+{
+	auto now = std::chrono::system_clock::now();
+	uint32_t secs = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+	uint32_t window = secs / interval * interval;
+	sock.timer.expires_at(std::chrono::system_clock::time_point(std::chrono::seconds(window + interval)));
+	sock.timer.async_wait(std::bind(&StatsdReceiver::onTimer, this, std::ref(sock), window, std::placeholders::_1 /*error*/));
+}
+
+// merge the aggregates of the socket for `window` into the shared one, and store it when all sockets have merged
+void StatsdReceiver::onTimer(Socket &sock, uint32_t window, const asio::error_code &error)
+{
+	if (error)
+		return;	// stopped
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// the interval has been stored without this socket, which missed its timer. fold its events into the next one
+		bool late = window <= flushed && windows.find(window) == windows.end();
+		if (late)
+			window = flushed + interval;
+		Window &win = windows[window];
+		for (auto imetric = sock.metrics.begin(); imetric != sock.metrics.end(); )
+		{
+			Metric &metric = imetric->second;
+			if (metric.agg.events == 0)
+			{
+				if (++metric.idle > IDLEMAX)
+					imetric = sock.metrics.erase(imetric);
+				else
+					++imetric;
+				continue;
+			}
+			metric.idle = 0;
+			auto iseries = series.find(imetric->first);
+			if (iseries == series.end())
+			{
+				iseries = series.emplace(imetric->first, Series()).first;
+				iseries->second.name = metric.name;
+				iseries->second.kind = metric.agg.kind;
+				iseries->second.stype = stores[metric.rule];
+			}
+			merge(win.aggs[imetric->first], metric.agg);
+			metric.agg.reset();
+			++imetric;
+		}
+		if (!late)
+			++win.merged;
+		// store complete intervals, and those left behind by a socket that missed its timer
+		for (auto iwin = windows.begin(); iwin != windows.end(); )
+		{
+			if (iwin->second.merged < (int)sockets.size() && iwin->first + interval >= window)
+			{
+				++iwin;
+				continue;
+			}
+			store(sock, iwin->first, iwin->second);
+			flushed = std::max(flushed, iwin->first);
+			iwin = windows.erase(iwin);
+		}
+	}
+	sock.outbox.flush();
+	schedule(sock);
+}
+
+void StatsdReceiver::merge(Agg &to, const Agg &from)
+{
+	if (to.events == 0)
+		to.kind = from.kind;
+	else if (to.kind != from.kind)
+		return;	// the name has another type on other sockets
+	switch (from.kind)
+	{
+	case COUNTER:
+		to.sum += from.sum;
+		break;
+	case GAUGE:
+		if (from.gaugeset)
+		{
+			to.gaugeset = true;
+			to.gauge = from.gauge;
+			to.sum = from.sum;
+		}
+		else
+			to.sum += from.sum;
+		break;
+	case SET:
+		to.uniques.insert(from.uniques.begin(), from.uniques.end());
+		break;
+	case TIMER:
+		if (to.events == 0 || from.min < to.min)
+			to.min = from.min;
+		if (to.events == 0 || from.max > to.max)
+			to.max = from.max;
+		to.count += from.count;
+		to.sum += from.sum;
+		// each sample stands for an equal share of the events of its socket
+		to.samples.insert(to.samples.end(), from.samples.begin(), from.samples.end());
+		to.weights.insert(to.weights.end(), from.samples.size(), (float)(from.count / from.samples.size()));
+		break;
+	}
+	to.events += from.events;
+}
+
+// queue the values of an interval, on the thread of `sock`. a value stands for (window, window + interval], so it is
+// stored at the end of the interval and filled back over the level 0 steps of the series within it
+void StatsdReceiver::store(Socket &sock, uint32_t window, Window &win)
+{
+	thread_local std::vector<SeriesPoint> points;
+	points.clear();
+	for (auto iseries = series.begin(); iseries != series.end(); )
+	{
+		Series &ser = iseries->second;
+		auto iagg = win.aggs.find(iseries->first);
+		if (iagg == win.aggs.end())
+		{
+			if (++ser.idle > IDLEMAX)
+				iseries = series.erase(iseries);
+			else
+				++iseries;
+			continue;
+		}
+		ser.idle = 0;
+		Agg &agg = iagg->second;
+		if (ser.kind != agg.kind || ser.ids.empty())	// intern the series
+		{
+			ser.kind = agg.kind;
+			ser.ids.clear();
+			if (agg.kind != TIMER)
+				ser.ids.push_back(amon->intern(ser.name));
+			else
+			{
+				for (const char *stat: { ".count", ".mean", ".min", ".max" })
+					ser.ids.push_back(amon->intern(ser.name + stat));
+				for (int pct: percentiles)
+					ser.ids.push_back(amon->intern(ser.name + ".p" + std::to_string(pct)));
+			}
+			// an interval must span whole steps, or values of adjacent intervals would overwrite each other
+			for (SeriesId &id: ser.ids)
+			{
+				if (id != AMON_NOSERIES && interval % amon->getstep(id) != 0)
+				{
+					PELOG_LOG((PLV_WARNING, "[%s] flush_interval %d is not a multiple of step %d of %s, dropped\n", m_name,
+						interval, (int)amon->getstep(id), amon->getname(id).c_str()));
+					id = AMON_NOSERIES;
+				}
+			}
+		}
+		auto add = [&](size_t idx, double value) {
+			SeriesId id = ser.ids[idx];
+			if (id == AMON_NOSERIES)
+				return;
+			if (ser.stype == AMON_AUINT)
+				value = std::min(4294967295.0, std::max(0.0, value));
+			points.push_back(SeriesPoint{id, window + interval, value, ser.stype, (uint32_t)(interval - amon->getstep(id))});
+		};
+		switch (agg.kind)
+		{
+		case COUNTER:
+			add(0, agg.sum / interval);
+			break;
+		case GAUGE:
+			ser.gauge = (agg.gaugeset ? agg.gauge : ser.gauge) + agg.sum;
+			add(0, ser.gauge);
+			break;
+		case SET:
+			add(0, (double)agg.uniques.size());
+			break;
+		case TIMER:
+		{
+			add(0, agg.count / interval);
+			add(1, agg.count > 0 ? agg.sum / agg.count : 0);
+			add(2, agg.min);
+			add(3, agg.max);
+			// percentiles of the samples, by their weights
+			thread_local std::vector<size_t> order;
+			order.resize(agg.samples.size());
+			for (size_t i = 0; i < order.size(); ++i)
+				order[i] = i;
+			std::sort(order.begin(), order.end(), [&agg](size_t a, size_t b) { return agg.samples[a] < agg.samples[b]; });
+			double total = 0;
+			for (float weight: agg.weights)
+				total += weight;
+			double cum = 0;
+			size_t i = 0;
+			for (size_t ipct = 0; ipct < percentiles.size() && !order.empty(); ++ipct)
+			{
+				double target = total * percentiles[ipct] / 100;
+				while (i + 1 < order.size() && cum + agg.weights[order[i]] < target)
+					cum += agg.weights[order[i++]];
+				add(4 + ipct, agg.samples[order[i]]);
+			}
+			break;
+		}
+		}
+		++iseries;
+	}
+	if (!sock.outbox.add(points.data(), points.size(), 0))
+		PELOG_LOG((PLV_DEBUG, "[%s] Dropped aggregates, task queue overloaded\n", m_name));
+}
+
+int StatsdReceiver::initstores(const config_setting_t *config, const char *defstore)
+{
+	stores.assign(filter->size() + 1, AMON_AUINT);
+	for (size_t irule = 0; irule < stores.size(); ++irule)
+	{
+		const char *store = defstore;
+		if (irule < filter->size())
+			config_setting_lookup_string(config_setting_get_elem(config, (int)irule), "store", &store);
+		if (strcmp(store, "auint") == 0)
+			stores[irule] = AMON_AUINT;
+		else if (strcmp(store, "fp16") == 0)
+			stores[irule] = AMON_FP16;
+		else
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid store type %s of rule %d\n", store, (int)irule), -1);
+	}
+	return 0;
+}
+
+void StatsdReceiver::addcounters()
+{
+	amon->addcounter("ingest.statsd.packets", &stats.packets, AMON_AUINT);
+	amon->addcounter("ingest.statsd.events", &stats.events, AMON_AUINT);
+	amon->addcounter("ingest.statsd.invalid", &stats.invalid);
+	filter->addcounters(amon, "ingest.statsd.filter");
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <vector>
+#include "AMon.h"
+#include "asio.hpp"
+#include "pe_log.h"
+#include "libconfig/libconfig.h"
+#include "strref.h"
+#include "IngestFilter.h"
+
+// StatsD over UDP, "<name>:<value>|<type>[|@<rate>]" lines. events are aggregated per socket over each flush interval,
+// and only the aggregates are stored:
+//   c  counter, `name` in events per second
+//   g  gauge, `name` last value. a leading '+' or '-' changes it instead
+//   s  set, `name` number of unique values
+//   ms timer (or h histogram), `name.count` per second, `name.mean`, `name.min`, `name.max` and `name.p<N>` percentiles
+// DogStatsD tags (|#...) are ignored
+class StatsdReceiver: public Receiver
+{
+public:
+	// sockets are spread over `ioServices` round robin
+	static std::unique_ptr<StatsdReceiver> byConfig(const std::vector<asio::io_service *> &ioServices, AMon *amon,
+		config_setting_t *config)
+	{
+		if (!config)
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver config missing\n"), NULL);
+		int port;
+		if (config_setting_lookup_int(config, "port", &port) == CONFIG_FALSE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver port config missing\n"), NULL);
+		if (ioServices.empty())
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver no I/O thread\n"), NULL);
+		auto ret = std::unique_ptr<StatsdReceiver>(new StatsdReceiver(ioServices, amon, port));
+		// SO_REUSEPORT sockets on the port, one per I/O thread by default
+		int socknum = (int)ioServices.size();
+		config_setting_lookup_int(config, "sockets", &socknum);
+		ret->socknum = std::min(256, std::max(1, socknum));
+		// seconds aggregated into one value, aligned to the clock. a multiple of level 0 steps of the series
+		int interval = ret->interval;
+		config_setting_lookup_int(config, "flush_interval", &interval);
+		ret->interval = std::min(3600, std::max(AMON_MINSTEP, interval));
+		// timer values kept per socket and interval to estimate percentiles, by reservoir sampling beyond that
+		int samples = (int)ret->samplemax;
+		config_setting_lookup_int(config, "timer_samples", &samples);
+		ret->samplemax = std::min(1 << 20, std::max(16, samples));
+		if (const config_setting_t *pconf = config_setting_get_member(config, "percentiles"))
+		{
+			if (getintlist(pconf, ret->percentiles) != 0)
+				PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver percentiles config invalid\n"), NULL);
+			for (int pct: ret->percentiles)
+				if (pct <= 0 || pct >= 100)
+					PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver percentile %d not in 1..99\n", pct), NULL);
+		}
+		// names to accept, by rules on `metric` (the name), see IngestFilter. a rule may set `store` ("auint" or
+		// "fp16") of its series, `store_default` otherwise
+		const char *defaction = "include";
+		config_setting_lookup_string(config, "filter_default", &defaction);
+		if (!(ret->filter = IngestFilter::byConfig(config_setting_get_member(config, "filter"), defaction, { "metric" },
+			{ "store" })))
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver filter config invalid\n"), NULL);
+		const char *defstore = "auint";
+		config_setting_lookup_string(config, "store_default", &defstore);
+		if (ret->initstores(config_setting_get_member(config, "filter"), defstore) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver store config invalid\n"), NULL);
+		ret->addcounters();
+		return ret;
+	}
+	int start();
+	int stop();
+	// receive counters, also exported as self metrics
+	struct Stats
+	{
+		std::atomic<uint64_t> packets{0};
+		std::atomic<uint64_t> events{0};
+		std::atomic<uint64_t> invalid{0};	// lines not parsed, or of a name seen with another type
+	};
+	const Stats &getstats() const { return stats; }
+	enum Kind
+	{
+		COUNTER = 0,
+		GAUGE = 1,
+		SET = 2,
+		TIMER = 3,
+	};
+private:
+	StatsdReceiver(const std::vector<asio::io_service *> &ioServices, AMon *amon, int port):
+		amon(amon), port(port), m_ioServices(ioServices)
+	{
+		taskq = amon->gettaskq();
+	}
+	int initstores(const config_setting_t *config, const char *defstore);
+	void addcounters();
+	// events of a name in an interval, per socket, then merged over the sockets
+	struct Agg
+	{
+		Kind kind = COUNTER;
+		double count = 0;	// events, by sample rate
+		double sum = 0;	// counter: sum of values by sample rate. gauge: change after `gauge`. timer: sum of values
+		double min = 0;
+		double max = 0;
+		bool gaugeset = false;	// `gauge` is set in the interval
+		double gauge = 0;
+		std::unordered_set<uint64_t> uniques;	// set: hashes of the values
+		std::vector<float> samples;	// timer: values, at most samplemax per socket
+		std::vector<float> weights;	// timer, merged: events represented by each of `samples`
+		uint64_t events = 0;	// received, also the timer values offered to `samples`
+		void reset()
+		{
+			count = sum = min = max = gauge = 0;
+			gaugeset = false;
+			uniques.clear();
+			samples.clear();
+			weights.clear();
+			events = 0;
+		}
+	};
+	// a name seen by a socket, resolved on first sight. keyed by hash of the name
+	struct Metric
+	{
+		std::string name;	// to tell apart hash collisions
+		size_t rule = 0;	// of the ingest filter deciding the name
+		bool accepted = false;
+		int idle = 0;	// intervals without events, removed after IDLEMAX
+		Agg agg;
+	};
+	typedef std::unordered_map<uint64_t, Metric> MetricMap;
+	static const int IDLEMAX = 12;
+	static const size_t METRICSMAX = 1 << 20;	// names per socket, events of more are dropped
+public:
+	// parse the lines of a datagram into `metrics`, modified in place. `data[size]` must be writable.
+	// nothing is allocated once the names are in `metrics`, except for new values of sets
+	int parse(char *data, size_t size, MetricMap &metrics, uint32_t &rng);
+private:
+	const char *m_name = "StatsdReceiver";
+	AMon *amon = NULL;
+	int port = 0;
+	int socknum = 1;
+	int interval = AMON_DEFSTEP;
+	size_t samplemax = 1024;
+	std::vector<int> percentiles = { 50, 90, 99 };
+	std::unique_ptr<IngestFilter> filter;
+	std::vector<StoreType> stores;	// by filter rule, the last one for no match
+	std::vector<asio::io_service *> m_ioServices;
+	// a receiving socket, used only by the thread of its io_service. events are aggregated into `metrics` without
+	// locking, and merged into `windows` when its timer ends an interval
+	struct Socket
+	{
+		Socket(asio::io_service &ioService, AMon *amon): socket(ioService, asio::ip::udp::v6()), timer(ioService),
+			outbox(amon) { }
+		asio::ip::udp::socket socket;
+		asio::system_timer timer;
+		AMon::Outbox outbox;
+		asio::ip::udp::endpoint remote;
+		std::vector<char> buf;
+		MetricMap metrics;
+		uint32_t rng = 1;	// xorshift state for timer sampling
+	};
+	std::vector<std::unique_ptr<Socket>> sockets;
+	static const size_t UDPMAX = 65507;	// largest datagram
+	// aggregates of an interval merged from the sockets, stored when all have merged theirs
+	struct Window
+	{
+		int merged = 0;	// sockets
+		std::unordered_map<uint64_t, Agg> aggs;
+	};
+	std::map<uint32_t, Window> windows;	// by interval start
+	uint32_t flushed = 0;	// start of the latest interval stored
+	// series of a name and kind, interned on first store
+	struct Series
+	{
+		std::string name;
+		Kind kind;
+		StoreType stype;
+		std::vector<SeriesId> ids;	// timers: count, mean, min, max, percentiles. others: one
+		double gauge = 0;	// last value, for gauge changes
+		int idle = 0;
+	};
+	std::unordered_map<uint64_t, Series> series;
+	std::mutex mutex;	// of `windows` and `series`
+	Stats stats;
+private:
+	int recv(Socket &sock);
+	void onRecv(Socket &sock, const asio::error_code &error, size_t size);
+	void schedule(Socket &sock);
+	void onTimer(Socket &sock, uint32_t window, const asio::error_code &error);
+	void merge(Agg &to, const Agg &from);
+	void store(Socket &sock, uint32_t window, Window &win);
+};
@@ -0,0 +1,178 @@
+// amon-backfill: bulk import history values of one series into AMon data dir
+// Must not be run on a series being written by a running amon at the same time.
+//
+// usage: amon-backfill [-b] [-t auint|fp16] [-c amon.conf] <datadir> <name> [inputfile]
+// new series are created with the storage schema in amon.conf if given, otherwise with the default schema
+// input is read from stdin if inputfile is missing or "-", and must be sorted by time.
+//   text (default): one "time,value" per line, ',' or blanks as separator, lines starting with '#' are ignored
+//   binary (-b): records of { uint32_t time; float value; } in host byte order
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include "AMon.h"
+#include "resguard.h"
+
+static const size_t BLOCKLEN = 1 << 16;	// values per Alog::backfill() call
+
+static int usage()
+{
+	fprintf(stderr, "usage: amon-backfill [-b] [-t auint|fp16] [-c amon.conf] <datadir> <name> [inputfile]\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	bool binary = false;
+	StoreType type = AMON_NULL;
+	const char *conffile = NULL;
+	int argi = 1;
+	for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi)
+	{
+		if (strcmp(argv[argi], "-b") == 0)
+			binary = true;
+		else if (strcmp(argv[argi], "-c") == 0 && argi + 1 < argc)
+			conffile = argv[++argi];
+		else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc)
+		{
+			++argi;
+			if (strcmp(argv[argi], "auint") == 0)
+				type = AMON_AUINT;
+			else if (strcmp(argv[argi], "fp16") == 0)
+				type = AMON_FP16;
+			else
+				return usage();
+		}
+		else
+			return usage();
+	}
+	if (argc - argi < 2 || argc - argi > 3)
+		return usage();
+	const char *datadir = argv[argi];
+	const char *name = argv[argi + 1];
+	const char *inname = argc - argi > 2 ? argv[argi + 2] : "-";
+	pelog_setlevel("WRN");
+
+	FILEGuard fp = (FILE *)NULL;
+	FILE *in = stdin;
+	if (strcmp(inname, "-") != 0)
+	{
+		fp = fopen(inname, "rb");
+		if (!fp)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Open input failed %s\n", inname), 1);
+		in = fp;
+	}
+	AlogConf alogconf;
+	if (conffile)
+	{
+		config_t config;
+		config_init(&config);
+		ResGuard<config_t> config_guard(&config, config_destroy);
+		if (CONFIG_FALSE == config_read_file(&config, conffile))
+			PELOG_ERROR_RETURN((PLV_ERROR, "Error loading config file (line %d): %s\n",
+				config_error_line(&config), config_error_text(&config)), 1);
+		if (alogconf.loadschemas(config_lookup(&config, "storage.schemas")) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Invalid storage.schemas config\n"), 1);
+	}
+	Alog log(&alogconf);
+	if (log.init(datadir, name, type) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Open series failed %s/%s\n", datadir, name), 1);
+
+	auto stime = std::chrono::steady_clock::now();
+	std::vector<uint32_t> times;
+	std::vector<float> values;
+	times.reserve(BLOCKLEN);
+	values.reserve(BLOCKLEN);
+	size_t total = 0;
+	size_t lineno = 0;
+	auto flush = [&]() -> int {
+		if (times.empty())
+			return 0;
+		if (log.backfill(times.data(), values.data(), times.size()) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Backfill failed near input line/record " PL_SIZET "\n", total), -1);
+		total += times.size();
+		times.clear();
+		values.clear();
+		return 0;
+	};
+	if (binary)
+	{
+#pragma pack(push, 4)
+		struct Record
+		{
+			uint32_t time;
+			float value;
+		};
+#pragma pack(pop)
+		std::vector<Record> buf(BLOCKLEN);
+		size_t n;
+		while ((n = fread(buf.data(), sizeof(buf[0]), buf.size(), in)) > 0)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				times.push_back(buf[i].time);
+				values.push_back(buf[i].value);
+			}
+			if (flush() != 0)
+				return 1;
+		}
+	}
+	else
+	{
+		std::vector<char> buf(1 << 20);
+		size_t len = 0;	// data length in buf
+		bool eof = false;
+		while (!eof || len > 0)
+		{
+			if (!eof)
+			{
+				size_t n = fread(buf.data() + len, 1, buf.size() - 1 - len, in);
+				len += n;
+				eof = n == 0;
+			}
+			buf[len] = 0;
+			char *p = buf.data();
+			char *end = buf.data() + len;
+			while (p < end)
+			{
+				char *pe = (char *)memchr(p, '\n', end - p);
+				if (!pe && !eof)	// incomplete line, wait for more data
+					break;
+				if (pe)
+					*pe = 0;
+				++lineno;
+				while (*p == ' ' || *p == '\t')
+					++p;
+				if (*p && *p != '#' && *p != '\r')
+				{
+					char *pv = NULL;
+					unsigned long time = strtoul(p, &pv, 10);
+					while (*pv == ',' || *pv == ' ' || *pv == '\t')
+						++pv;
+					char *pn = NULL;
+					float value = strtof(pv, &pn);
+					if (pn == pv)
+						PELOG_ERROR_RETURN((PLV_ERROR, "Invalid input line " PL_SIZET "\n", lineno), 1);
+					times.push_back((uint32_t)time);
+					values.push_back(value);
+					if (times.size() >= BLOCKLEN && flush() != 0)
+						return 1;
+				}
+				p = pe ? pe + 1 : end;
+			}
+			if (p == buf.data() && len + 1 >= buf.size())
+				PELOG_ERROR_RETURN((PLV_ERROR, "Input line too long " PL_SIZET "\n", lineno + 1), 1);
+			len = end - p;
+			memmove(buf.data(), p, len);
+		}
+		if (flush() != 0)
+			return 1;
+	}
+	if (flush() != 0 || log.backfillend() != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Backfill failed %s/%s\n", datadir, name), 1);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - stime).count();
+	fprintf(stderr, "Backfilled " PL_SIZET " values in %.3fs (%.0f/s)\n", total, secs, secs > 0 ? total / secs : 0.0);
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define CRC32C_HW 1
+#	include <nmmintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78u
+
+static struct Crc32cTable
+{
+	uint32_t t[256];
+	Crc32cTable()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t crc = i;
+			for (int k = 0; k < 8; ++k)
+				crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+			t[i] = crc;
+		}
+	}
+} crc32c_table;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len > 0; --len, ++p)
+		crc = crc32c_table.t[(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+#	ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);	// p is not necessarily aligned
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t)crc64;
+#	endif
+	for (; len >= 4; len -= 4, p += 4)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	for (; len > 0; --len, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+static const bool crc32c_hwsupported = []() { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.2") != 0; }();
+#endif
+
+uint32_t crc32c(const void *data, size_t len, uint32_t crc/* = 0*/)
+{
+	crc = ~crc;
+#ifdef CRC32C_HW
+	if (crc32c_hwsupported)
+		return ~crc32c_hw(crc, (const uint8_t *)data, len);
+#endif
+	return ~crc32c_sw(crc, (const uint8_t *)data, len);
+}
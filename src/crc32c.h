@@ -0,0 +1,10 @@
+// CRC32C (Castagnoli) checksum
+// Uses the SSE4.2 crc32 instruction when the running CPU supports it, and falls back to a table driven
+// implementation otherwise. Chaining is supported: crc32c(b, nb, crc32c(a, na)) == crc32c(a+b, na+nb)
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0);
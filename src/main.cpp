@@ -1,21 +1,14 @@
 #include <stdio.h>
 #include "CollectdReceiver.h"
+#include "GraphiteReceiver.h"
+#include "StatsdReceiver.h"
+#include "InfluxReceiver.h"
 #include "GrafanaReader.h"
+#include "IOPool.h"
 #include "Alog.h"
 #include "libconfig/libconfig.h"
 #include "resguard.h"
 
-asio::io_service ioService;
-
-void sighdl(int code)
-{
-	if (code == SIGINT || code == SIGTERM || code == SIGABRT)
-	{
-		PELOG_LOG((PLV_INFO, "Stopping\n"));
-		ioService.stop();
-	}
-}
-
 int main(int argc, char **argv)
 {
 	config_t config;
@@ -35,19 +28,62 @@ int main(int argc, char **argv)
 
 	// AMon
 	std::string datadir = config_get_string(&config, "general.datadir", ".");
-	AMon amon(datadir.c_str());
-	amon.start();
+	std::unique_ptr<AMon> amon = AMon::byConfig(datadir.c_str(), &config);
+	if (!amon)
+		PELOG_ERROR_RETURN((PLV_ERROR, "AMon creation failed\n"), -1);
+	amon->start();
+
+	// I/O threads. by default CollectdReceiver runs on thread 0 (`io_threads`, one socket each) and GrafanaReader on the others, if any
+	std::unique_ptr<IOPool> iopool = IOPool::byConfig(&config);
+	if (!iopool)
+		PELOG_ERROR_RETURN((PLV_ERROR, "IOPool creation failed\n"), -1);
+	std::vector<int> grafanaidx;
+	for (size_t i = iopool->size() > 1 ? 1 : 0; i < iopool->size(); ++i)
+		grafanaidx.push_back((int)i);
 
 	std::vector<std::unique_ptr<Worker>> workers;
 	// CollectdReceiver
-	std::unique_ptr<Worker> collectd = CollectdReceiver::byConfig(
-		ioService, amon.gettaskq(), config_lookup(&config, "workers.CollectdReceiver"));
+	config_setting_t *collectdconf = config_lookup(&config, "workers.CollectdReceiver");
+	config_setting_t *collectdio = NULL;
+	if (collectdconf && !(collectdio = config_setting_lookup(collectdconf, "io_threads")))
+		collectdio = config_setting_lookup(collectdconf, "io_thread");
+	std::unique_ptr<CollectdReceiver> collectd = CollectdReceiver::byConfig(iopool->byindex(collectdio, {0}),
+		amon.get(), collectdconf);
 	if (!collectd)
 		PELOG_ERROR_RETURN((PLV_ERROR, "CollectdReceiver creation failed"), -1);
 	workers.push_back(std::move(collectd));
+	// GraphiteReceiver, if configured. on thread 0 by default, like CollectdReceiver
+	if (config_setting_t *graphiteconf = config_lookup(&config, "workers.GraphiteReceiver"))
+	{
+		std::unique_ptr<GraphiteReceiver> graphite = GraphiteReceiver::byConfig(
+			iopool->byindex(config_setting_lookup(graphiteconf, "io_threads"), {0}), amon.get(), graphiteconf);
+		if (!graphite)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GraphiteReceiver creation failed"), -1);
+		workers.push_back(std::move(graphite));
+	}
+	// StatsdReceiver, if configured. on thread 0 by default, one socket per thread
+	if (config_setting_t *statsdconf = config_lookup(&config, "workers.StatsdReceiver"))
+	{
+		std::unique_ptr<StatsdReceiver> statsd = StatsdReceiver::byConfig(
+			iopool->byindex(config_setting_lookup(statsdconf, "io_threads"), {0}), amon.get(), statsdconf);
+		if (!statsd)
+			PELOG_ERROR_RETURN((PLV_ERROR, "StatsdReceiver creation failed"), -1);
+		workers.push_back(std::move(statsd));
+	}
+	// InfluxReceiver, if configured. on thread 0 by default, connections spread over its threads
+	if (config_setting_t *influxconf = config_lookup(&config, "workers.InfluxReceiver"))
+	{
+		std::unique_ptr<InfluxReceiver> influx = InfluxReceiver::byConfig(
+			iopool->byindex(config_setting_lookup(influxconf, "io_threads"), {0}), amon.get(), influxconf);
+		if (!influx)
+			PELOG_ERROR_RETURN((PLV_ERROR, "InfluxReceiver creation failed"), -1);
+		workers.push_back(std::move(influx));
+	}
 	// GrafanaReader
+	config_setting_t *grafanaconf = config_lookup(&config, "workers.GrafanaReader");
 	std::unique_ptr<Worker> grafana = GrafanaReader::byConfig(
-		ioService, amon.gettaskq(), config_lookup(&config, "workers.GrafanaReader"));
+		iopool->byindex(grafanaconf ? config_setting_lookup(grafanaconf, "io_threads") : NULL, grafanaidx),
+		amon->gettaskq(), grafanaconf);
 	if (!grafana)
 		PELOG_ERROR_RETURN((PLV_ERROR, "GrafanaReader creation failed"), -1);
 	workers.push_back(std::move(grafana));
@@ -56,14 +92,18 @@ int main(int argc, char **argv)
 		worker->start();
 	}
 
-	signal(SIGINT, sighdl);
-	signal(SIGTERM, sighdl);
-	signal(SIGABRT, sighdl);
-	//signal(SIGUSR1, sighdl);
+	// wait for signals on the main thread, while the I/O threads run the workers
+	asio::io_service sigService;
+	asio::signal_set signals(sigService, SIGINT, SIGTERM, SIGABRT);
+	signals.async_wait([](const asio::error_code &error, int code) {
+		PELOG_LOG((PLV_INFO, "Stopping\n"));
+	});
 	signal(SIGHUP, SIG_IGN);
+	iopool->start();
 
-	ioService.run();
-	amon.stop();
+	sigService.run();
+	iopool->stop();
+	amon->stop();
 
 //	// **** DEBUG
 //	FILE *fp = fopen("data.dump", "rb");
@@ -264,6 +264,11 @@ int pelog_setlevel(int level, int *old_level)
 	return 0;
 }
 
+int pelog_getlevel()
+{
+	return pelog_logLevel;
+}
+
 int pelog_setlevel(const char *level, int *old_level)
 {
 	for(int i = 0; i < PLV_MAXLEVEL; ++i)
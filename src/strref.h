@@ -0,0 +1,22 @@
+// StrRef: a read only string in a buffer owned by others, e.g. a field of a received packet. like std::string_view
+// of C++17, with only what the parsers need
+
+#pragma once
+
+#include <string.h>
+#include <string>
+
+struct StrRef
+{
+	const char *data = NULL;
+	size_t size = 0;
+	StrRef() { }
+	StrRef(const char *data, size_t size): data(data), size(size) { }
+	bool empty() const { return size == 0; }
+	std::string str() const { return std::string(data, size); }
+	bool operator ==(const StrRef &r) const { return size == r.size && memcmp(data, r.data, size) == 0; }
+	bool operator !=(const StrRef &r) const { return !(*this == r); }
+	// compare with a null terminated string
+	bool operator ==(const char *s) const { return strncmp(data, s, size) == 0 && s[size] == 0; }
+	bool operator !=(const char *s) const { return !(*this == s); }
+};